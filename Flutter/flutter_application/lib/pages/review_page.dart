@@ -123,7 +123,8 @@ class _ReviewPageState extends ConsumerState<ReviewPage> {
     }
 
     final sensorState = ref.read(sensorProvider);
-    final samples = List.unmodifiable(sensorState.sampleBuffer);
+    // Already a snapshot, samples decoded later do not change it
+    final samples = sensorState.sampleBuffer;
     final droppedPackets = sensorState.droppedPackets;
 
     print(
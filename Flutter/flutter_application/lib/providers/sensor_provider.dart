@@ -1,9 +1,11 @@
 // lib/providers/sensor_provider.dart
 import 'dart:async';
+import 'dart:collection';
 import 'dart:convert';
 import 'dart:typed_data';
 import 'package:flutter_riverpod/flutter_riverpod.dart';
 import 'package:flutter_blue_plus/flutter_blue_plus.dart';
+import 'package:imu_decoder/imu_decoder.dart';
 
 /// Single IMU sample matching the embedded imu_sample_t struct
 /// With converted floating-point values in physical units
@@ -75,6 +77,126 @@ class BlePacket {
   BlePacket({required this.seqId, required this.samples});
 }
 
+/// Collected samples of one session as typed columns: time plus one column
+/// per sensor axis (sensor A/B, axis 0-2 accel X/Y/Z, 3-5 gyro X/Y/Z).
+/// Native decodes are copied in column by column, capacity doubles as it
+/// fills. Append only, so a [view] taken earlier keeps its samples.
+class ImuSampleColumns {
+  static const int sensors = 2;
+  static const int axes = 6;
+
+  int _length = 0;
+  Int32List _timeMs;
+  final List<Int16List> _raw; // [sensor * axes + axis]
+  final List<Float32List> _values;
+
+  ImuSampleColumns([int capacity = 1024])
+    : _timeMs = Int32List(capacity),
+      _raw = List.generate(sensors * axes, (_) => Int16List(capacity)),
+      _values = List.generate(sensors * axes, (_) => Float32List(capacity));
+
+  int get length => _length;
+
+  /// ms from session start (after RTT adjustment), [length] entries
+  Int32List get timeMs => Int32List.sublistView(_timeMs, 0, _length);
+
+  /// Register counts of one sensor axis, [length] entries
+  Int16List raw(int sensor, int axis) =>
+      Int16List.sublistView(_raw[sensor * axes + axis], 0, _length);
+
+  /// g (accel axes) or deg/s (gyro axes) of one sensor axis, [length] entries
+  Float32List values(int sensor, int axis) =>
+      Float32List.sublistView(_values[sensor * axes + axis], 0, _length);
+
+  /// The samples so far as a read-only list, [ImuSample]s are built on access
+  List<ImuSample> view() => ImuSampleView(this, _length);
+
+  void _reserve(int count) {
+    final needed = _length + count;
+    if (needed <= _timeMs.length) return;
+    int capacity = _timeMs.isEmpty ? 1024 : _timeMs.length * 2;
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+    _timeMs = Int32List(capacity)..setRange(0, _length, _timeMs);
+    for (int c = 0; c < _raw.length; c++) {
+      _raw[c] = Int16List(capacity)..setRange(0, _length, _raw[c]);
+      _values[c] = Float32List(capacity)..setRange(0, _length, _values[c]);
+    }
+  }
+
+  /// Append the first [count] samples of the last [ImuDecoder.decode],
+  /// shifting their times by [offsetMs]
+  void addDecoded(ImuDecoder decoder, int count, int offsetMs) {
+    _reserve(count);
+    final end = _length + count;
+    for (int i = 0; i < count; i++) {
+      _timeMs[_length + i] = decoder.timeUs[i] ~/ 1000 + offsetMs;
+    }
+    for (int s = 0; s < sensors; s++) {
+      for (int a = 0; a < axes; a++) {
+        _raw[s * axes + a].setRange(_length, end, decoder.raw(s, a));
+        _values[s * axes + a].setRange(_length, end, decoder.values(s, a));
+      }
+    }
+    _length = end;
+  }
+
+  /// Append one sample parsed in Dart
+  void add(ImuSample sample) {
+    _reserve(1);
+    final i = _length++;
+    _timeMs[i] = sample.timeOffset;
+    final raw = [sample.rawAccA, sample.rawGyroA, sample.rawAccB, sample.rawGyroB];
+    final values = [sample.accA, sample.gyroA, sample.accB, sample.gyroB];
+    for (int c = 0; c < _raw.length; c++) {
+      _raw[c][i] = raw[c ~/ 3][c % 3];
+      _values[c][i] = values[c ~/ 3][c % 3];
+    }
+  }
+
+  ImuSample sampleAt(int i) {
+    List<int> raw(int first) => [for (int c = first; c < first + 3; c++) _raw[c][i]];
+    List<double> values(int first) => [for (int c = first; c < first + 3; c++) _values[c][i]];
+    return ImuSample(
+      timeOffset: _timeMs[i],
+      rawAccA: raw(0),
+      rawGyroA: raw(3),
+      rawAccB: raw(6),
+      rawGyroB: raw(9),
+      accA: values(0),
+      gyroA: values(3),
+      accB: values(6),
+      gyroB: values(9),
+    );
+  }
+}
+
+/// First [length] samples of an [ImuSampleColumns], unaffected by later appends
+class ImuSampleView extends ListBase<ImuSample> {
+  final ImuSampleColumns columns;
+  final int _length;
+
+  ImuSampleView(this.columns, this._length);
+
+  @override
+  int get length => _length;
+
+  @override
+  ImuSample operator [](int index) {
+    RangeError.checkValidIndex(index, this, 'index', length);
+    return columns.sampleAt(index);
+  }
+
+  @override
+  void operator []=(int index, ImuSample value) =>
+      throw UnsupportedError('Cannot modify the sample buffer');
+
+  @override
+  set length(int newLength) =>
+      throw UnsupportedError('Cannot change the length of the sample buffer');
+}
+
 /// State for the sensor provider
 class SensorState {
   final bool isScanning;
@@ -83,7 +205,8 @@ class SensorState {
   final BluetoothDevice? device;
   final String statusMessage;
   final int? rttOffsetMs; // RTT/2 offset for time synchronization
-  final List<ImuSample> sampleBuffer;
+  final int pretriggerMs; // device timeline starts this long before "Start" (pre-trigger samples)
+  final List<ImuSample> sampleBuffer; // an ImuSampleView once samples arrive
   final int lastSeqId;
   final int droppedPackets;
 
@@ -94,6 +217,7 @@ class SensorState {
     this.device,
     this.statusMessage = 'Not connected',
     this.rttOffsetMs,
+    this.pretriggerMs = 0,
     this.sampleBuffer = const [],
     this.lastSeqId = -1,
     this.droppedPackets = 0,
@@ -106,6 +230,7 @@ class SensorState {
     BluetoothDevice? device,
     String? statusMessage,
     int? rttOffsetMs,
+    int? pretriggerMs,
     List<ImuSample>? sampleBuffer,
     int? lastSeqId,
     int? droppedPackets,
@@ -117,6 +242,7 @@ class SensorState {
       device: device ?? this.device,
       statusMessage: statusMessage ?? this.statusMessage,
       rttOffsetMs: rttOffsetMs ?? this.rttOffsetMs,
+      pretriggerMs: pretriggerMs ?? this.pretriggerMs,
       sampleBuffer: sampleBuffer ?? this.sampleBuffer,
       lastSeqId: lastSeqId ?? this.lastSeqId,
       droppedPackets: droppedPackets ?? this.droppedPackets,
@@ -144,6 +270,12 @@ class SensorNotifier extends Notifier<SensorState> {
   static const double accelSensitivity = 16384.0; // LSB/g for ±2g range
   static const double gyroSensitivity = 131.0; // LSB/(°/s) for ±250°/s range
 
+  // Notifications are decoded natively in batches of this interval where the
+  // imu_decoder library is built (Android, Linux, Windows)
+  static const Duration decodeInterval = Duration(milliseconds: 20);
+  // Wire format of the data notifications, the firmware default (no "Format:<n>")
+  static const int dataFormat = ImuFormat.legacy;
+
   BluetoothCharacteristic? _statusChar;
   BluetoothCharacteristic? _ackChar;
   BluetoothCharacteristic? _dataChar;
@@ -156,15 +288,24 @@ class SensorNotifier extends Notifier<SensorState> {
   DateTime? _startCommandTime;
   Completer<void>? _ackCompleter;
 
+  ImuDecoder? _decoder;
+  Timer? _decodeTimer;
+  ImuSampleColumns _samples = ImuSampleColumns();
+
   @override
   SensorState build() {
+    _decoder = ImuDecoder.tryCreate();
     ref.onDispose(() {
       _cleanup();
+      _decoder?.dispose();
+      _decoder = null;
     });
     return const SensorState();
   }
 
   void _cleanup() {
+    _decodeTimer?.cancel();
+    _decodeTimer = null;
     _scanSubscription?.cancel();
     _connectionSubscription?.cancel();
     _ackSubscription?.cancel();
@@ -325,10 +466,15 @@ class SensorNotifier extends Notifier<SensorState> {
 
     try {
       // Clear buffer for new session
+      _decodeTimer?.cancel();
+      _decodeTimer = null;
+      _decoder?.reset();
+      _samples = ImuSampleColumns();
       state = state.copyWith(
-        sampleBuffer: [],
+        sampleBuffer: const [],
         lastSeqId: -1,
         droppedPackets: 0,
+        pretriggerMs: 0,
         statusMessage: 'Starting recording...',
       );
 
@@ -363,6 +509,13 @@ class SensorNotifier extends Notifier<SensorState> {
   void _onAckReceived(List<int> value) {
     String ackStr = utf8.decode(value);
 
+    // Sent before the first data packet: sample times count from this long before "Start"
+    if (ackStr.startsWith('Pretriggered:')) {
+      final ms = int.tryParse(ackStr.substring('Pretriggered:'.length));
+      if (ms != null) state = state.copyWith(pretriggerMs: ms);
+      return;
+    }
+
     if (ackStr == 'ACK' && _startCommandTime != null && _ackCompleter != null) {
       final rtt = DateTime.now().difference(_startCommandTime!).inMilliseconds;
       final rttOffset = rtt ~/ 2;
@@ -379,6 +532,15 @@ class SensorNotifier extends Notifier<SensorState> {
   void _onDataReceived(List<int> value) {
     if (!state.isRecording) return;
 
+    final decoder = _decoder;
+    if (decoder != null) {
+      if (decoder.isFull(value.length)) _decodeQueued();
+      if (decoder.add(value)) {
+        _decodeTimer ??= Timer(decodeInterval, _decodeQueued);
+      }
+      return;
+    }
+
     try {
       final packet = _parsePacket(Uint8List.fromList(value));
 
@@ -389,11 +551,10 @@ class SensorNotifier extends Notifier<SensorState> {
       }
 
       // Add samples to buffer
-      final newBuffer = List<ImuSample>.from(state.sampleBuffer)
-        ..addAll(packet.samples);
+      packet.samples.forEach(_samples.add);
 
       state = state.copyWith(
-        sampleBuffer: newBuffer,
+        sampleBuffer: _samples.view(),
         lastSeqId: packet.seqId,
         droppedPackets: state.droppedPackets + dropped,
       );
@@ -403,6 +564,55 @@ class SensorNotifier extends Notifier<SensorState> {
     }
   }
 
+  /// Decode every queued notification in one native call and append the
+  /// samples to the buffer
+  void _decodeQueued() {
+    _decodeTimer?.cancel();
+    _decodeTimer = null;
+    final decoder = _decoder;
+    if (decoder == null) return;
+
+    final rtt = (state.rttOffsetMs ?? 0) - state.pretriggerMs;
+    final before = _samples.length;
+    int lastSeqId = state.lastSeqId;
+    int dropped = 0;
+
+    while (decoder.queued > 0) {
+      final n = decoder.decode(dataFormat);
+      lastSeqId = _countDrops(decoder.seqIds, n, lastSeqId, (d) => dropped += d);
+      // Angle packets carry no per-sensor samples for ImuSample
+      if (decoder.sensorCount < 2) continue;
+      _samples.addDecoded(decoder, n, rtt);
+    }
+
+    final added = _samples.length - before;
+    if (added == 0 && dropped == 0 && lastSeqId == state.lastSeqId) return;
+    state = state.copyWith(
+      sampleBuffer: added > 0 ? _samples.view() : null,
+      lastSeqId: lastSeqId,
+      droppedPackets: state.droppedPackets + dropped,
+    );
+  }
+
+  /// Walk the per-sample packet ids of a decode, report the gaps and return
+  /// the last id seen
+  int _countDrops(
+    Uint32List seqIds,
+    int n,
+    int lastSeqId,
+    void Function(int) onDropped,
+  ) {
+    for (int i = 0; i < n; i++) {
+      final seqId = seqIds[i];
+      if (seqId == lastSeqId) continue;
+      if (lastSeqId >= 0 && seqId > lastSeqId + 1) {
+        onDropped(seqId - lastSeqId - 1);
+      }
+      lastSeqId = seqId;
+    }
+    return lastSeqId;
+  }
+
   /// Parse raw BLE packet bytes into BlePacket
   BlePacket _parsePacket(Uint8List data) {
     // ble_packet_t: uint32_t seq_id + 3x imu_sample_t
@@ -429,7 +639,7 @@ class SensorNotifier extends Notifier<SensorState> {
       offset += 2;
 
       // Apply RTT offset for time synchronization
-      final adjustedTime = timeOffset + (state.rttOffsetMs ?? 0);
+      final adjustedTime = timeOffset + (state.rttOffsetMs ?? 0) - state.pretriggerMs;
 
       // acc_A[3] (int16 x 3, BIG ENDIAN - raw from MPU6050)
       final rawAccA = [
@@ -446,22 +656,6 @@ class SensorNotifier extends Notifier<SensorState> {
         byteData.getInt16(offset + 4, Endian.big),
       ];
 
-      // DEBUG: Print first few packets' raw values
-      if (seqId < 5 && i == 0) {
-        print('[SensorProvider] Packet $seqId Sample $i:');
-        print(
-          '  Raw Bytes at offset $offset: '
-          '${data.sublist(offset, offset + 6)}',
-        );
-        print('  Parsed GyroA (BigEndian): $rawGyroA');
-        print(
-          '  Parsed GyroA (LittleEndian): ['
-          '${byteData.getInt16(offset, Endian.little)}, '
-          '${byteData.getInt16(offset + 2, Endian.little)}, '
-          '${byteData.getInt16(offset + 4, Endian.little)}]',
-        );
-      }
-
       offset += 6;
 
       // acc_B[3] (int16 x 3, BIG ENDIAN - raw from MPU6050)
@@ -512,6 +706,7 @@ class SensorNotifier extends Notifier<SensorState> {
 
     try {
       await _statusChar!.write(utf8.encode('Stop'), withoutResponse: false);
+      _decodeQueued();
 
       state = state.copyWith(
         isRecording: false,
@@ -543,7 +738,8 @@ class SensorNotifier extends Notifier<SensorState> {
   //   ],
   //   "total_samples": 300,
   //   "dropped_packets": 0,
-  //   "rtt_offset_ms": 15
+  //   "rtt_offset_ms": 15,
+  //   "pretrigger_ms": 500
   //  }
   //
   // Conversion from raw int16 to physical units:
@@ -561,6 +757,7 @@ class SensorNotifier extends Notifier<SensorState> {
       'total_samples': state.sampleBuffer.length,
       'dropped_packets': state.droppedPackets,
       'rtt_offset_ms': state.rttOffsetMs,
+      'pretrigger_ms': state.pretriggerMs,
     };
   }
 
@@ -568,26 +765,35 @@ class SensorNotifier extends Notifier<SensorState> {
   /// Returns list of tuples: [(dict, timestamp_ms), ...]
   /// where dict has keys: xA, yA, zA, xB, yB, zB (gyro in °/s)
   List<Map<String, dynamic>> getSamplesForBackend() {
-    return state.sampleBuffer
-        .map(
-          (s) => {
-            'data': {
-              'xA': s.gyroA[0],
-              'yA': s.gyroA[1],
-              'zA': s.gyroA[2],
-              'xB': s.gyroB[0],
-              'yB': s.gyroB[1],
-              'zB': s.gyroB[2],
-            },
-            'timestamp_ms': s.timeOffset,
+    final buffer = state.sampleBuffer;
+    if (buffer is! ImuSampleView) return const [];
+    // Straight from the gyro columns, no ImuSample per row
+    final columns = buffer.columns;
+    final time = columns.timeMs;
+    final gyro = [
+      for (int s = 0; s < ImuSampleColumns.sensors; s++)
+        [for (int a = 3; a < ImuSampleColumns.axes; a++) columns.values(s, a)],
+    ];
+    return [
+      for (int i = 0; i < buffer.length; i++)
+        {
+          'data': {
+            'xA': gyro[0][0][i],
+            'yA': gyro[0][1][i],
+            'zA': gyro[0][2][i],
+            'xB': gyro[1][0][i],
+            'yB': gyro[1][1][i],
+            'zB': gyro[1][2][i],
           },
-        )
-        .toList();
+          'timestamp_ms': time[i],
+        },
+    ];
   }
 
   /// Clear the sample buffer
   void clearBuffer() {
-    state = state.copyWith(sampleBuffer: []);
+    _samples = ImuSampleColumns();
+    state = state.copyWith(sampleBuffer: const []);
   }
 
   /// Disconnect from device
@@ -8,6 +8,7 @@ list(APPEND FLUTTER_PLUGIN_LIST
 )
 
 list(APPEND FLUTTER_FFI_PLUGIN_LIST
+  imu_decoder
 )
 
 set(PLUGIN_BUNDLED_LIBRARIES)
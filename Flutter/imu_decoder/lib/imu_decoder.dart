@@ -0,0 +1,230 @@
+// lib/imu_decoder.dart
+import 'dart:ffi';
+import 'dart:io';
+import 'dart:typed_data';
+
+/// Wire formats selected with "Format:<n>" (IMU_FORMAT_* in
+/// NexHacks_Embedded/include/imu_packet.hpp)
+class ImuFormat {
+  static const int legacy = 0;
+  static const int batch = 1;
+  static const int delta = 2;
+  static const int timed = 3;
+  static const int angle = 4;
+  static const int multi = 5;
+}
+
+final class _Decoder extends Opaque {}
+
+typedef _CreateNative = Pointer<_Decoder> Function(Uint32, Uint32);
+typedef _Create = Pointer<_Decoder> Function(int, int);
+typedef _HandleNative = Void Function(Pointer<_Decoder>);
+typedef _Handle = void Function(Pointer<_Decoder>);
+typedef _SetRangesNative = Void Function(Pointer<_Decoder>, Uint8, Uint8);
+typedef _SetRanges = void Function(Pointer<_Decoder>, int, int);
+typedef _DecodeNative = Uint32 Function(Pointer<_Decoder>, Uint8, Uint32);
+typedef _Decode = int Function(Pointer<_Decoder>, int, int);
+typedef _U32Native = Uint32 Function(Pointer<_Decoder>);
+typedef _U8Native = Uint8 Function(Pointer<_Decoder>);
+typedef _Int = int Function(Pointer<_Decoder>);
+typedef _PtrNative<T extends NativeType> = Pointer<T> Function(Pointer<_Decoder>);
+
+class _Bindings {
+  final _Create create;
+  final _Handle destroy;
+  final _Handle reset;
+  final _SetRanges setRanges;
+  final _Decode decode;
+  final _Int inputCapacity;
+  final _Int sampleCount;
+  final _Int errorCount;
+  final _Int sensorCount;
+  final _PtrNative<Uint8> input;
+  final _PtrNative<Uint16> inputLengths;
+  final _PtrNative<Int64> timeUs;
+  final _PtrNative<Uint32> seqId;
+  final _PtrNative<Uint16> rateHz;
+  final _PtrNative<Int16> raw;
+  final _PtrNative<Float> value;
+  final _PtrNative<Int16> angleCdeg;
+  final _PtrNative<Uint8> confidence;
+
+  _Bindings(DynamicLibrary lib)
+    : create = lib.lookupFunction<_CreateNative, _Create>('imu_decoder_create'),
+      destroy = lib.lookupFunction<_HandleNative, _Handle>('imu_decoder_destroy'),
+      reset = lib.lookupFunction<_HandleNative, _Handle>('imu_decoder_reset'),
+      setRanges = lib.lookupFunction<_SetRangesNative, _SetRanges>('imu_decoder_set_ranges'),
+      decode = lib.lookupFunction<_DecodeNative, _Decode>('imu_decoder_decode'),
+      inputCapacity = lib.lookupFunction<_U32Native, _Int>('imu_decoder_input_capacity'),
+      sampleCount = lib.lookupFunction<_U32Native, _Int>('imu_decoder_sample_count'),
+      errorCount = lib.lookupFunction<_U32Native, _Int>('imu_decoder_error_count'),
+      sensorCount = lib.lookupFunction<_U8Native, _Int>('imu_decoder_sensor_count'),
+      input = lib.lookupFunction<_PtrNative<Uint8>, _PtrNative<Uint8>>('imu_decoder_input'),
+      inputLengths = lib.lookupFunction<_PtrNative<Uint16>, _PtrNative<Uint16>>('imu_decoder_input_lengths'),
+      timeUs = lib.lookupFunction<_PtrNative<Int64>, _PtrNative<Int64>>('imu_decoder_time_us'),
+      seqId = lib.lookupFunction<_PtrNative<Uint32>, _PtrNative<Uint32>>('imu_decoder_seq_id'),
+      rateHz = lib.lookupFunction<_PtrNative<Uint16>, _PtrNative<Uint16>>('imu_decoder_rate_hz'),
+      raw = lib.lookupFunction<_PtrNative<Int16>, _PtrNative<Int16>>('imu_decoder_raw'),
+      value = lib.lookupFunction<_PtrNative<Float>, _PtrNative<Float>>('imu_decoder_value'),
+      angleCdeg = lib.lookupFunction<_PtrNative<Int16>, _PtrNative<Int16>>('imu_decoder_angle_cdeg'),
+      confidence = lib.lookupFunction<_PtrNative<Uint8>, _PtrNative<Uint8>>('imu_decoder_confidence');
+}
+
+/// Batch decoder backed by the imu_decoder native library.
+///
+/// Queue notifications with [add], decode them with one [decode] call, then read
+/// the samples from the struct-of-arrays views: [timeUs], [seqIds], and per
+/// sensor/axis [raw] and [values] (axis 0-2 accel X/Y/Z, 3-5 gyro X/Y/Z).
+/// The views point into native memory, are overwritten by the next [decode]
+/// and are only valid for [sampleCount] entries.
+class ImuDecoder {
+  static const int maxSensors = 8;
+  static const int axes = 6;
+  /// Longest packet the native decoder accepts (IMU_DECODER_MAX_PACKET)
+  static const int maxPacketBytes = 253;
+
+  static _Bindings? _bindings;
+  static bool _loadFailed = false;
+
+  final _Bindings _b;
+  final Pointer<_Decoder> _handle;
+  final int capacity;
+  final int maxPackets;
+
+  late final Uint8List _input;
+  late final Uint16List _inputLengths;
+  late final Int64List timeUs;
+  late final Uint32List seqIds;
+
+  /// Capture rate of each sample's packet with the adaptive sample rate
+  /// ("Adaptive:1"), 0 = the session's configured rate
+  late final Uint16List rateHz;
+  late final Int16List _raw;
+  late final Float32List _values;
+  late final Int16List angleCdeg;
+  late final Uint8List confidence;
+
+  int _queued = 0;
+  int _queuedBytes = 0;
+  int _lastSamples = 0;
+
+  ImuDecoder._(this._b, this._handle, this.capacity, this.maxPackets) {
+    _input = _b.input(_handle).asTypedList(_b.inputCapacity(_handle));
+    _inputLengths = _b.inputLengths(_handle).asTypedList(maxPackets);
+    timeUs = _b.timeUs(_handle).asTypedList(capacity);
+    seqIds = _b.seqId(_handle).asTypedList(capacity);
+    rateHz = _b.rateHz(_handle).asTypedList(capacity);
+    _raw = _b.raw(_handle).asTypedList(capacity * maxSensors * axes);
+    _values = _b.value(_handle).asTypedList(capacity * maxSensors * axes);
+    angleCdeg = _b.angleCdeg(_handle).asTypedList(capacity);
+    confidence = _b.confidence(_handle).asTypedList(capacity);
+  }
+
+  /// Decoder for up to [maxPackets] packets / [capacity] samples per [decode],
+  /// or null where the native library is not built (iOS, macOS, web)
+  static ImuDecoder? tryCreate({int capacity = 4096, int maxPackets = 256}) {
+    final bindings = _load();
+    if (bindings == null) return null;
+    final handle = bindings.create(capacity, maxPackets);
+    if (handle == nullptr) return null;
+    return ImuDecoder._(bindings, handle, capacity, maxPackets);
+  }
+
+  static _Bindings? _load() {
+    if (_bindings != null || _loadFailed) return _bindings;
+    try {
+      final DynamicLibrary lib;
+      if (Platform.isAndroid || Platform.isLinux) {
+        lib = DynamicLibrary.open('libimu_decoder.so');
+      } else if (Platform.isWindows) {
+        lib = DynamicLibrary.open('imu_decoder.dll');
+      } else {
+        _loadFailed = true;
+        return null;
+      }
+      _bindings = _Bindings(lib);
+    } catch (_) {
+      _loadFailed = true;
+    }
+    return _bindings;
+  }
+
+  /// Packets queued since the last [decode]
+  int get queued => _queued;
+
+  /// True when [add] would not fit another packet of [length] bytes
+  bool isFull(int length) =>
+      _queued >= maxPackets || _queuedBytes + length > _input.length;
+
+  /// Copy one notification into the native input buffer. Returns false if it is
+  /// too long or the input is full (call [decode] first).
+  bool add(List<int> packet) {
+    if (packet.length > maxPacketBytes || isFull(packet.length)) return false;
+    _input.setRange(_queuedBytes, _queuedBytes + packet.length, packet);
+    _inputLengths[_queued++] = packet.length;
+    _queuedBytes += packet.length;
+    return true;
+  }
+
+  /// Decode the queued packets as [format]. Returns the number of samples; if
+  /// they did not all fit, the rest stay queued for the next call.
+  int decode(int format) {
+    if (_queued == 0) {
+      _lastSamples = 0;
+      return 0;
+    }
+    final consumed = _b.decode(_handle, format, _queued);
+    if (consumed == 0 || consumed == _queued) {
+      // All decoded, or a packet with more samples than [capacity]: drop the queue
+      _queuedBytes = 0;
+      _queued = 0;
+    } else {
+      // Move the packets that did not fit to the front of the input
+      int offset = 0;
+      for (int i = 0; i < consumed; i++) {
+        offset += _inputLengths[i];
+      }
+      _input.setRange(0, _queuedBytes - offset, _input, offset);
+      _inputLengths.setRange(0, _queued - consumed, _inputLengths, consumed);
+      _queuedBytes -= offset;
+      _queued -= consumed;
+    }
+    _lastSamples = _b.sampleCount(_handle);
+    return _lastSamples;
+  }
+
+  /// Samples produced by the last [decode]
+  int get sampleCount => _lastSamples;
+
+  /// Malformed packets skipped by the last [decode]
+  int get errorCount => _b.errorCount(_handle);
+
+  /// Sensors per sample in the last [decode]: 2, the packets' own count for
+  /// [ImuFormat.multi], 0 for [ImuFormat.angle] (angles only)
+  int get sensorCount => _b.sensorCount(_handle);
+
+  /// Register counts of one sensor axis, [sampleCount] valid entries
+  Int16List raw(int sensor, int axis) {
+    final start = (sensor * axes + axis) * capacity;
+    return Int16List.sublistView(_raw, start, start + capacity);
+  }
+
+  /// g (accel axes) or deg/s (gyro axes) of one sensor axis
+  Float32List values(int sensor, int axis) {
+    final start = (sensor * axes + axis) * capacity;
+    return Float32List.sublistView(_values, start, start + capacity);
+  }
+
+  /// Start of a session: drop queued packets and the timestamp unwrapping state
+  void reset() {
+    _queued = 0;
+    _queuedBytes = 0;
+    _lastSamples = 0;
+    _b.reset(_handle);
+  }
+
+  /// Session ranges (AFS_SEL / FS_SEL, 0..3) used for [values]
+  void setRanges(int accelFs, int gyroFs) => _b.setRanges(_handle, accelFs, gyroFs);
+
+  void dispose() => _b.destroy(_handle);
+}
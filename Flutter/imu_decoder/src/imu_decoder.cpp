@@ -0,0 +1,311 @@
+#include "imu_decoder.h"
+
+#include <cstring>
+#include <new>
+#include <vector>
+
+// Wire formats come straight from the firmware so app and device cannot drift apart.
+// Those headers use GCC's packed attribute; MSVC (the Windows runner) gets the same
+// layout from pragma pack, and the static_asserts in imu_packet.hpp check it.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define __attribute__(x)
+#pragma pack(push, 1)
+#endif
+#include "imu_packet.hpp"
+#include "imu_codec.hpp"
+#if defined(_MSC_VER) && !defined(__clang__)
+#pragma pack(pop)
+#undef __attribute__
+#endif
+
+static_assert(IMU_DECODER_MAX_PACKET == IMU_BATCH_HEADER_SIZE + IMU_BATCH_MAX_PAYLOAD,
+              "IMU_DECODER_MAX_PACKET must match the firmware's largest packet");
+
+#define LEGACY_SAMPLES              3
+#define ACCEL_LSB_PER_G             16384.0f // AFS_SEL 0, halves per step
+#define GYRO_LSB_PER_DPS            131.0f   // FS_SEL 0, halves per step
+
+struct imu_decoder {
+  uint32_t capacity;
+  uint32_t max_packets;
+
+  std::vector<uint8_t> input;
+  std::vector<uint16_t> input_lengths;
+
+  std::vector<int64_t> time_us;
+  std::vector<uint32_t> seq_id;
+  std::vector<uint16_t> rate_hz;
+  std::vector<int16_t> raw;      // IMU_DECODER_CHANNELS x capacity
+  std::vector<float> value;      // IMU_DECODER_CHANNELS x capacity
+  std::vector<int16_t> angle_cdeg;
+  std::vector<uint8_t> confidence;
+
+  // Register words of one packet, sample-major, byte swapped in one flat pass
+  uint16_t stage[UINT8_MAX * IMU_DECODER_CHANNELS];
+
+  float accel_scale;
+  float gyro_scale;
+
+  // Timestamps are 16-bit ms or 32-bit µs on air. Unwrapping by signed difference to the
+  // last one keeps retransmitted (older) packets on the right side of a wrap.
+  bool have_ms;
+  int64_t last_ms;
+  bool have_us;
+  int64_t last_us;
+
+  uint32_t count;
+  uint32_t errors;
+  uint8_t sensor_count;
+  uint8_t last_format;
+};
+
+static int64_t unwrap_ms(imu_decoder_t* d, uint16_t ms) {
+  if (!d->have_ms) {
+    d->have_ms = true;
+    d->last_ms = ms;
+  }
+  d->last_ms += (int16_t)(uint16_t)(ms - (uint16_t)d->last_ms);
+  return d->last_ms;
+}
+
+static int64_t unwrap_us(imu_decoder_t* d, uint32_t us) {
+  if (!d->have_us) {
+    d->have_us = true;
+    d->last_us = us;
+  }
+  d->last_us += (int32_t)(uint32_t)(us - (uint32_t)d->last_us);
+  return d->last_us;
+}
+
+static uint16_t le16(const uint8_t* p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+// Copy the 12 register words of an imu_sample_t (everything after time_offset) into the stage
+static void stage_sample(imu_decoder_t* d, int index, const imu_sample_t* sample) {
+  memcpy(&d->stage[index * 2 * IMU_DECODER_AXES], sample->acc_A, 2 * IMU_DECODER_AXES * sizeof(uint16_t));
+}
+
+/**
+ * @brief Byte swap the staged words and scatter them into the channel arrays at d->count
+ */
+static void flush_stage(imu_decoder_t* d, int samples, int sensors) {
+  int channels = sensors * IMU_DECODER_AXES;
+  int words = samples * channels;
+
+  // Flat loop without dependencies, the compiler turns it into vector shifts/ors
+  uint16_t* w = d->stage;
+  for (int k = 0; k < words; k++) w[k] = (uint16_t)((w[k] >> 8) | (w[k] << 8));
+
+  for (int c = 0; c < channels; c++) {
+    int16_t* raw = &d->raw[(size_t)c * d->capacity + d->count];
+    float* value = &d->value[(size_t)c * d->capacity + d->count];
+    float scale = (c % IMU_DECODER_AXES) < 3 ? d->accel_scale : d->gyro_scale;
+    for (int i = 0; i < samples; i++) raw[i] = (int16_t)w[i * channels + c];
+    for (int i = 0; i < samples; i++) value[i] = raw[i] * scale;
+  }
+  if (sensors > d->sensor_count) d->sensor_count = (uint8_t)sensors;
+}
+
+/**
+ * @brief Samples a packet will produce, -1 if it is malformed
+ */
+static int packet_samples(uint8_t format, const uint8_t* bytes, size_t length) {
+  if (format == IMU_FORMAT_LEGACY) return length >= sizeof(ble_packet_t) ? LEGACY_SAMPLES : -1;
+  if (length < IMU_BATCH_HEADER_SIZE || length > IMU_BATCH_HEADER_SIZE + IMU_BATCH_MAX_PAYLOAD) return -1;
+
+  size_t payload = length - IMU_BATCH_HEADER_SIZE;
+  uint8_t count = bytes[1];
+  switch (imu_version_format(bytes[0])) {
+    case IMU_FORMAT_LEGACY:
+    case IMU_FORMAT_BATCH:
+      return count * sizeof(imu_sample_t) <= payload ? count : -1;
+    case IMU_FORMAT_DELTA:
+      return count;
+    case IMU_FORMAT_TIMED:
+      return payload >= IMU_TIMED_BASE_SIZE &&
+             count * sizeof(imu_sample_t) <= payload - IMU_TIMED_BASE_SIZE ? count : -1;
+    case IMU_FORMAT_ANGLE:
+      return payload >= IMU_TIMED_BASE_SIZE &&
+             count * sizeof(imu_angle_sample_t) <= payload - IMU_TIMED_BASE_SIZE ? count : -1;
+    case IMU_FORMAT_MULTI: {
+      if (payload < IMU_MULTI_BASE_SIZE) return -1;
+      uint8_t sensors = bytes[IMU_BATCH_HEADER_SIZE];
+      if (sensors < 1 || sensors > IMU_DECODER_MAX_SENSORS) return -1;
+      return (size_t)count * IMU_MULTI_SAMPLE_SIZE(sensors) <= payload - IMU_MULTI_BASE_SIZE ? count : -1;
+    }
+    default:
+      return -1;
+  }
+}
+
+/**
+ * @brief Decode one validated packet of n samples at d->count
+ */
+static bool decode_packet(imu_decoder_t* d, uint8_t format, const uint8_t* bytes, size_t length, int n) {
+  ble_batch_packet_t packet;
+  memset(&packet, 0, IMU_BATCH_HEADER_SIZE);
+  if (format == IMU_FORMAT_LEGACY) {
+    // No header on air: the bytes are the part of ble_batch_packet_t from seq_id on
+    memcpy((uint8_t*)&packet + IMU_LEGACY_OFFSET, bytes, sizeof(ble_packet_t));
+    packet.version = IMU_FORMAT_LEGACY;
+    packet.sample_count = LEGACY_SAMPLES;
+  } else {
+    memcpy(&packet, bytes, length);
+  }
+  size_t payload_length = length - (format == IMU_FORMAT_LEGACY ? 0 : IMU_BATCH_HEADER_SIZE);
+  uint8_t packet_format = imu_version_format(packet.version);
+  uint16_t rate_hz = imu_version_rate_hz(packet.version);
+  d->last_format = packet_format;
+
+  int64_t* time_us = &d->time_us[d->count];
+  for (int i = 0; i < n; i++) {
+    d->seq_id[d->count + i] = packet.seq_id;
+    d->rate_hz[d->count + i] = rate_hz;
+  }
+
+  switch (packet_format) {
+    case IMU_FORMAT_LEGACY:
+    case IMU_FORMAT_BATCH:
+      for (int i = 0; i < n; i++) {
+        time_us[i] = unwrap_ms(d, packet.samples[i].time_offset) * 1000;
+        stage_sample(d, i, &packet.samples[i]);
+      }
+      flush_stage(d, n, 2);
+      return true;
+
+    case IMU_FORMAT_DELTA: {
+      imu_sample_t samples[UINT8_MAX];
+      if (imu_delta_decode(packet.payload, payload_length, packet.sample_count, samples, UINT8_MAX) != n) return false;
+      for (int i = 0; i < n; i++) {
+        time_us[i] = unwrap_ms(d, samples[i].time_offset) * 1000;
+        stage_sample(d, i, &samples[i]);
+      }
+      flush_stage(d, n, 2);
+      return true;
+    }
+
+    case IMU_FORMAT_TIMED: {
+      int64_t t = unwrap_us(d, packet.timed.base_us);
+      for (int i = 0; i < n; i++) {
+        if (i > 0) t += packet.timed.samples[i].time_offset;
+        time_us[i] = t;
+        stage_sample(d, i, &packet.timed.samples[i]);
+      }
+      flush_stage(d, n, 2);
+      return true;
+    }
+
+    case IMU_FORMAT_ANGLE: {
+      int64_t t = unwrap_us(d, packet.angle.base_us);
+      for (int i = 0; i < n; i++) {
+        const imu_angle_sample_t* s = &packet.angle.samples[i];
+        if (i > 0) t += s->time_offset;
+        time_us[i] = t;
+        d->angle_cdeg[d->count + i] = s->angle_cdeg;
+        d->confidence[d->count + i] = s->confidence;
+      }
+      return true;
+    }
+
+    case IMU_FORMAT_MULTI: {
+      int sensors = packet.multi.sensor_count;
+      size_t sample_size = IMU_MULTI_SAMPLE_SIZE(sensors);
+      int64_t t = unwrap_us(d, packet.multi.base_us);
+      for (int i = 0; i < n; i++) {
+        const uint8_t* in = &packet.multi.data[i * sample_size];
+        if (i > 0) t += le16(in);
+        time_us[i] = t;
+        memcpy(&d->stage[i * sensors * IMU_DECODER_AXES], in + 2, sensors * IMU_SENSOR_BYTES);
+      }
+      flush_stage(d, n, sensors);
+      return true;
+    }
+  }
+  return false;
+}
+
+extern "C" {
+
+imu_decoder_t* imu_decoder_create(uint32_t capacity, uint32_t max_packets) {
+  if (capacity == 0 || max_packets == 0) return nullptr;
+  imu_decoder_t* d = new (std::nothrow) imu_decoder_t();
+  if (d == nullptr) return nullptr;
+  d->capacity = capacity;
+  d->max_packets = max_packets;
+  d->input.resize((size_t)max_packets * IMU_DECODER_MAX_PACKET);
+  d->input_lengths.resize(max_packets);
+  d->time_us.resize(capacity);
+  d->seq_id.resize(capacity);
+  d->rate_hz.resize(capacity);
+  d->raw.resize((size_t)IMU_DECODER_CHANNELS * capacity);
+  d->value.resize((size_t)IMU_DECODER_CHANNELS * capacity);
+  d->angle_cdeg.resize(capacity);
+  d->confidence.resize(capacity);
+  imu_decoder_set_ranges(d, 0, 0);
+  imu_decoder_reset(d);
+  return d;
+}
+
+void imu_decoder_destroy(imu_decoder_t* decoder) {
+  delete decoder;
+}
+
+void imu_decoder_reset(imu_decoder_t* decoder) {
+  decoder->have_ms = false;
+  decoder->have_us = false;
+  decoder->count = 0;
+  decoder->errors = 0;
+  decoder->sensor_count = 0;
+  decoder->last_format = IMU_FORMAT_LEGACY;
+}
+
+void imu_decoder_set_ranges(imu_decoder_t* decoder, uint8_t accel_fs, uint8_t gyro_fs) {
+  decoder->accel_scale = (float)(1 << (accel_fs & 3)) / ACCEL_LSB_PER_G;
+  decoder->gyro_scale = (float)(1 << (gyro_fs & 3)) / GYRO_LSB_PER_DPS;
+}
+
+uint8_t* imu_decoder_input(imu_decoder_t* decoder) { return decoder->input.data(); }
+uint16_t* imu_decoder_input_lengths(imu_decoder_t* decoder) { return decoder->input_lengths.data(); }
+uint32_t imu_decoder_input_capacity(imu_decoder_t* decoder) { return (uint32_t)decoder->input.size(); }
+
+uint32_t imu_decoder_decode(imu_decoder_t* decoder, uint8_t format, uint32_t packet_count) {
+  imu_decoder_t* d = decoder;
+  d->count = 0;
+  d->errors = 0;
+  d->sensor_count = 0;
+  if (packet_count > d->max_packets) packet_count = d->max_packets;
+
+  // Packets sit back to back in the input, each taking its own length
+  const uint8_t* bytes = d->input.data();
+  uint32_t consumed = 0;
+  for (; consumed < packet_count; consumed++) {
+    size_t length = d->input_lengths[consumed];
+    const uint8_t* packet = bytes;
+    int n = packet_samples(format, packet, length); // also rejects anything over IMU_DECODER_MAX_PACKET
+    if (n >= 0 && d->count + (uint32_t)n > d->capacity) break; // rest goes in the next call
+    bytes += length;
+
+    if (n < 0 || !decode_packet(d, format, packet, length, n)) {
+      d->errors++;
+      continue;
+    }
+    d->count += n;
+  }
+  return consumed;
+}
+
+uint32_t imu_decoder_sample_count(imu_decoder_t* decoder) { return decoder->count; }
+uint32_t imu_decoder_error_count(imu_decoder_t* decoder) { return decoder->errors; }
+uint8_t imu_decoder_sensor_count(imu_decoder_t* decoder) { return decoder->sensor_count; }
+uint8_t imu_decoder_last_format(imu_decoder_t* decoder) { return decoder->last_format; }
+
+int64_t* imu_decoder_time_us(imu_decoder_t* decoder) { return decoder->time_us.data(); }
+uint32_t* imu_decoder_seq_id(imu_decoder_t* decoder) { return decoder->seq_id.data(); }
+uint16_t* imu_decoder_rate_hz(imu_decoder_t* decoder) { return decoder->rate_hz.data(); }
+int16_t* imu_decoder_raw(imu_decoder_t* decoder) { return decoder->raw.data(); }
+float* imu_decoder_value(imu_decoder_t* decoder) { return decoder->value.data(); }
+int16_t* imu_decoder_angle_cdeg(imu_decoder_t* decoder) { return decoder->angle_cdeg.data(); }
+uint8_t* imu_decoder_confidence(imu_decoder_t* decoder) { return decoder->confidence.data(); }
+
+}
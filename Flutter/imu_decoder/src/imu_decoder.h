@@ -0,0 +1,77 @@
+#ifndef IMU_DECODER_H
+#define IMU_DECODER_H
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define FFI_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define FFI_PLUGIN_EXPORT __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Batch decoder for the IMU notifications of the SmartPT device (every IMU_FORMAT_* in
+// NexHacks_Embedded/include/imu_packet.hpp). Packets are copied into the decoder's input
+// buffer, decoded in one call, and the samples land in preallocated struct-of-arrays
+// outputs that Dart maps once as typed lists. Nothing is allocated per packet.
+//
+// Channel c of the raw/value outputs is sensor c / 6, axis c % 6: accel X, Y, Z then
+// gyro X, Y, Z. Each output array holds `capacity` samples; sample i of channel c is at
+// [c * capacity + i]. Outputs are overwritten by every decode call.
+//
+// NexHacks_Embedded/bench/decoder_check.cpp runs this decoder on the host against packets built
+// by the firmware's packet_builder.hpp, every format included.
+
+#define IMU_DECODER_MAX_SENSORS     8
+#define IMU_DECODER_AXES            6     // accel XYZ, gyro XYZ
+#define IMU_DECODER_CHANNELS        (IMU_DECODER_MAX_SENSORS * IMU_DECODER_AXES)
+// Longest packet accepted: batch header + IMU_BATCH_MAX_PAYLOAD at the firmware's preferred MTU
+// of 256. L2CAP frames carry the same packets behind their length prefix, split them first.
+#define IMU_DECODER_MAX_PACKET      253
+
+typedef struct imu_decoder imu_decoder_t;
+
+// capacity: samples per decode call, max_packets: packets per decode call
+FFI_PLUGIN_EXPORT imu_decoder_t* imu_decoder_create(uint32_t capacity, uint32_t max_packets);
+FFI_PLUGIN_EXPORT void imu_decoder_destroy(imu_decoder_t* decoder);
+
+// Start of a session: forget the timestamp unwrapping state
+FFI_PLUGIN_EXPORT void imu_decoder_reset(imu_decoder_t* decoder);
+// Full-scale selections of the session (GYRO_CONFIG.FS_SEL / ACCEL_CONFIG.AFS_SEL, 0..3) for the values
+FFI_PLUGIN_EXPORT void imu_decoder_set_ranges(imu_decoder_t* decoder, uint8_t accel_fs, uint8_t gyro_fs);
+
+// Input: packet bytes back to back, lengths[i] bytes for packet i. The byte buffer holds
+// input_capacity bytes, the lengths max_packets entries.
+FFI_PLUGIN_EXPORT uint8_t* imu_decoder_input(imu_decoder_t* decoder);
+FFI_PLUGIN_EXPORT uint16_t* imu_decoder_input_lengths(imu_decoder_t* decoder);
+FFI_PLUGIN_EXPORT uint32_t imu_decoder_input_capacity(imu_decoder_t* decoder);
+
+// Decode the first packet_count input packets. format is the IMU_FORMAT_* selected with
+// "Format:<n>": IMU_FORMAT_LEGACY packets have no header, every other packet carries its
+// own version byte. Returns the packets consumed, fewer than packet_count only when the
+// sample capacity ran out (decode the rest in the next call).
+FFI_PLUGIN_EXPORT uint32_t imu_decoder_decode(imu_decoder_t* decoder, uint8_t format, uint32_t packet_count);
+
+// Results of the last decode call
+FFI_PLUGIN_EXPORT uint32_t imu_decoder_sample_count(imu_decoder_t* decoder);
+FFI_PLUGIN_EXPORT uint32_t imu_decoder_error_count(imu_decoder_t* decoder);  // malformed packets skipped
+FFI_PLUGIN_EXPORT uint8_t imu_decoder_sensor_count(imu_decoder_t* decoder);  // 2, MULTI: its count, ANGLE: 0
+FFI_PLUGIN_EXPORT uint8_t imu_decoder_last_format(imu_decoder_t* decoder);
+
+// Outputs, capacity entries per array (per channel for raw/value)
+FFI_PLUGIN_EXPORT int64_t* imu_decoder_time_us(imu_decoder_t* decoder);    // since session start, unwrapped
+FFI_PLUGIN_EXPORT uint32_t* imu_decoder_seq_id(imu_decoder_t* decoder);    // packet of each sample
+FFI_PLUGIN_EXPORT uint16_t* imu_decoder_rate_hz(imu_decoder_t* decoder);   // capture rate tag, 0 = configured rate
+FFI_PLUGIN_EXPORT int16_t* imu_decoder_raw(imu_decoder_t* decoder);        // register counts
+FFI_PLUGIN_EXPORT float* imu_decoder_value(imu_decoder_t* decoder);        // g / deg/s
+FFI_PLUGIN_EXPORT int16_t* imu_decoder_angle_cdeg(imu_decoder_t* decoder); // IMU_FORMAT_ANGLE only
+FFI_PLUGIN_EXPORT uint8_t* imu_decoder_confidence(imu_decoder_t* decoder); // IMU_FORMAT_ANGLE only
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,329 @@
+// Host check for the app's native decoder (Flutter/imu_decoder/src/imu_decoder.cpp).
+//
+// Builds every wire format with packet_builder.hpp from the replay_bench mock source, queues the
+// packets the way lib/imu_decoder.dart does (re-queueing what a full decode left over) and checks
+// every decoded sample against its input: registers, values, seq_id and the unwrapped timestamps.
+// The session starts 10 s before the 32-bit µs wrap and runs past a 16-bit ms wrap. Truncated,
+// oversized and unknown packets must be skipped and counted without losing the packets after them.
+//
+// Build (from NexHacks_Embedded):
+//   g++ -O2 -std=c++17 -Wall -Wextra -Iinclude -I../Flutter/imu_decoder/src bench/decoder_check.cpp ../Flutter/imu_decoder/src/imu_decoder.cpp -o decoder_check
+//
+// Usage:
+//   ./decoder_check
+// Exits non-zero if any check fails.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include "imu_packet.hpp"
+#include "packet_builder.hpp"
+#include "replay_source.hpp"
+#include "imu_decoder.h"
+
+#define CHECK_SECONDS               80.0  // past one ms wrap (every 65.536 s)
+#define CHECK_RATE_HZ               100
+#define CHECK_START_US              (0x100000000ULL - 10000000ULL) // µs base_us wraps 10 s in
+#define CHECK_CAPACITY              150   // samples per decode call, below CHECK_MAX_PACKETS legacy packets
+#define CHECK_MAX_PACKETS           64    // ImuDecoder.tryCreate uses 256, smaller splits more often
+
+static int failures = 0;
+
+#define EXPECT(cond, ...) do {                      \
+    if (!(cond)) {                                  \
+      printf("  FAIL %s:%d: ", __FILE__, __LINE__); \
+      printf(__VA_ARGS__);                          \
+      printf("\n");                                 \
+      failures++;                                   \
+      return false;                                 \
+    }                                               \
+  } while (0)
+
+static const char* format_name(uint8_t format) {
+  switch (format) {
+    case IMU_FORMAT_LEGACY: return "LEGACY";
+    case IMU_FORMAT_BATCH:  return "BATCH";
+    case IMU_FORMAT_DELTA:  return "DELTA";
+    case IMU_FORMAT_TIMED:  return "TIMED";
+    case IMU_FORMAT_ANGLE:  return "ANGLE";
+    case IMU_FORMAT_MULTI:  return "MULTI";
+  }
+  return "?";
+}
+
+// The bytes ble_task notifies for a packet (notify_bytes in BLE.cpp)
+static std::vector<uint8_t> wire_bytes(const ble_batch_packet_t* packet) {
+  const uint8_t* bytes = (const uint8_t*)packet;
+  if (packet->version == IMU_FORMAT_LEGACY) bytes += IMU_LEGACY_OFFSET;
+  return std::vector<uint8_t>(bytes, bytes + packet_builder_wire_size(packet));
+}
+
+// Samples of one built packet, for mapping decoded samples back to their source
+typedef struct {
+  uint32_t seq_id;
+  size_t first;   // index into the session
+  const ble_batch_packet_t* packet;
+} built_packet_t;
+
+// Where the decoded stream is: packet and sample within it
+typedef struct {
+  size_t packet;      // index into the built packets, seq_id starts at 0 and nothing is dropped
+  int position;
+  size_t samples;     // session samples seen so far
+  int64_t first_time_us;
+} decode_cursor_t;
+
+/**
+ * @brief Run the session through packet_builder at MTU 256 in one format
+ */
+static void build_packets(uint8_t format, int sensors, const std::vector<replay_sample_t>& session,
+                          std::vector<ble_batch_packet_t>& slots, std::vector<built_packet_t>& built) {
+  slots.assign(session.size() + 1, ble_batch_packet_t());
+  mock_link_t link;
+  link.format = format;
+  link.payload_capacity = IMU_BATCH_MAX_PAYLOAD;
+  link.slots = slots.data();
+  link.slot_count = slots.size();
+  link.used = 0;
+  link.dropped = 0;
+
+  packet_sink_t sink = {mock_acquire, mock_publish, mock_format, mock_payload_capacity, &link};
+  static packet_builder_t builder;
+  imu_config_t config = {CHECK_RATE_HZ, 1, 0, 0};
+  packet_builder_init(&builder, &sink, sensors);
+  packet_builder_begin(&builder, &config, 100); // SENSOR_BATCH_MAX_LATENCY_MS
+  for (const replay_sample_t& s : session) {
+    link.now_us = s.sample_us;
+    packet_builder_push(&builder, CHECK_START_US + s.sample_us, CHECK_START_US + s.sample_us, &s.imu[0][0]);
+  }
+  packet_builder_finish(&builder);
+
+  built.clear();
+  size_t first = 0;
+  for (size_t i = 0; i < link.used; i++) {
+    built.push_back({slots[i].seq_id, first, &slots[i]});
+    first += slots[i].sample_count;
+  }
+}
+
+// Sensor block the decoder reports for sensor s: formats 0..4 carry A and B, B = A with one IMU
+static const uint8_t* source_block(const replay_sample_t* source, uint8_t format, int sensors, int s) {
+  if (format == IMU_FORMAT_MULTI) return source->imu[s];
+  return source->imu[s > 0 && sensors > 1 ? 1 : 0];
+}
+
+/**
+ * @brief Compare the samples of one decode call with the session they were built from
+ */
+static bool verify_decode(imu_decoder_t* d, uint8_t format, int sensors,
+                          const std::vector<replay_sample_t>& session, const std::vector<built_packet_t>& built,
+                          decode_cursor_t* cursor) {
+  uint32_t n = imu_decoder_sample_count(d);
+  const int64_t* time_us = imu_decoder_time_us(d);
+  const uint32_t* seq_id = imu_decoder_seq_id(d);
+  const int16_t* raw = imu_decoder_raw(d);
+  const float* value = imu_decoder_value(d);
+  int expect_sensors = format == IMU_FORMAT_ANGLE ? 0 : format == IMU_FORMAT_MULTI ? sensors : 2;
+
+  EXPECT(imu_decoder_error_count(d) == 0, "%u packets rejected", imu_decoder_error_count(d));
+  EXPECT(n == 0 || imu_decoder_sensor_count(d) == expect_sensors, "sensor count %u, expected %d",
+         imu_decoder_sensor_count(d), expect_sensors);
+
+  for (uint32_t i = 0; i < n; i++) {
+    if (i > 0 && seq_id[i] != seq_id[i - 1]) {
+      cursor->packet++;
+      cursor->position = 0;
+    } else if (i == 0 && cursor->samples > 0) {
+      cursor->packet++; // a decode call always starts with a new packet
+      cursor->position = 0;
+    }
+    size_t p = cursor->packet;
+    EXPECT(p < built.size() && seq_id[i] == built[p].seq_id, "decoded seq_id %u, expected packet %zu", seq_id[i], p);
+    int position = cursor->position++;
+    if (position >= built[p].packet->sample_count) {
+      // Legacy packets always carry 3 samples, the last one of a session may be padded
+      EXPECT(format == IMU_FORMAT_LEGACY && p + 1 == built.size(), "packet %zu: sample %d beyond its %u",
+             p, position, built[p].packet->sample_count);
+      continue;
+    }
+    size_t index = built[p].first + position;
+    EXPECT(index == cursor->samples, "sample %zu decoded out of order, expected %zu", index, cursor->samples);
+    cursor->samples++;
+    const replay_sample_t* source = &session[index];
+
+    // Unwrapped times count from the first sample, across the ms and µs wraps
+    if (index == 0) cursor->first_time_us = time_us[i];
+    int64_t elapsed = time_us[i] - cursor->first_time_us;
+    bool ms_format = format == IMU_FORMAT_LEGACY || format == IMU_FORMAT_BATCH || format == IMU_FORMAT_DELTA;
+    uint64_t start_us = CHECK_START_US + session[0].sample_us;
+    uint64_t sample_us = CHECK_START_US + source->sample_us;
+    int64_t expected = ms_format ? (int64_t)(sample_us / 1000 - start_us / 1000) * 1000
+                                 : (int64_t)(sample_us - start_us);
+    EXPECT(elapsed == expected, "sample %zu: %lld us after the first, expected %lld", index,
+           (long long)elapsed, (long long)expected);
+
+    if (format == IMU_FORMAT_ANGLE) {
+      const imu_angle_sample_t* angle = &built[p].packet->angle.samples[position];
+      EXPECT(imu_decoder_angle_cdeg(d)[i] == angle->angle_cdeg && imu_decoder_confidence(d)[i] == angle->confidence,
+             "sample %zu: angle %d/%u, expected %d/%u", index, imu_decoder_angle_cdeg(d)[i],
+             imu_decoder_confidence(d)[i], angle->angle_cdeg, angle->confidence);
+      continue;
+    }
+    for (int s = 0; s < expect_sensors; s++) {
+      const uint8_t* block = source_block(source, format, sensors, s);
+      for (int a = 0; a < IMU_DECODER_AXES; a++) {
+        size_t at = (size_t)(s * IMU_DECODER_AXES + a) * CHECK_CAPACITY + i;
+        int16_t expect_raw = (int16_t)((block[a * 2] << 8) | block[a * 2 + 1]);
+        float scale = a < 3 ? 1.0f / 16384.0f : 1.0f / 131.0f;
+        EXPECT(raw[at] == expect_raw, "sample %zu sensor %d axis %d: raw %d, expected %d", index, s, a,
+               raw[at], expect_raw);
+        EXPECT(fabsf(value[at] - expect_raw * scale) < 1e-5f, "sample %zu sensor %d axis %d: value %f, expected %f",
+               index, s, a, value[at], expect_raw * scale);
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Decode a whole session through a small decoder, queueing like ImuDecoder.add/decode
+ */
+static bool check_format(uint8_t format, int sensors) {
+  std::vector<replay_sample_t> session;
+  lcg_state = 12345;
+  generate_session(session, CHECK_SECONDS, CHECK_RATE_HZ, sensors);
+  std::vector<ble_batch_packet_t> slots;
+  std::vector<built_packet_t> built;
+  build_packets(format, sensors, session, slots, built);
+
+  imu_decoder_t* d = imu_decoder_create(CHECK_CAPACITY, CHECK_MAX_PACKETS);
+  EXPECT(d != nullptr, "imu_decoder_create failed");
+  uint8_t* input = imu_decoder_input(d);
+  uint16_t* lengths = imu_decoder_input_lengths(d);
+  uint32_t input_capacity = imu_decoder_input_capacity(d);
+
+  decode_cursor_t cursor = {0, 0, 0, 0};
+  uint32_t queued = 0;
+  size_t queued_bytes = 0;
+  size_t splits = 0;
+  bool ok = true;
+
+  // One decode call like ImuDecoder.decode: packets it had no room for move to the front
+  auto decode = [&]() {
+    uint32_t consumed = imu_decoder_decode(d, format, queued);
+    if (consumed == 0 || consumed > queued) {
+      printf("  FAIL: decode consumed %u of %u packets\n", consumed, queued);
+      failures++;
+      return false;
+    }
+    if (!verify_decode(d, format, sensors, session, built, &cursor)) return false;
+    if (consumed < queued) {
+      size_t offset = 0;
+      for (uint32_t i = 0; i < consumed; i++) offset += lengths[i];
+      memmove(input, input + offset, queued_bytes - offset);
+      memmove(lengths, lengths + consumed, (queued - consumed) * sizeof(lengths[0]));
+      queued_bytes -= offset;
+      splits++;
+    } else {
+      queued_bytes = 0;
+    }
+    queued -= consumed;
+    return true;
+  };
+
+  for (size_t i = 0; ok && i < built.size(); i++) {
+    std::vector<uint8_t> bytes = wire_bytes(built[i].packet);
+    if (queued >= CHECK_MAX_PACKETS || queued_bytes + bytes.size() > input_capacity) ok = decode();
+    memcpy(input + queued_bytes, bytes.data(), bytes.size());
+    lengths[queued++] = (uint16_t)bytes.size();
+    queued_bytes += bytes.size();
+  }
+  while (ok && queued > 0) ok = decode();
+  imu_decoder_destroy(d);
+  if (!ok) return false;
+
+  // The last open packet is published by packet_builder_finish, so every sample comes back
+  EXPECT(cursor.samples == session.size(), "%zu of %zu samples decoded", cursor.samples, session.size());
+  EXPECT(splits > 0, "the capacity never split a decode");
+  printf("  %-6s %zu packets, %zu samples, %zu split decodes\n", format_name(format), built.size(),
+         cursor.samples, splits);
+  return true;
+}
+
+// Queue the packets given, decode them in one call
+static uint32_t decode_packets(imu_decoder_t* d, uint8_t format, const std::vector<std::vector<uint8_t>>& packets) {
+  uint8_t* input = imu_decoder_input(d);
+  uint16_t* lengths = imu_decoder_input_lengths(d);
+  size_t offset = 0;
+  for (size_t i = 0; i < packets.size(); i++) {
+    memcpy(input + offset, packets[i].data(), packets[i].size());
+    lengths[i] = (uint16_t)packets[i].size();
+    offset += packets[i].size();
+  }
+  return imu_decoder_decode(d, format, (uint32_t)packets.size());
+}
+
+/**
+ * @brief Malformed packets are skipped and counted, the good ones around them still decode
+ */
+static bool check_malformed() {
+  std::vector<replay_sample_t> session;
+  lcg_state = 12345;
+  generate_session(session, 1.0, CHECK_RATE_HZ, 2);
+  std::vector<ble_batch_packet_t> slots;
+  std::vector<built_packet_t> built;
+  build_packets(IMU_FORMAT_TIMED, 2, session, slots, built);
+  EXPECT(built.size() >= 2, "session too short");
+
+  std::vector<uint8_t> good = wire_bytes(built[0].packet);
+  int good_samples = built[0].packet->sample_count;
+  std::vector<uint8_t> truncated(good.begin(), good.end() - 1);
+  std::vector<uint8_t> header_only(good.begin(), good.begin() + IMU_BATCH_HEADER_SIZE - 1);
+  std::vector<uint8_t> oversized = good;
+  oversized.resize(IMU_DECODER_MAX_PACKET + 1, 0);
+  std::vector<uint8_t> unknown = good;
+  unknown[0] = (unknown[0] & ~IMU_VERSION_FORMAT_MASK) | 0x0F; // no such format
+  std::vector<uint8_t> overcount = good;
+  overcount[1] = UINT8_MAX; // sample_count beyond the payload
+
+  imu_decoder_t* d = imu_decoder_create(CHECK_CAPACITY, CHECK_MAX_PACKETS);
+  EXPECT(d != nullptr, "imu_decoder_create failed");
+
+  uint32_t consumed = decode_packets(d, IMU_FORMAT_TIMED, {truncated, good, header_only, oversized, unknown,
+                                                           overcount, good});
+  uint32_t errors = imu_decoder_error_count(d), samples = imu_decoder_sample_count(d);
+  bool ok = consumed == 7 && errors == 5 && samples == (uint32_t)(2 * good_samples);
+  if (ok) {
+    // The legacy format has no header, only its fixed size is checked
+    std::vector<uint8_t> legacy(sizeof(ble_packet_t), 0);
+    std::vector<uint8_t> short_legacy(sizeof(ble_packet_t) - 1, 0);
+    consumed = decode_packets(d, IMU_FORMAT_LEGACY, {short_legacy, legacy});
+    ok = consumed == 2 && imu_decoder_error_count(d) == 1 && imu_decoder_sample_count(d) == 3;
+  }
+  imu_decoder_destroy(d);
+  EXPECT(ok, "consumed %u, %u errors, %u samples (expected 7, 5, %d)", consumed, errors, samples, 2 * good_samples);
+
+  // A packet with more samples than the decoder holds is consumed by nobody: ImuDecoder drops the queue
+  d = imu_decoder_create(2, CHECK_MAX_PACKETS);
+  EXPECT(d != nullptr, "imu_decoder_create failed");
+  consumed = decode_packets(d, IMU_FORMAT_TIMED, {good});
+  samples = imu_decoder_sample_count(d);
+  imu_decoder_destroy(d);
+  EXPECT(consumed == 0 && samples == 0, "packet over capacity: consumed %u, %u samples", consumed, samples);
+
+  printf("  malformed packets skipped and counted\n");
+  return true;
+}
+
+int main() {
+  printf("imu_decoder against packet_builder, %.0f s at %d Hz from %llu us:\n", CHECK_SECONDS, CHECK_RATE_HZ,
+         (unsigned long long)CHECK_START_US);
+  for (uint8_t format = IMU_FORMAT_LEGACY; format <= IMU_FORMAT_MULTI; format++) check_format(format, 2);
+  check_format(IMU_FORMAT_MULTI, 3);
+  check_format(IMU_FORMAT_BATCH, 1);
+  check_malformed();
+  printf(failures > 0 ? "%d checks failed\n" : "All checks passed\n", failures);
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,425 @@
+// Hardware-in-the-loop benchmark analysis.
+//
+// Reads the HCI snoop log of a central that ran "Bench:<rate>:<batch>:<seconds>" against the
+// device (see BLE.hpp) and reports goodput, packet and sample loss and the latency from sample
+// generation on the device to arrival at the central's HCI. Android: Developer options >
+// Enable Bluetooth HCI snoop log, run the benchmark, then pull the log from a bug report.
+// Linux: btmon -w bench.btsnoop while a script drives the device.
+//
+// Latency needs the device clock. "Ping:<t1>" writes during the run and their "Pong:" replies
+// give its offset NTP style from the snoop timestamps (the exchange with the shortest round trip
+// wins). Without any, latency is reported relative to the fastest sample.
+//
+// Build (from NexHacks_Embedded):
+//   g++ -O2 -std=c++17 -Wall -Iinclude bench/hil_bench.cpp -o hil_bench
+//
+// Usage:
+//   ./hil_bench btsnoop_hci.log [--handle 0x0012] [--format 3]
+//
+// The last "Bench:" write in the log is analysed. --handle is the ATT handle of the data
+// characteristic, by default the one with the most notifications during the run. --format
+// overrides the wire format, by default the last "Format:<n>" written before the run
+// (IMU_FORMAT_LEGACY if none); IMU_FORMAT_ANGLE packets carry no sample bytes, only their loss
+// is counted. Exits non-zero if the log holds no benchmark.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "imu_packet.hpp"
+#include "imu_codec.hpp"
+
+#define SNOOP_MAGIC                 "btsnoop"
+#define SNOOP_HEADER_SIZE           16
+#define SNOOP_RECORD_HEADER_SIZE    24
+#define SNOOP_DATALINK_H1           1001  // HCI packets without the H4 type byte
+#define SNOOP_DATALINK_H4           1002  // UART H4, Android and btmon
+#define SNOOP_FLAG_RECEIVED         0x01  // controller -> host
+#define SNOOP_FLAG_COMMAND_EVENT    0x02
+#define H4_ACL                      0x02
+#define ACL_PB_CONTINUATION         0x01
+#define L2CAP_HEADER_SIZE           4
+#define L2CAP_CID_ATT               0x0004
+#define ATT_WRITE_REQ               0x12
+#define ATT_WRITE_CMD               0x52
+#define ATT_NOTIFY                  0x1B
+#define BENCH_TIME_OFFSET           0     // sensor block bytes: 48-bit µs since session start
+#define BENCH_INDEX_OFFSET          6     // 32-bit sample index
+
+// One ATT PDU of interest, with the time the central's HCI saw it
+typedef struct {
+  int64_t time_us;
+  bool received;        // notification from the device (false = written by the central)
+  uint8_t opcode;
+  uint16_t handle;
+  std::vector<uint8_t> value;
+} att_pdu_t;
+
+typedef struct {
+  int64_t rx_us;
+  int64_t generated_us; // device session timeline
+  uint32_t index;
+} bench_sample_t;
+
+static uint32_t be32(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint16_t le16(const uint8_t* p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static bool starts_with(const std::vector<uint8_t>& value, const char* prefix) {
+  size_t n = strlen(prefix);
+  return value.size() >= n && memcmp(value.data(), prefix, n) == 0;
+}
+
+static std::string as_text(const std::vector<uint8_t>& value) {
+  return std::string(value.begin(), value.end());
+}
+
+/**
+ * @brief ATT writes and notifications of every connection in a btsnoop file,
+ *        L2CAP reassembled from ACL fragments
+ */
+static bool load_snoop(const char* path, std::vector<att_pdu_t>& out) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) return false;
+  uint8_t header[SNOOP_HEADER_SIZE];
+  if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, SNOOP_MAGIC, 8) != 0) {
+    fclose(f);
+    return false;
+  }
+  uint32_t datalink = be32(&header[12]);
+  if (datalink != SNOOP_DATALINK_H1 && datalink != SNOOP_DATALINK_H4) {
+    fprintf(stderr, "Unsupported btsnoop datalink %u\n", datalink);
+    fclose(f);
+    return false;
+  }
+
+  // L2CAP frames being reassembled, per connection handle and direction
+  std::map<uint32_t, std::vector<uint8_t>> partial;
+  uint8_t record[SNOOP_RECORD_HEADER_SIZE];
+  std::vector<uint8_t> data;
+  while (fread(record, 1, sizeof(record), f) == sizeof(record)) {
+    uint32_t length = be32(&record[4]);
+    uint32_t flags = be32(&record[8]);
+    int64_t time_us = (int64_t)(((uint64_t)be32(&record[16]) << 32) | be32(&record[20]));
+    data.resize(length);
+    if (fread(data.data(), 1, length, f) != length) break;
+
+    const uint8_t* p = data.data();
+    size_t n = length;
+    if (datalink == SNOOP_DATALINK_H4) {
+      if (n < 1 || p[0] != H4_ACL) continue;
+      p++;
+      n--;
+    } else if (flags & SNOOP_FLAG_COMMAND_EVENT) {
+      continue;
+    }
+    if (n < 4) continue;
+
+    bool received = flags & SNOOP_FLAG_RECEIVED;
+    uint16_t acl = le16(p);
+    uint16_t acl_length = le16(p + 2);
+    if (acl_length > n - 4) continue;
+    uint32_t key = ((uint32_t)(acl & 0x0FFF) << 1) | (received ? 1 : 0);
+    std::vector<uint8_t>& frame = partial[key];
+    if (((acl >> 12) & 0x3) == ACL_PB_CONTINUATION) {
+      if (frame.empty()) continue; // start fragment not in the log
+    } else {
+      frame.clear();
+    }
+    frame.insert(frame.end(), p + 4, p + 4 + acl_length);
+    if (frame.size() < L2CAP_HEADER_SIZE || frame.size() < L2CAP_HEADER_SIZE + (size_t)le16(&frame[0])) continue;
+
+    uint16_t l2cap_length = le16(&frame[0]);
+    if (le16(&frame[2]) == L2CAP_CID_ATT && l2cap_length >= 3) {
+      const uint8_t* att = &frame[L2CAP_HEADER_SIZE];
+      uint8_t opcode = att[0];
+      bool wanted = received ? opcode == ATT_NOTIFY : (opcode == ATT_WRITE_REQ || opcode == ATT_WRITE_CMD);
+      if (wanted) {
+        att_pdu_t pdu;
+        pdu.time_us = time_us;
+        pdu.received = received;
+        pdu.opcode = opcode;
+        pdu.handle = le16(&att[1]);
+        pdu.value.assign(att + 3, att + l2cap_length);
+        out.push_back(pdu);
+      }
+    }
+    frame.clear();
+  }
+  fclose(f);
+  return true;
+}
+
+static bench_sample_t sample_from_block(int64_t rx_us, const uint8_t* block) {
+  bench_sample_t s;
+  s.rx_us = rx_us;
+  s.generated_us = 0;
+  for (int i = 0; i < 6; i++) s.generated_us = (s.generated_us << 8) | block[BENCH_TIME_OFFSET + i];
+  s.index = be32(&block[BENCH_INDEX_OFFSET]);
+  return s;
+}
+
+/**
+ * @brief Samples of one data notification, false if it does not parse as format.
+ *        seq_id is set for every format.
+ */
+static bool decode_notification(uint8_t format, const att_pdu_t& pdu, uint32_t* seq_id,
+                                std::vector<bench_sample_t>& out) {
+  const std::vector<uint8_t>& v = pdu.value;
+  const size_t block_offset = offsetof(imu_sample_t, acc_A);
+  if (format == IMU_FORMAT_LEGACY) {
+    if (v.size() < sizeof(ble_packet_t)) return false;
+    ble_packet_t packet;
+    memcpy(&packet, v.data(), sizeof(packet));
+    *seq_id = packet.seq_id;
+    for (int i = 0; i < 3; i++) {
+      out.push_back(sample_from_block(pdu.time_us, (const uint8_t*)&packet.samples[i] + block_offset));
+    }
+    return true;
+  }
+
+  if (v.size() < IMU_BATCH_HEADER_SIZE || v.size() > IMU_BATCH_HEADER_SIZE + IMU_BATCH_MAX_PAYLOAD) return false;
+  ble_batch_packet_t packet;
+  memcpy(&packet, v.data(), v.size());
+  size_t payload_length = v.size() - IMU_BATCH_HEADER_SIZE;
+  *seq_id = packet.seq_id;
+  uint8_t packet_format = imu_version_format(packet.version);
+  int count = packet.sample_count;
+
+  if (packet_format == IMU_FORMAT_BATCH || packet_format == IMU_FORMAT_TIMED) {
+    size_t base = packet_format == IMU_FORMAT_TIMED ? IMU_TIMED_BASE_SIZE : 0;
+    if (payload_length < base || count * sizeof(imu_sample_t) > payload_length - base) return false;
+    const uint8_t* samples = packet.payload + base;
+    for (int i = 0; i < count; i++) {
+      out.push_back(sample_from_block(pdu.time_us, samples + i * sizeof(imu_sample_t) + block_offset));
+    }
+  } else if (packet_format == IMU_FORMAT_DELTA) {
+    imu_sample_t samples[UINT8_MAX];
+    if (imu_delta_decode(packet.payload, payload_length, count, samples, UINT8_MAX) != count) return false;
+    for (int i = 0; i < count; i++) {
+      out.push_back(sample_from_block(pdu.time_us, (const uint8_t*)&samples[i] + block_offset));
+    }
+  } else if (packet_format == IMU_FORMAT_MULTI) {
+    if (payload_length < IMU_MULTI_BASE_SIZE) return false;
+    size_t sample_size = IMU_MULTI_SAMPLE_SIZE(packet.multi.sensor_count);
+    if (packet.multi.sensor_count < 1 || count * sample_size > payload_length - IMU_MULTI_BASE_SIZE) return false;
+    for (int i = 0; i < count; i++) {
+      out.push_back(sample_from_block(pdu.time_us, &packet.multi.data[i * sample_size + 2]));
+    }
+  } else if (packet_format != IMU_FORMAT_ANGLE) {
+    return false;
+  }
+  return true;
+}
+
+static double percentile(std::vector<int64_t>& sorted, double p) {
+  if (sorted.empty()) return NAN;
+  size_t i = (size_t)llround(p / 100.0 * (sorted.size() - 1));
+  return (double)sorted[i];
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s btsnoop_hci.log [--handle 0x0012] [--format 3]\n", argv0);
+}
+
+int main(int argc, char** argv) {
+  const char* path = NULL;
+  int handle_arg = -1;
+  int format_arg = -1;
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--handle") == 0 && has_value) handle_arg = (int)strtol(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "--format") == 0 && has_value) format_arg = atoi(argv[++i]);
+    else if (path == NULL && argv[i][0] != '-') path = argv[i];
+    else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (path == NULL || format_arg > IMU_FORMAT_MULTI) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  std::vector<att_pdu_t> pdus;
+  if (!load_snoop(path, pdus)) {
+    fprintf(stderr, "Cannot read %s as a btsnoop log\n", path);
+    return 1;
+  }
+
+  // The run: from the last "Bench:" write to its "Bench:Done" report (or the end of the log)
+  size_t start = pdus.size();
+  uint8_t format = IMU_FORMAT_LEGACY;
+  for (size_t i = 0; i < pdus.size(); i++) {
+    if (!pdus[i].received && starts_with(pdus[i].value, "Bench:")) start = i;
+  }
+  if (start == pdus.size()) {
+    fprintf(stderr, "No \"Bench:\" command in %s\n", path);
+    return 1;
+  }
+  for (size_t i = 0; i < start; i++) {
+    if (!pdus[i].received && starts_with(pdus[i].value, "Format:")) format = (uint8_t)atoi(as_text(pdus[i].value).c_str() + 7);
+  }
+  if (format_arg >= 0) format = (uint8_t)format_arg;
+
+  size_t end = pdus.size();
+  std::string report;
+  for (size_t i = start + 1; i < pdus.size(); i++) {
+    if (pdus[i].received && starts_with(pdus[i].value, "Bench:Done:")) {
+      report = as_text(pdus[i].value);
+      end = i;
+      break;
+    }
+  }
+
+  std::map<uint16_t, size_t> notify_count;
+  for (size_t i = start + 1; i < end; i++) {
+    if (pdus[i].received) notify_count[pdus[i].handle]++;
+  }
+  int data_handle = handle_arg;
+  if (data_handle < 0) {
+    size_t best = 0;
+    for (auto& h : notify_count) {
+      if (h.second > best) {
+        best = h.second;
+        data_handle = h.first;
+      }
+    }
+  }
+  if (data_handle < 0) {
+    fprintf(stderr, "No notifications after the \"Bench:\" command\n");
+    return 1;
+  }
+
+  // Device clock: θ = device - central, from the Ping/Pong exchange with the shortest round trip
+  std::map<std::string, int64_t> ping_us;
+  bool have_offset = false;
+  int64_t best_rtt = INT64_MAX;
+  double offset_us = 0;
+  for (size_t i = start + 1; i < end; i++) {
+    const att_pdu_t& p = pdus[i];
+    std::string text = as_text(p.value);
+    if (!p.received && starts_with(p.value, "Ping:")) {
+      ping_us[text.substr(5)] = p.time_us;
+    } else if (p.received && starts_with(p.value, "Pong:")) {
+      // Pong:<t1>:<t2>:<t3>, t1 is echoed verbatim
+      size_t c3 = text.rfind(':');
+      size_t c2 = c3 == std::string::npos || c3 == 0 ? std::string::npos : text.rfind(':', c3 - 1);
+      if (c2 == std::string::npos || c2 < 5) continue;
+      auto ping = ping_us.find(text.substr(5, c2 - 5));
+      if (ping == ping_us.end()) continue;
+      int64_t t2 = atoll(text.c_str() + c2 + 1);
+      int64_t t3 = atoll(text.c_str() + c3 + 1);
+      int64_t rtt = (p.time_us - ping->second) - (t3 - t2);
+      if (rtt < best_rtt) {
+        best_rtt = rtt;
+        offset_us = ((t2 - ping->second) + (t3 - p.time_us)) / 2.0;
+        have_offset = true;
+      }
+    }
+  }
+
+  // Packets and samples; resent (duplicate) packets only count for loss
+  std::vector<bench_sample_t> samples;
+  std::map<uint32_t, bool> seen_seq;
+  std::map<uint32_t, bool> seen_index;
+  size_t notifications = 0, malformed = 0, duplicates = 0;
+  uint64_t value_bytes = 0;
+  int64_t first_rx = 0, last_rx = 0, max_gap_us = 0;
+  std::vector<int64_t> latency;
+  for (size_t i = start + 1; i < end; i++) {
+    const att_pdu_t& p = pdus[i];
+    if (!p.received || p.handle != data_handle) continue;
+    std::vector<bench_sample_t> decoded;
+    uint32_t seq_id = 0;
+    if (!decode_notification(format, p, &seq_id, decoded)) {
+      malformed++;
+      continue;
+    }
+    if (notifications > 0 && p.time_us - last_rx > max_gap_us) max_gap_us = p.time_us - last_rx;
+    if (notifications++ == 0) first_rx = p.time_us;
+    last_rx = p.time_us;
+    value_bytes += p.value.size();
+    if (seen_seq.count(seq_id)) {
+      duplicates++;
+      continue;
+    }
+    seen_seq[seq_id] = true;
+    for (const bench_sample_t& s : decoded) {
+      if (seen_index.count(s.index)) continue;
+      seen_index[s.index] = true;
+      samples.push_back(s);
+      // Arrival in the central's clock minus generation converted to it
+      latency.push_back(s.rx_us - (int64_t)llround(s.generated_us - offset_us));
+    }
+  }
+  if (notifications == 0) {
+    fprintf(stderr, "No decodable data notifications on handle 0x%04x (format %u)\n", data_handle, format);
+    return 1;
+  }
+
+  // Expected counts from the device report if the run finished, else from the highest ids seen
+  unsigned long rep[12] = {0};
+  bool have_report = !report.empty() &&
+      sscanf(report.c_str(), "Bench:Done:%lu:%lu:%lu:%lu:%lu:%lu:%lu:%lu:%lu:%lu:%lu:%lu", &rep[0], &rep[1],
+             &rep[2], &rep[3], &rep[4], &rep[5], &rep[6], &rep[7], &rep[8], &rep[9], &rep[10], &rep[11]) == 12;
+  uint64_t expected_packets = seen_seq.empty() ? 0 : (uint64_t)seen_seq.rbegin()->first + 1;
+  uint64_t expected_samples = seen_index.empty() ? 0 : (uint64_t)seen_index.rbegin()->first + 1;
+  if (have_report) {
+    expected_packets = rep[1];
+    if (format != IMU_FORMAT_ANGLE) expected_samples = rep[0] + rep[7]; // processed + dropped before processing
+  }
+
+  double span_s = (last_rx - first_rx) / 1e6;
+  if (span_s <= 0) span_s = 1e-6;
+  printf("Run: \"%s\", format %u, data handle 0x%04x\n", as_text(pdus[start].value).c_str(), format, data_handle);
+  printf("Received %zu notifications over %.2f s (%zu resent, %zu malformed), longest gap %.1f ms\n",
+         notifications, span_s, duplicates, malformed, max_gap_us / 1000.0);
+  printf("Goodput: %.1f kB/s ATT payload, %.1f notifications/s, %.1f samples/s\n",
+         value_bytes / span_s / 1000.0, notifications / span_s, samples.size() / span_s);
+  if (expected_packets > 0) {
+    uint64_t lost = expected_packets > seen_seq.size() ? expected_packets - seen_seq.size() : 0;
+    printf("Packet loss: %llu of %llu (%.3f%%)\n", (unsigned long long)lost,
+           (unsigned long long)expected_packets, 100.0 * lost / expected_packets);
+  }
+  if (expected_samples > 0) {
+    uint64_t lost = expected_samples > samples.size() ? expected_samples - samples.size() : 0;
+    printf("Sample loss: %llu of %llu (%.3f%%)\n", (unsigned long long)lost,
+           (unsigned long long)expected_samples, 100.0 * lost / expected_samples);
+  }
+
+  if (!latency.empty()) {
+    std::sort(latency.begin(), latency.end());
+    double base = 0;
+    if (have_offset) {
+      printf("Latency (device clock from Ping/Pong, round trip %.1f ms):", best_rtt / 1000.0);
+    } else {
+      base = (double)latency.front();
+      printf("Latency relative to the fastest sample (no Ping/Pong during the run):");
+    }
+    printf(" p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f ms\n",
+           (percentile(latency, 50) - base) / 1000.0, (percentile(latency, 90) - base) / 1000.0,
+           (percentile(latency, 99) - base) / 1000.0, (percentile(latency, 99.9) - base) / 1000.0,
+           (latency.back() - base) / 1000.0);
+  }
+
+  if (have_report) {
+    printf("Device: %lu samples in %lu packets over %lu ms, %lu notifications/s accepted\n",
+           rep[0], rep[1], rep[10], rep[11]);
+    printf("Device: sent %lu, retries %lu, drops ring %lu / nomem %lu / error %lu, "
+           "raw ring full %lu, high water raw %lu ble %lu\n",
+           rep[2], rep[3], rep[4], rep[5], rep[6], rep[7], rep[8], rep[9]);
+  } else {
+    printf("No \"Bench:Done\" report in the log, the run was cut short or the report was lost\n");
+  }
+  return 0;
+}
@@ -0,0 +1,401 @@
+// Host benchmark for the packet pipeline.
+//
+// Replays a session through packet_builder.hpp (the packing the sensor processing task runs),
+// once per wire format, against a mock sensor source and a mock BLE link, then decodes every
+// packet again and checks it against the input. Reports samples/s, bytes/sample, per-stage
+// latency and how long samples wait in a packet before it is sent.
+//
+// Build (from NexHacks_Embedded):
+//   g++ -O2 -std=c++17 -Wall -Wextra -Iinclude bench/replay_bench.cpp -o replay_bench
+//
+// Usage:
+//   ./replay_bench [--log imulog.bin] [--seconds 60] [--rate 100] [--sensors 2] [--mtu 256]
+//                  [--latency-ms 100] [--repeat 5]
+//
+// --log replays a flash log read back from the "imulog" partition (parttool.py read_partition
+// --partition-name imulog). Without it a synthetic knee flexion session is generated at --rate
+// for --sensors IMUs (the extra ones swing like further joints down the leg).
+// Exits non-zero if any packet fails to decode back to its input.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include "imu_packet.hpp"
+#include "imu_codec.hpp"
+#include "packet_builder.hpp"
+#include "replay_source.hpp"
+
+#define BENCH_PAGE_SIZE             4096  // RECORDER_PAGE_SIZE, see recorder.hpp
+
+static int sensor_count = 2;
+
+static void sample_to_replay(const imu_sample_t* sample, uint64_t sample_us, replay_sample_t* out) {
+  memset(out, 0, sizeof(*out));
+  out->sample_us = sample_us;
+  out->truth_deg = NAN;
+  memcpy(&out->imu[0][0], sample->acc_A, 6);
+  memcpy(&out->imu[0][6], sample->gyro_A, 6);
+  memcpy(&out->imu[1][0], sample->acc_B, 6);
+  memcpy(&out->imu[1][6], sample->gyro_B, 6);
+}
+
+/**
+ * @brief Read a flash log dump back into raw samples. Angle packets carry no raw data and are skipped.
+ * @return false if the file cannot be read
+ */
+static bool load_log(const char* path, std::vector<replay_sample_t>& out) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) return false;
+
+  uint8_t page[BENCH_PAGE_SIZE];
+  uint64_t ms_wraps = 0;      // ms time_offset is 16 bits, wraps every 65.5s
+  uint16_t last_ms = 0;
+  size_t skipped = 0;
+  bool done = false;
+  while (!done && fread(page, 1, BENCH_PAGE_SIZE, f) == BENCH_PAGE_SIZE) {
+    size_t pos = 0;
+    while (pos + 2 <= BENCH_PAGE_SIZE) {
+      uint16_t length = page[pos] | (page[pos + 1] << 8);
+      if (length == 0xFFFF) {
+        done = (pos == 0); // empty page = end of log
+        break;
+      }
+      if (length < IMU_BATCH_HEADER_SIZE || length > IMU_BATCH_HEADER_SIZE + IMU_BATCH_MAX_PAYLOAD ||
+          pos + 2 + length > BENCH_PAGE_SIZE) {
+        fprintf(stderr, "Corrupt record at page offset %zu, rest of page skipped\n", pos);
+        break;
+      }
+
+      ble_batch_packet_t packet;
+      memcpy(&packet, &page[pos + 2], length);
+      size_t payload_length = length - IMU_BATCH_HEADER_SIZE;
+      pos += 2 + length;
+
+      imu_sample_t samples[UINT8_MAX]; // sample_count is 8 bits
+      int count = 0;
+      uint8_t format = imu_version_format(packet.version); // adaptive sessions tag their rate
+      if (format == IMU_FORMAT_LEGACY || format == IMU_FORMAT_BATCH) {
+        count = std::min<int>(packet.sample_count, payload_length / sizeof(imu_sample_t));
+        memcpy(samples, packet.samples, count * sizeof(imu_sample_t));
+      } else if (format == IMU_FORMAT_DELTA) {
+        count = imu_delta_decode(packet.payload, payload_length, packet.sample_count,
+                                 samples, sizeof(samples) / sizeof(samples[0]));
+      } else if (format == IMU_FORMAT_TIMED && payload_length >= IMU_TIMED_BASE_SIZE) {
+        uint64_t sample_us = packet.timed.base_us;
+        count = std::min<int>(packet.sample_count, (payload_length - IMU_TIMED_BASE_SIZE) / sizeof(imu_sample_t));
+        for (int i = 0; i < count; i++) {
+          if (i > 0) sample_us += packet.timed.samples[i].time_offset;
+          replay_sample_t s;
+          sample_to_replay(&packet.timed.samples[i], sample_us, &s);
+          out.push_back(s);
+        }
+        continue;
+      } else if (format == IMU_FORMAT_MULTI && payload_length >= IMU_MULTI_BASE_SIZE &&
+                 packet.multi.sensor_count >= 1 && packet.multi.sensor_count <= BENCH_MAX_SENSORS) {
+        uint8_t sensors = packet.multi.sensor_count;
+        size_t sample_size = IMU_MULTI_SAMPLE_SIZE(sensors);
+        uint64_t sample_us = packet.multi.base_us;
+        count = std::min<int>(packet.sample_count, (payload_length - IMU_MULTI_BASE_SIZE) / sample_size);
+        for (int i = 0; i < count; i++) {
+          const uint8_t* in = &packet.multi.data[i * sample_size];
+          if (i > 0) sample_us += in[0] | (in[1] << 8);
+          replay_sample_t s;
+          memset(&s, 0, sizeof(s));
+          s.sample_us = sample_us;
+          s.truth_deg = NAN;
+          memcpy(s.imu, &in[2], sensors * IMU_SENSOR_BYTES);
+          out.push_back(s);
+        }
+        sensor_count = sensors;
+        continue;
+      } else {
+        skipped += packet.sample_count;
+        continue;
+      }
+
+      for (int i = 0; i < count; i++) {
+        if (samples[i].time_offset < last_ms) ms_wraps += 65536;
+        last_ms = samples[i].time_offset;
+        replay_sample_t s;
+        sample_to_replay(&samples[i], (ms_wraps + samples[i].time_offset) * 1000, &s);
+        out.push_back(s);
+      }
+    }
+  }
+  fclose(f);
+  if (skipped > 0) printf("Skipped %zu angle samples (no raw data in the log)\n", skipped);
+  return true;
+}
+
+typedef struct {
+  uint32_t p50, p99, max;
+  double mean;
+} percentiles_t;
+
+static percentiles_t summarize(std::vector<uint32_t>& values) {
+  percentiles_t p = {0, 0, 0, 0.0};
+  if (values.empty()) return p;
+  std::sort(values.begin(), values.end());
+  p.p50 = values[values.size() / 2];
+  p.p99 = values[std::min(values.size() - 1, values.size() * 99 / 100)];
+  p.max = values.back();
+  double sum = 0;
+  for (uint32_t v : values) sum += v;
+  p.mean = sum / values.size();
+  return p;
+}
+
+static uint32_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+// Formats 0..4 carry the first two sensors, or the first one twice
+static bool raw_matches(const imu_sample_t* decoded, const replay_sample_t* source) {
+  const uint8_t* b = sensor_count > 1 ? source->imu[1] : source->imu[0];
+  return memcmp(decoded->acc_A, &source->imu[0][0], 6) == 0 && memcmp(decoded->gyro_A, &source->imu[0][6], 6) == 0 &&
+         memcmp(decoded->acc_B, &b[0], 6) == 0 && memcmp(decoded->gyro_B, &b[6], 6) == 0;
+}
+
+// Results of one format over the replayed session
+typedef struct {
+  size_t packets;
+  size_t samples;           // in published packets, the last open packet is never sent
+  size_t wire_bytes;
+  double samples_per_s;
+  percentiles_t pack_ns;    // packet_builder_push, per sample
+  percentiles_t decode_ns;  // app-side decode, per packet
+  percentiles_t hold_us;    // first sample in a packet until the packet is published
+  size_t mismatches;
+  double angle_rms_deg;     // ANGLE only, against the synthetic truth
+  uint32_t dropped;
+} format_result_t;
+
+/**
+ * @brief Decode one packet the way the app does and compare it to the samples it was built from.
+ * @return Samples that did not match
+ */
+static size_t verify_packet(const ble_batch_packet_t* packet, const replay_sample_t* source,
+                            double* angle_sq_sum, size_t* angle_count) {
+  size_t bad = 0;
+  uint8_t format = imu_version_format(packet->version);
+  if (format == IMU_FORMAT_DELTA) {
+    imu_sample_t decoded[UINT8_MAX]; // sample_count is 8 bits
+    int count = imu_delta_decode(packet->payload, packet->payload_length, packet->sample_count,
+                                 decoded, sizeof(decoded) / sizeof(decoded[0]));
+    if (count != packet->sample_count) return packet->sample_count;
+    for (int i = 0; i < count; i++) {
+      if (!raw_matches(&decoded[i], &source[i]) ||
+          decoded[i].time_offset != (uint16_t)(source[i].sample_us / 1000)) bad++;
+    }
+  } else if (format == IMU_FORMAT_TIMED) {
+    uint32_t sample_us = packet->timed.base_us;
+    for (int i = 0; i < packet->sample_count; i++) {
+      if (i > 0) sample_us += packet->timed.samples[i].time_offset;
+      if (!raw_matches(&packet->timed.samples[i], &source[i]) ||
+          sample_us != (uint32_t)source[i].sample_us) bad++;
+    }
+  } else if (format == IMU_FORMAT_ANGLE) {
+    uint32_t sample_us = packet->angle.base_us;
+    for (int i = 0; i < packet->sample_count; i++) {
+      const imu_angle_sample_t* angle = &packet->angle.samples[i];
+      if (i > 0) sample_us += angle->time_offset;
+      if (sample_us != (uint32_t)source[i].sample_us) bad++;
+      if (angle->confidence > 0 && !isnan(source[i].truth_deg)) {
+        double error = angle->angle_cdeg / 100.0 - source[i].truth_deg;
+        *angle_sq_sum += error * error;
+        (*angle_count)++;
+      }
+    }
+  } else if (format == IMU_FORMAT_MULTI) {
+    uint32_t sample_us = packet->multi.base_us;
+    size_t sample_size = IMU_MULTI_SAMPLE_SIZE(packet->multi.sensor_count);
+    if (packet->multi.sensor_count != sensor_count) return packet->sample_count;
+    for (int i = 0; i < packet->sample_count; i++) {
+      const uint8_t* in = &packet->multi.data[i * sample_size];
+      if (i > 0) sample_us += in[0] | (in[1] << 8);
+      if (memcmp(&in[2], source[i].imu, sensor_count * IMU_SENSOR_BYTES) != 0 ||
+          sample_us != (uint32_t)source[i].sample_us) bad++;
+    }
+  } else {
+    for (int i = 0; i < packet->sample_count; i++) {
+      if (!raw_matches(&packet->samples[i], &source[i]) ||
+          packet->samples[i].time_offset != (uint16_t)(source[i].sample_us / 1000)) bad++;
+    }
+  }
+  return bad;
+}
+
+static void run_pipeline(packet_builder_t* builder, mock_link_t* link, const imu_config_t* config,
+                         uint32_t latency_ms, const std::vector<replay_sample_t>& session,
+                         std::vector<uint32_t>* pack_ns) {
+  link->used = 0;
+  link->dropped = 0;
+  link->hold_us.clear();
+  packet_builder_begin(builder, config, latency_ms);
+  for (const replay_sample_t& s : session) {
+    link->now_us = s.sample_us;
+    if (pack_ns == nullptr) {
+      packet_builder_push(builder, s.sample_us, s.sample_us, &s.imu[0][0]);
+    } else {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      packet_builder_push(builder, s.sample_us, s.sample_us, &s.imu[0][0]);
+      pack_ns->push_back(elapsed_ns(start));
+    }
+  }
+}
+
+static format_result_t bench_format(uint8_t format, const std::vector<replay_sample_t>& session,
+                                    const imu_config_t* config, size_t payload_capacity,
+                                    uint32_t latency_ms, int repeat) {
+  format_result_t r;
+  memset(&r, 0, sizeof(r));
+
+  std::vector<ble_batch_packet_t> slots(session.size() + 1);
+  mock_link_t link;
+  link.format = format;
+  link.payload_capacity = payload_capacity;
+  link.slots = slots.data();
+  link.slot_count = slots.size();
+
+  packet_sink_t sink = {mock_acquire, mock_publish, mock_format, mock_payload_capacity, &link};
+  static packet_builder_t builder;
+  packet_builder_init(&builder, &sink, sensor_count);
+
+  // Throughput: uninstrumented passes, best of repeat
+  double best_s = 0;
+  for (int i = 0; i < repeat; i++) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    run_pipeline(&builder, &link, config, latency_ms, session, nullptr);
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (i == 0 || s < best_s) best_s = s;
+  }
+  r.samples_per_s = best_s > 0 ? session.size() / best_s : 0;
+
+  // Per-sample latency: one instrumented pass (includes ~20ns of clock overhead per sample)
+  std::vector<uint32_t> pack_ns;
+  pack_ns.reserve(session.size());
+  run_pipeline(&builder, &link, config, latency_ms, session, &pack_ns);
+  r.pack_ns = summarize(pack_ns);
+  r.hold_us = summarize(link.hold_us);
+  r.packets = link.used;
+  r.dropped = link.dropped;
+
+  // Decode every packet again, the way the app does
+  std::vector<uint32_t> decode_ns;
+  double angle_sq_sum = 0;
+  size_t angle_count = 0;
+  size_t offset = 0;
+  for (size_t i = 0; i < link.used; i++) {
+    const ble_batch_packet_t* packet = &slots[i];
+    r.wire_bytes += packet_builder_wire_size(packet);
+    if (offset + packet->sample_count > session.size()) {
+      r.mismatches += packet->sample_count;
+      break;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    r.mismatches += verify_packet(packet, &session[offset], &angle_sq_sum, &angle_count);
+    decode_ns.push_back(elapsed_ns(start));
+    offset += packet->sample_count;
+  }
+  r.samples = offset;
+  r.decode_ns = summarize(decode_ns);
+  r.angle_rms_deg = angle_count > 0 ? sqrt(angle_sq_sum / angle_count) : NAN;
+  return r;
+}
+
+static const char* format_name(uint8_t format) {
+  switch (format) {
+    case IMU_FORMAT_LEGACY: return "LEGACY";
+    case IMU_FORMAT_BATCH:  return "BATCH";
+    case IMU_FORMAT_DELTA:  return "DELTA";
+    case IMU_FORMAT_TIMED:  return "TIMED";
+    case IMU_FORMAT_ANGLE:  return "ANGLE";
+    case IMU_FORMAT_MULTI:  return "MULTI";
+  }
+  return "?";
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [--log imulog.bin] [--seconds 60] [--rate 100] [--sensors 2] [--mtu 256] "
+                  "[--latency-ms 100] [--repeat 5]\n", argv0);
+}
+
+int main(int argc, char** argv) {
+  const char* log_path = NULL;
+  double seconds = 60;
+  int rate_hz = 100;
+  int mtu = CONFIG_BT_NIMBLE_ATT_PREFERRED_MTU;
+  int latency_ms = 100; // SENSOR_BATCH_MAX_LATENCY_MS
+  int repeat = 5;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--log") == 0 && has_value) log_path = argv[++i];
+    else if (strcmp(argv[i], "--seconds") == 0 && has_value) seconds = atof(argv[++i]);
+    else if (strcmp(argv[i], "--rate") == 0 && has_value) rate_hz = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--sensors") == 0 && has_value) sensor_count = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--mtu") == 0 && has_value) mtu = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--latency-ms") == 0 && has_value) latency_ms = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--repeat") == 0 && has_value) repeat = atoi(argv[++i]);
+    else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (rate_hz <= 0 || seconds <= 0 || repeat <= 0 || latency_ms <= 0 ||
+      sensor_count < 1 || sensor_count > BENCH_MAX_SENSORS) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  std::vector<replay_sample_t> session;
+  if (log_path != NULL) {
+    if (!load_log(log_path, session)) {
+      fprintf(stderr, "Cannot read %s\n", log_path);
+      return 1;
+    }
+    if (session.size() >= 2) {
+      rate_hz = (int)llround((session.size() - 1) * 1e6 / (session.back().sample_us - session.front().sample_us));
+    }
+    printf("Replaying %s: %zu samples, ~%d Hz\n", log_path, session.size(), rate_hz);
+  } else {
+    generate_session(session, seconds, rate_hz, sensor_count);
+    printf("Synthetic session: %zu samples of %d sensors at %d Hz\n", session.size(), sensor_count, rate_hz);
+  }
+  if (session.empty()) {
+    fprintf(stderr, "No samples to replay\n");
+    return 1;
+  }
+
+  // Same cap as ble_payload_capacity()
+  size_t payload_capacity = mtu > ATT_NOTIFY_OVERHEAD + IMU_BATCH_HEADER_SIZE
+                              ? mtu - ATT_NOTIFY_OVERHEAD - IMU_BATCH_HEADER_SIZE : 0;
+  if (payload_capacity > IMU_BATCH_MAX_PAYLOAD) payload_capacity = IMU_BATCH_MAX_PAYLOAD;
+  imu_config_t config = {(uint16_t)rate_hz, 1, 0, 0};
+  printf("MTU %d (payload %zu), max packet latency %d ms, best of %d runs\n\n",
+         mtu, payload_capacity, latency_ms, repeat);
+
+  printf("%-7s %8s %7s %8s %8s %10s %17s %17s %15s %8s\n", "format", "packets", "smp/pkt", "B/smp",
+         "air B/smp", "Msmp/s", "pack ns p50/p99", "decode ns p50/p99", "hold ms avg/max", "errors");
+  int failures = 0;
+  for (uint8_t format = IMU_FORMAT_LEGACY; format <= IMU_FORMAT_MULTI; format++) {
+    format_result_t r = bench_format(format, session, &config, payload_capacity, latency_ms, repeat);
+    double samples = r.samples > 0 ? (double)r.samples : 1.0;
+    printf("%-7s %8zu %7.1f %8.2f %9.2f %10.2f %8u/%-8u %8u/%-8u %7.1f/%-7.1f %8zu",
+           format_name(format), r.packets, r.packets ? samples / r.packets : 0.0,
+           r.wire_bytes / samples, (r.wire_bytes + r.packets * ATT_NOTIFY_OVERHEAD) / samples,
+           r.samples_per_s / 1e6, r.pack_ns.p50, r.pack_ns.p99, r.decode_ns.p50, r.decode_ns.p99,
+           r.hold_us.mean / 1000.0, r.hold_us.max / 1000.0, r.mismatches);
+    if (!isnan(r.angle_rms_deg)) printf("  angle RMS error %.2f deg", r.angle_rms_deg);
+    if (r.dropped > 0) printf("  dropped %u", r.dropped);
+    printf("\n");
+    if (r.mismatches > 0 || r.dropped > 0) failures++;
+  }
+  return failures > 0 ? 1 : 0;
+}
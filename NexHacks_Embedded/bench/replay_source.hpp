@@ -0,0 +1,119 @@
+#ifndef REPLAY_SOURCE_H
+#define REPLAY_SOURCE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include "imu_packet.hpp"
+#include "packet_builder.hpp"
+
+// Mock sensor source and mock BLE link shared by the host tools in bench/: replay_bench.cpp
+// times packet_builder.hpp with them, decoder_check.cpp feeds their packets to the app's
+// native decoder.
+
+#define BENCH_NOISE_ACCEL           8     // counts of uniform noise on the synthetic accel
+#define BENCH_NOISE_GYRO            4
+#define BENCH_FLEX_CENTER_DEG       45.0
+#define BENCH_FLEX_AMPLITUDE_DEG    40.0
+#define BENCH_FLEX_HZ               0.5
+#define BENCH_MAX_SENSORS           8     // SENSOR_MAX_COUNT, see sensor.hpp
+
+// One paired sample as the capture task hands it over: big-endian register bytes
+typedef struct {
+  uint64_t sample_us;   // since session start
+  uint8_t imu[BENCH_MAX_SENSORS][IMU_SENSOR_BYTES]; // accel XYZ + gyro XYZ per sensor
+  float truth_deg;      // joint angle the synthetic source generated, NAN for replayed logs
+} replay_sample_t;
+
+// Mock BLE link: hands out slots from one preallocated array and keeps every published packet
+typedef struct {
+  uint8_t format;
+  size_t payload_capacity;
+  ble_batch_packet_t* slots;
+  size_t slot_count;
+  size_t used;
+  uint64_t now_us;        // time of the sample being pushed
+  uint64_t open_us;       // time the current packet was opened
+  std::vector<uint32_t> hold_us;
+  uint32_t dropped;
+} mock_link_t;
+
+static inline ble_batch_packet_t* mock_acquire(void* ctx) {
+  mock_link_t* link = (mock_link_t*)ctx;
+  link->open_us = link->now_us;
+  return link->used < link->slot_count ? &link->slots[link->used] : nullptr;
+}
+
+static inline void mock_publish(void* ctx, ble_batch_packet_t* /*packet*/, bool dropped) {
+  mock_link_t* link = (mock_link_t*)ctx;
+  if (dropped) {
+    link->dropped++;
+    return;
+  }
+  link->used++;
+  link->hold_us.push_back((uint32_t)(link->now_us - link->open_us));
+}
+
+static inline uint8_t mock_format(void* ctx) {
+  return ((mock_link_t*)ctx)->format;
+}
+
+static inline size_t mock_payload_capacity(void* ctx) {
+  return ((mock_link_t*)ctx)->payload_capacity;
+}
+
+static uint32_t lcg_state = 12345;
+
+static inline int noise(int amplitude) {
+  lcg_state = lcg_state * 1664525u + 1013904223u;
+  return (int)((lcg_state >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+static inline void put_be16(uint8_t* p, int value) {
+  if (value > INT16_MAX) value = INT16_MAX;
+  if (value < INT16_MIN) value = INT16_MIN;
+  p[0] = (uint8_t)((uint16_t)value >> 8);
+  p[1] = (uint8_t)value;
+}
+
+/**
+ * @brief One sensor tilted by angle_deg about X, turning at rate_dps. Raw counts at the
+ *        firmware's default ranges.
+ */
+static inline void generate_sensor(uint8_t* imu, double angle_deg, double rate_dps) {
+  double rad = angle_deg * M_PI / 180.0;
+  put_be16(&imu[0], noise(BENCH_NOISE_ACCEL));
+  put_be16(&imu[2], (int)(FUSION_ACCEL_LSB_PER_G * sin(rad)) + noise(BENCH_NOISE_ACCEL));
+  put_be16(&imu[4], (int)(FUSION_ACCEL_LSB_PER_G * cos(rad)) + noise(BENCH_NOISE_ACCEL));
+  put_be16(&imu[6], (int)(FUSION_GYRO_LSB_PER_DPS * rate_dps) + noise(BENCH_NOISE_GYRO));
+  put_be16(&imu[8], noise(BENCH_NOISE_GYRO));
+  put_be16(&imu[10], noise(BENCH_NOISE_GYRO));
+}
+
+/**
+ * @brief Mock sensor source: Sensor A lies flat, Sensor B swings about X like a shank
+ *        during repeated knee flexion, further sensors swing with a growing phase lag.
+ */
+static inline void generate_session(std::vector<replay_sample_t>& out, double seconds, int rate_hz,
+                                    int sensor_count) {
+  size_t count = (size_t)(seconds * rate_hz);
+  for (size_t i = 0; i < count; i++) {
+    double t = (double)i / rate_hz;
+    replay_sample_t s;
+    memset(&s, 0, sizeof(s));
+    s.sample_us = (uint64_t)(t * 1e6);
+    generate_sensor(s.imu[0], 0.0, 0.0);
+    for (int sensor = 1; sensor < sensor_count; sensor++) {
+      double phase = 2.0 * M_PI * BENCH_FLEX_HZ * t - (sensor - 1) * 0.5;
+      double angle = BENCH_FLEX_CENTER_DEG + BENCH_FLEX_AMPLITUDE_DEG * sin(phase);
+      double rate_dps = BENCH_FLEX_AMPLITUDE_DEG * 2.0 * M_PI * BENCH_FLEX_HZ * cos(phase);
+      generate_sensor(s.imu[sensor], angle, rate_dps);
+      if (sensor == 1) s.truth_deg = (float)angle;
+    }
+    if (sensor_count == 1) s.truth_deg = 0.0f;
+    out.push_back(s);
+  }
+}
+
+#endif
@@ -4,22 +4,158 @@
 
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
+#include "imu_packet.hpp"
+#include "imu_events.hpp"
+#include "packet_ring.hpp"
 
-extern QueueHandle_t ble_queue;
+#define BLE_RING_SLOTS              16    // Packets buffered between sensor processing and ble_task
+#define BLE_NOTIFY_RETRY_MS         20    // Wait for a TX-complete event before retrying on ENOMEM
+#define BLE_NOTIFY_MAX_RETRIES      10    // Then give up on the packet and count it as a stack drop
+#define BLE_HISTORY_SLOTS           64    // Packets kept by ble_task for "Resend" (~16KB), slot = seq_id % slots
+#define BLE_RESEND_QUEUE_LEN        8     // Resend ranges waiting for ble_task
+#define BLE_FANOUT_BURST            4     // Notifications per subscriber before the next one gets its turn
+#define BLE_EVENT_QUEUE_LEN         8     // Rep events waiting for ble_task
+
+// Streaming profile, requested from the central right after connect
+#define BLE_STREAMING_PROFILE       1
+#define BLE_STREAM_INTERVAL_MIN     6     // 7.5ms (1.25ms units), the BLE minimum
+#define BLE_STREAM_INTERVAL_MAX     12    // 15ms, leave the phone some room to accept
+#define BLE_STREAM_LATENCY          0
+#define BLE_STREAM_TIMEOUT          400   // 4s (10ms units)
+#define BLE_STREAM_DATA_LEN         251   // LE Data Length Extension, max LL PDU payload
+
+// Advertising: fast after boot/disconnect so the app finds the device quickly, then slow
+// to save power while nobody is connected (0.625ms units)
+#define BLE_ADV_FAST_INTERVAL_MIN   32    // 20ms
+#define BLE_ADV_FAST_INTERVAL_MAX   48    // 30ms
+#define BLE_ADV_SLOW_INTERVAL_MIN   1600  // 1s
+#define BLE_ADV_SLOW_INTERVAL_MAX   1760  // 1.1s
+#define BLE_ADV_FAST_DURATION_MS    30000
+
+// L2CAP connection-oriented channel, an alternative to dataChar notifications.
+// The stream carries the same framing as the flash log: a little-endian uint16 length
+// followed by ble_batch_packet_t header + payload, frames packed back to back into SDUs.
+#if defined(CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM) && CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM > 0
+#define BLE_USE_L2CAP               1
+#else
+#define BLE_USE_L2CAP               0
+#endif
+#define BLE_L2CAP_PSM               0x0080 // First dynamic LE PSM, advertised to the app in the link info
+#define BLE_L2CAP_MTU               512    // Largest SDU we accept / build, sized to the msys mbuf pool
+
+// Clock sync on the status/ack characteristics, repeated by the app as often as it likes
+// (also during a session) to track offset and drift of the device clock:
+//   app -> statusChar  "Ping:<t1>"              t1 = app clock at send, echoed verbatim
+//   ackChar -> app     "Pong:<t1>:<t2>:<t3>"    t2/t3 = device receive/reply time
+// t2/t3 are µs since session start, the timeline of IMU_FORMAT_TIMED sample timestamps.
+// With pre-trigger samples (SENSOR_PRETRIGGER_MS) that timeline starts before "Start", by the
+// ms in "Pretriggered:<ms>" on ackChar after the "ACK" of every "Start"/"Record". While a session
+// is still arming the reply is "Pong:<t1>:Busy", its timeline is not fixed yet.
+// With t4 = app clock at receipt: offset = ((t2 - t1) + (t3 - t4)) / 2, and a fit of
+// offset against t4 over the exchanges gives the drift.
+
+// Retransmission on the status/ack characteristics, for the seq_id gaps the app detects:
+//   app -> statusChar  "Resend:<first>:<last>"     inclusive range, at most BLE_HISTORY_SLOTS packets
+//   ackChar -> app     "Resent:<first>:<last>:<n>" once served, n = packets still in the history
+//   ackChar -> app     "Resend:ERR"                malformed, range too long or too many ranges pending
+// Resent packets are byte-identical to the originals (same seq_id) and reach only the requesting
+// connection. They go out only while no live packet is waiting, so they arrive late and out of
+// order. Packets dropped before ble_task (drop_ring_full) never enter the history.
+
+// Several centrals (up to CONFIG_BT_NIMBLE_MAX_CONNECTIONS, e.g. the app plus a gateway or a
+// clinician tablet) can subscribe to dataChar in the same session. ble_task moves packets off
+// the ring into the history and serves every subscriber from its own position there, so a
+// congested central falls behind alone; one more than BLE_HISTORY_SLOTS packets behind loses
+// the oldest (counted as drop_stack_nomem). During an "Offload" the slowest subscriber holds
+// the ring instead, so the log is read out at its pace and nothing is lost. A new subscriber
+// starts with live data. Packets are sized for the smallest MTU among the subscribers, and
+// capture only stops on "Stop" or when the last central disconnects. A "Record" session keeps recording without any central, until
+// "Stop" or a full log partition; an "Offload" is aborted when the last central leaves.
+// "Start" during a live session just joins it (ACK, nothing restarts). The central reading the
+// L2CAP channel gets its packets (and resends) there only, a dataChar subscription of the same
+// connection is skipped.
+// "Start"/"Record" during a recording, a calibration or while the last session still drains
+// (see session.hpp) answers "Busy". Commands never wait for the capture task.
+
+// Rep/step events (imu_events.hpp) on their own characteristic (0006), one imu_event_t per
+// notification, ahead of any data packet waiting:
+//   app -> statusChar  "Events:<mode>"   IMU_EVENTS_OFF / _WITH_RAW / _ONLY, echoed on ackChar
+//   ackChar -> app     "Events:ERR"      unknown mode (or built without SENSOR_USE_EVENTS)
+// IMU_EVENTS_ONLY streams no data packets in live sessions, "Record" still logs raw data.
+// The mode may change during a session; the detector always runs from the session start.
+
+// Adaptive sample rate (SENSOR_ADAPTIVE_RATE in sensor.hpp), from the next session on:
+//   app -> statusChar  "Adaptive:<0|1>"  echoed on ackChar
+//   ackChar -> app     "Adaptive:ERR"    built without SENSOR_ADAPTIVE_RATE
+// The rate then changes with the movement during a session; batch packets carry theirs in
+// the version byte (IMU_VERSION_RATE_SHIFT), legacy packets only their ms timestamps.
+
+// Pre-trigger sampling between sessions (SENSOR_PRETRIGGER_MS in sensor.hpp), off after boot:
+//   app -> statusChar  "Pretrigger:<0|1>"  echoed on ackChar
+//   ackChar -> app     "Pretrigger:ERR"    built with SENSOR_PRETRIGGER_MS 0
+// Costs power for as long as the central stays connected, see sensor.hpp.
+
+// Hardware-in-the-loop benchmark (SENSOR_USE_BENCH in sensor.hpp), a streaming session of
+// synthetic samples in the selected format:
+//   app -> statusChar  "Bench:<rate>:<batch>:<seconds>"  rate 1..SENSOR_BENCH_MAX_HZ, batch = samples
+//                                                      per packet (0 = as many as fit), then "ACK"
+//   ackChar -> app     "Bench:ERR"                       out of range (or not built in), "Busy" if not idle
+//   ackChar -> app     "Bench:Done:<samples>:<packets>:<sent>:<retries>:<drop_ring>:<drop_nomem>:
+//                      <drop_error>:<raw_ring_full>:<raw_high_water>:<ble_high_water>:<ms>:<notify_per_s>"
+// once every subscriber has the last packet; ms is the generated span, the counters are the
+// ble_tx_stats / diag_report_t ones of the run. "Stop" ends it early (with the report). Each sample
+// carries its generation time on the session timeline, so with "Ping:" exchanges during the run an
+// HCI snoop log of the phone gives goodput, latency and loss (bench/hil_bench.cpp).
+
+typedef SpscRing<ble_batch_packet_t, BLE_RING_SLOTS> ble_ring_t;
+
+// Packet accounting for the current session, split by where packets are lost
+typedef struct {
+  std::atomic<uint32_t> sent;              // notifications (or L2CAP frames) accepted by the host stack, per subscriber
+  std::atomic<uint32_t> retries;           // notify attempts deferred or repeated after ENOMEM (congestion)
+  std::atomic<uint32_t> drop_ring_full;    // sensor processing found no free ring slot
+  std::atomic<uint32_t> drop_no_subscriber;// nobody subscribed to the data characteristic
+  std::atomic<uint32_t> drop_stack_nomem;  // a subscriber fell a whole history behind and lost packets
+  std::atomic<uint32_t> drop_stack_error;  // any other host error (disconnect mid-send, ...)
+  std::atomic<uint32_t> resent;            // retransmissions accepted by the host stack (not in sent)
+} ble_tx_stats_t;
+
+extern ble_tx_stats_t ble_tx_stats;
+extern ble_ring_t ble_ring;
 extern TaskHandle_t BLE_manager_task_handle;
-extern SemaphoreHandle_t sensor_run_semaphore;
 
 class MyServerCallbacks : public NimBLEServerCallbacks {
   void onConnect(NimBLEServer* pServer, NimBLEConnInfo& connInfo);
   void onDisconnect(NimBLEServer* pServer, NimBLEConnInfo& connInfo, int reason);
+  void onMTUChange(uint16_t MTU, NimBLEConnInfo& connInfo);
+  void onConnParamsUpdate(NimBLEConnInfo& connInfo);
+  void onPhyUpdate(NimBLEConnInfo& connInfo, uint8_t txPhy, uint8_t rxPhy);
 };
 
 class MyCharCallbacks : public NimBLECharacteristicCallbacks {
   void onRead(NimBLECharacteristic* pChar, NimBLEConnInfo& connInfo);
   void onWrite(NimBLECharacteristic* pChar, NimBLEConnInfo& connInfo);
+  void onSubscribe(NimBLECharacteristic* pChar, NimBLEConnInfo& connInfo, uint16_t subValue);
+  void onStatus(NimBLECharacteristic* pChar, int code);
 };
 
 NimBLEAdvertising* initBLE();
 void ble_task(void *pvParameters);
 
+// Set and notify the ack/status characteristic (replies to status commands)
+void ble_send_status(const char* status);
+
+// Wire format requested by the app (IMU_FORMAT_*)
+uint8_t ble_packet_format();
+// Payload bytes available after the batch header at the currently negotiated MTU
+size_t ble_payload_capacity();
+// Samples per packet for a fixed-size format at the currently negotiated MTU
+uint8_t ble_batch_capacity(uint8_t format);
+// IMU_EVENTS_* requested by the app
+uint8_t ble_event_mode();
+// Sensor processing task: queue one event for eventChar, false if the queue is full
+bool ble_send_event(const imu_event_t* event);
+// Sensor processing task: the benchmark session ended, ble_task reports once it is sent
+void ble_bench_done(uint32_t samples, uint32_t packets, uint32_t duration_ms);
+
 #endif
\ No newline at end of file
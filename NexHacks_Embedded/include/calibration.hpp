@@ -0,0 +1,40 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include "esp_err.h"
+#include "imu_packet.hpp"
+#include "imu_calib.hpp"
+
+#define CALIB_NVS_NAMESPACE         "imu_calib"
+#define CALIB_NVS_KEY               "sensors"
+#define CALIB_BLOB_VERSION          1
+#define CALIB_CAPTURE_MS            2000  // Length of a stationary capture ("Calibrate")
+#define CALIB_MAX_GYRO_SPREAD_DPS   4     // Peak-to-peak gyro on any axis above this = the sensor moved
+
+// Commands on statusChar, replies on ackChar:
+//   "Calibrate"        run a CALIB_CAPTURE_MS session with the device at rest, then
+//                      "Calib:OK:<captured accel points>" or "Calib:ERR:<sensors that moved>"
+//   "Calibrate:Clear"  forget the stored calibration, "Calib:Cleared"
+// Each capture refreshes the gyro bias. Repeating it with each of the six faces down
+// completes the accel offset/scale (see imu_calib.hpp).
+
+// Load the stored calibration (NVS must be initialised)
+esp_err_t calibration_init();
+
+// The next session is a stationary capture instead of a stream
+void calibration_arm();
+// Forget the stored calibration, only between sessions
+esp_err_t calibration_clear();
+
+// sensor processing task: start of a session, true if it is a calibration capture
+bool calibration_begin(const imu_config_t* config);
+// sensor processing task: one sample of every sensor. Returns true once the capture is
+// complete and stored, the caller then ends the session.
+bool calibration_add(const uint8_t* imu, uint64_t since_start_us);
+// sensor processing task: end of a session, reports a capture that was stopped early
+void calibration_end();
+
+// sensor processing task hot path: correct one sensor's 12 sample bytes in place
+void calibration_apply(int sensor, uint8_t* imu);
+
+#endif
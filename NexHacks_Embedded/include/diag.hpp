@@ -0,0 +1,75 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <stdint.h>
+#include "esp_cpu.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Pipeline stages timed with the CPU cycle counter (single core, CPU clock held at max during sessions)
+#define DIAG_STAGE_I2C              0   // capture: register/FIFO reads of both sensors, queue to done
+#define DIAG_STAGE_CAPTURE_LOOP     1   // capture: one loop iteration from wake-up to the next wait
+#define DIAG_STAGE_QUEUE_WAIT       2   // raw sample committed by capture until processing picks it up
+#define DIAG_STAGE_PACK             3   // processing: fusion/encoding/batching of one sample
+#define DIAG_STAGE_NOTIFY           4   // ble_task: handing one packet to the host stack
+#define DIAG_STAGE_COUNT            5
+
+#define DIAG_TASK_CAPTURE           0
+#define DIAG_TASK_PROCESS           1
+#define DIAG_TASK_BLE               2
+#define DIAG_TASK_RECORDER          3
+#define DIAG_TASK_COUNT             4
+
+// Bucket 0 counts durations below 2^DIAG_HIST_MIN_SHIFT cycles, every bucket doubles the bound,
+// the last one takes everything from 2^(DIAG_HIST_MIN_SHIFT + DIAG_HIST_BUCKETS - 2) cycles up
+#define DIAG_HIST_BUCKETS           16
+#define DIAG_HIST_MIN_SHIFT         8     // 256 cycles = 1.6us at 160MHz, last bucket from 26ms
+#define DIAG_REPORT_VERSION         2     // 2: I2C bus fields appended
+#define DIAG_PUBLISH_PERIOD_MS      1000  // Notify interval while the diagnostics characteristic is subscribed
+
+typedef struct __attribute__((packed)) {
+    uint32_t max_cycles;
+    uint16_t buckets[DIAG_HIST_BUCKETS]; // saturating
+} diag_histogram_t;
+
+// Diagnostics characteristic (0005). Counters cover the session since the last "Start".
+typedef struct __attribute__((packed)) {
+    uint8_t version;                      // DIAG_REPORT_VERSION
+    uint16_t cpu_mhz;                     // cycles per µs for the histograms
+    uint32_t uptime_ms;
+    diag_histogram_t stages[DIAG_STAGE_COUNT];
+    uint32_t loop_overruns;               // capture iterations that missed their period
+    uint32_t i2c_errors;
+    uint32_t fifo_overflows;
+    uint32_t raw_ring_full;               // samples dropped because processing fell behind
+    uint16_t raw_ring_high_water;
+    uint16_t ble_ring_high_water;
+    uint32_t ble_sent;
+    uint32_t ble_retries;
+    uint32_t ble_drop_ring_full;
+    uint32_t ble_drop_no_subscriber;
+    uint32_t ble_drop_stack_nomem;
+    uint32_t ble_drop_stack_error;
+    uint16_t stack_free[DIAG_TASK_COUNT]; // uxTaskGetStackHighWaterMark, 0 = task not running
+    uint16_t i2c_khz;                     // SCL clock picked at boot
+    uint16_t i2c_round_us;                // boot measurement: one data read of every sensor
+    uint32_t i2c_recoveries;              // bus resets after a timed out transaction
+} diag_report_t;
+
+static inline uint32_t diag_now() {
+    return (uint32_t)esp_cpu_get_cycle_count();
+}
+
+// Record one duration for a stage. Each stage has a single writer task.
+void diag_record(uint8_t stage, uint32_t cycles);
+
+static inline void diag_record_since(uint8_t stage, uint32_t start) {
+    diag_record(stage, diag_now() - start);
+}
+
+// Called by each task once it runs, for the stack high-water marks
+void diag_register_task(uint8_t task);
+void diag_reset();
+void diag_build_report(diag_report_t* report);
+
+#endif
@@ -11,16 +11,56 @@ extern "C" {
 #define I2C_MASTER_SDA_IO           22    // XIAO ESP32C6: D4/GPIO22 = SDA
 #define I2C_MASTER_NUM              0     // I2C Port 0
 #define I2C_MASTER_FREQ_HZ          400000 // 400kHz (Fast Mode)
-#define I2C_MASTER_TX_BUF_DISABLE   0
-#define I2C_MASTER_RX_BUF_DISABLE   0
-#define I2C_MASTER_TIMEOUT_MS       1000
+#define I2C_FAST_MODE_PLUS          0     // 1 = try 1MHz at boot (needs ~1k external pull-ups), 400kHz if it fails
+#define I2C_FAST_PLUS_FREQ_HZ       1000000
+// Short timeouts so a stuck bus costs one capture round, not a second. The longest single
+// transfer (FIFO_DRAIN_MAX_SAMPLES, 384 bytes) takes ~9ms at 400kHz.
+#define I2C_XFER_TIMEOUT_MS         20    // Per transaction: wait for a free queue slot / sync completion
+#define I2C_WAIT_TIMEOUT_MS         50    // Whole queue, after that the bus is reset
+#define I2C_MAX_DEVICES             10    // Device handles are created on first use of a bus/address
+#define I2C_ASYNC_QUEUE_DEPTH       16    // Transactions per bus that can be queued before submit blocks
+
+// Second bus: the C6 has one HP I2C controller plus the LP I2C controller, whose pins are
+// fixed. Transactions queued on both run concurrently, so bus time no longer adds up.
+#define I2C_BUS_COUNT               1     // 2 = also use the LP I2C bus (bus index 1)
+#define I2C_BUS1_SDA_IO             6     // LP I2C SDA, fixed on the C6
+#define I2C_BUS1_SCL_IO             7     // LP I2C SCL, fixed on the C6
+
+// TCA9548A multiplexer: each downstream channel can hold one MPU6050 per address (0x68/0x69).
+// The helper selects the channel of a target ahead of its transaction, in the same queue.
+#define I2C_MUX_ADDR                0x70  // A0..A2 low
+#define I2C_MUX_NONE                0xFF  // Target wired to the bus directly
+
+typedef struct {
+  uint8_t bus;          // 0 = I2C_MASTER_NUM, 1 = LP I2C (needs I2C_BUS_COUNT 2)
+  uint8_t mux_channel;  // TCA9548A channel 0..7, I2C_MUX_NONE if not behind the mux
+  uint8_t addr;         // 7-bit address
+} i2c_target_t;
 
 esp_err_t i2c_master_init();
+
+esp_err_t i2c_write_byte(const i2c_target_t* target, uint8_t reg, uint8_t data);
+esp_err_t i2c_read_burst(const i2c_target_t* target, uint8_t start_reg, uint8_t *buffer, size_t len);
+// Queue a burst read and return immediately. buffer must stay valid until i2c_wait_all().
+esp_err_t i2c_read_burst_async(const i2c_target_t* target, uint8_t start_reg, uint8_t *buffer, size_t len);
+// Wait for every queued transaction on every bus, returns the first error seen since the last wait.
+// A bus that timed out is reset (SCL pulsed until SDA is released) before this returns.
+esp_err_t i2c_wait_all();
+
+// SCL clock for every target, takes effect on the next transaction. Nothing may be queued.
+esp_err_t i2c_set_speed(uint32_t hz);
+uint32_t i2c_get_speed();
+// Bus resets since boot
+uint32_t i2c_recovery_count();
+
+// Bus 0 without the mux, for the directly wired Sensor A/B bring-up code
 esp_err_t mpu6050_write_byte(uint8_t addr, uint8_t reg, uint8_t data);
 esp_err_t mpu6050_read_burst(uint8_t addr, uint8_t start_reg, uint8_t *buffer, size_t len);
+esp_err_t mpu6050_read_burst_async(uint8_t addr, uint8_t start_reg, uint8_t *buffer, size_t len);
+esp_err_t mpu6050_wait_all();
 
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
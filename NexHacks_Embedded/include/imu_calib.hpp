@@ -0,0 +1,174 @@
+#ifndef IMU_CALIB_H
+#define IMU_CALIB_H
+
+#include <stdint.h>
+
+// Per-sensor gyro bias and accel offset/scale, estimated from stationary captures and
+// applied to the raw big-endian sample bytes in integer fixed point.
+//
+// Values are kept in full-scale range 0 counts (131 LSB/deg/s, 16384 LSB/g) so one
+// calibration serves every FS_SEL / AFS_SEL setting: range n is a right shift by n.
+//
+// Accel: every capture measures the zero-g output of the two axes perpendicular to
+// gravity, and a +1g or -1g point on the axis along it. Six captures (each face down
+// once) give both points on every axis, and with them the scale as well as the offset.
+
+#define CALIB_ACCEL_LSB_PER_G       16384 // AFS_SEL 0
+#define CALIB_GYRO_LSB_PER_DPS      131   // FS_SEL 0
+#define CALIB_SCALE_SHIFT           14    // accel_scale is Q14
+#define CALIB_SCALE_ONE             (1 << CALIB_SCALE_SHIFT)
+#define CALIB_GRAVITY_TOLERANCE     4     // |axis| within 1g +/- 1/4 g counts as lying along gravity
+
+typedef struct __attribute__((packed)) {
+    int16_t gyro_bias[3];       // FS_SEL 0 counts
+    int16_t accel_offset[3];    // AFS_SEL 0 counts, zero-g output
+    uint16_t accel_scale[3];    // Q14, CALIB_SCALE_ONE = nominal sensitivity
+    int16_t accel_plus[3];      // axis reading with +1g along it
+    int16_t accel_minus[3];     // axis reading with -1g along it
+    uint8_t accel_points;       // bit axis: plus captured, bit 3 + axis: minus captured
+    uint8_t accel_zero;         // bit axis: offset measured with the axis perpendicular to gravity
+    uint8_t gyro_valid;
+} imu_calib_t;
+
+// Sums of one stationary capture, in the counts of the ranges it ran at
+typedef struct {
+    int64_t sum[6];             // accel XYZ, gyro XYZ
+    int16_t min[6];
+    int16_t max[6];
+    uint32_t samples;
+} imu_calib_accum_t;
+
+static inline int16_t imu_calib_be16(const uint8_t* p) {
+    return (int16_t)((p[0] << 8) | p[1]);
+}
+
+static inline int16_t imu_calib_saturate(int32_t v) {
+    return v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : (int16_t)v);
+}
+
+static inline void imu_calib_reset(imu_calib_t* c) {
+    for (int i = 0; i < 3; i++) {
+        c->gyro_bias[i] = 0;
+        c->accel_offset[i] = 0;
+        c->accel_scale[i] = CALIB_SCALE_ONE;
+        c->accel_plus[i] = 0;
+        c->accel_minus[i] = 0;
+    }
+    c->accel_points = 0;
+    c->accel_zero = 0;
+    c->gyro_valid = 0;
+}
+
+static inline bool imu_calib_active(const imu_calib_t* c) {
+    return c->gyro_valid || c->accel_points || c->accel_zero;
+}
+
+static inline void imu_calib_accum_reset(imu_calib_accum_t* a) {
+    for (int i = 0; i < 6; i++) {
+        a->sum[i] = 0;
+        a->min[i] = INT16_MAX;
+        a->max[i] = INT16_MIN;
+    }
+    a->samples = 0;
+}
+
+// be: 12 big-endian bytes, accel XYZ then gyro XYZ
+static inline void imu_calib_accum_add(imu_calib_accum_t* a, const uint8_t* be) {
+    for (int i = 0; i < 6; i++) {
+        int16_t v = imu_calib_be16(&be[i * 2]);
+        a->sum[i] += v;
+        if (v < a->min[i]) a->min[i] = v;
+        if (v > a->max[i]) a->max[i] = v;
+    }
+    a->samples++;
+}
+
+// Rounded mean of one axis, scaled up to range 0 counts
+static inline int32_t imu_calib_mean_fs0(const imu_calib_accum_t* a, int i, uint8_t fs) {
+    int64_t n = a->samples;
+    int64_t sum = a->sum[i];
+    int64_t mean = (sum >= 0 ? sum + n / 2 : sum - n / 2) / n;
+    return (int32_t)(mean * (1 << fs));
+}
+
+// Range 0 counts to range fs counts, rounded
+static inline int32_t imu_calib_to_fs(int32_t v, uint8_t fs) {
+    return fs == 0 ? v : (v + (1 << (fs - 1))) >> fs;
+}
+
+// Offset and scale of one axis from whatever points it has
+static inline void imu_calib_solve_axis(imu_calib_t* c, int axis) {
+    bool plus = c->accel_points & (1u << axis);
+    bool minus = c->accel_points & (1u << (3 + axis));
+    if (plus && minus) {
+        int32_t span = c->accel_plus[axis] - c->accel_minus[axis];
+        c->accel_offset[axis] = (int16_t)((c->accel_plus[axis] + c->accel_minus[axis]) / 2);
+        if (span > 0) c->accel_scale[axis] = (uint16_t)(((int64_t)2 * CALIB_ACCEL_LSB_PER_G << CALIB_SCALE_SHIFT) / span);
+    } else if (!(c->accel_zero & (1u << axis)) && (plus || minus)) {
+        // One point and no perpendicular capture yet: assume nominal sensitivity
+        c->accel_offset[axis] = plus ? imu_calib_saturate(c->accel_plus[axis] - CALIB_ACCEL_LSB_PER_G)
+                                     : imu_calib_saturate(c->accel_minus[axis] + CALIB_ACCEL_LSB_PER_G);
+    }
+}
+
+// Fold one stationary capture into the calibration. Returns false (and changes nothing)
+// if the gyro moved more than max_gyro_spread (range 0 counts peak to peak) on any axis.
+static inline bool imu_calib_update(imu_calib_t* c, const imu_calib_accum_t* a,
+                                    uint8_t accel_fs, uint8_t gyro_fs, int32_t max_gyro_spread) {
+    if (a->samples == 0) return false;
+    for (int i = 0; i < 3; i++) {
+        int32_t spread = (int32_t)(a->max[3 + i] - a->min[3 + i]) * (1 << gyro_fs);
+        if (spread > max_gyro_spread) return false;
+    }
+
+    for (int i = 0; i < 3; i++) c->gyro_bias[i] = imu_calib_saturate(imu_calib_mean_fs0(a, 3 + i, gyro_fs));
+    c->gyro_valid = 1;
+
+    int32_t mean[3];
+    int axis = 0;
+    for (int i = 0; i < 3; i++) {
+        mean[i] = imu_calib_mean_fs0(a, i, accel_fs);
+        if ((mean[i] < 0 ? -mean[i] : mean[i]) > (mean[axis] < 0 ? -mean[axis] : mean[axis])) axis = i;
+    }
+    int32_t along = mean[axis] < 0 ? -mean[axis] : mean[axis];
+    if (along < CALIB_ACCEL_LSB_PER_G - CALIB_ACCEL_LSB_PER_G / CALIB_GRAVITY_TOLERANCE ||
+        along > CALIB_ACCEL_LSB_PER_G + CALIB_ACCEL_LSB_PER_G / CALIB_GRAVITY_TOLERANCE) {
+        return true; // gravity is not along one axis, only the gyro bias is usable
+    }
+
+    if (mean[axis] > 0) {
+        c->accel_plus[axis] = imu_calib_saturate(mean[axis]);
+        c->accel_points |= 1u << axis;
+    } else {
+        c->accel_minus[axis] = imu_calib_saturate(mean[axis]);
+        c->accel_points |= 1u << (3 + axis);
+    }
+    for (int i = 0; i < 3; i++) {
+        if (i == axis) continue;
+        // Two-point offsets already include the zero-g output, keep them
+        if ((c->accel_points & (9u << i)) == (9u << i)) continue;
+        c->accel_offset[i] = imu_calib_saturate(mean[i]);
+        c->accel_zero |= 1u << i;
+    }
+    for (int i = 0; i < 3; i++) imu_calib_solve_axis(c, i);
+    return true;
+}
+
+// Correct one sample in place (12 big-endian bytes, accel XYZ then gyro XYZ) at the given ranges
+static inline void imu_calib_apply(const imu_calib_t* c, uint8_t* be, uint8_t accel_fs, uint8_t gyro_fs) {
+    for (int i = 0; i < 3; i++) {
+        int32_t v = imu_calib_be16(&be[i * 2]) - imu_calib_to_fs(c->accel_offset[i], accel_fs);
+        v = (v * c->accel_scale[i] + (1 << (CALIB_SCALE_SHIFT - 1))) >> CALIB_SCALE_SHIFT;
+        int16_t out = imu_calib_saturate(v);
+        be[i * 2] = (uint8_t)(out >> 8);
+        be[i * 2 + 1] = (uint8_t)out;
+    }
+    for (int i = 0; i < 3; i++) {
+        int32_t v = imu_calib_be16(&be[6 + i * 2]) - imu_calib_to_fs(c->gyro_bias[i], gyro_fs);
+        int16_t out = imu_calib_saturate(v);
+        be[6 + i * 2] = (uint8_t)(out >> 8);
+        be[6 + i * 2 + 1] = (uint8_t)out;
+    }
+}
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef IMU_CODEC_H
+#define IMU_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "imu_packet.hpp"
+
+// IMU_FORMAT_DELTA payload:
+//   sample 0       : imu_sample_t as-is (26 bytes keyframe)
+//   sample 1..n-1  : 13 zigzag LEB128 varints, one per word, delta to the previous sample
+// Words are time_offset followed by the 12 accel/gyro channels (decoded from big endian).
+// Deltas wrap modulo 2^16 so decoding is exact for any input.
+
+#define IMU_CODEC_WORDS             13
+#define IMU_DELTA_MAX_SAMPLE_BYTES  (IMU_CODEC_WORDS * 3) // 16-bit zigzag needs at most 3 varint bytes
+
+typedef struct {
+    uint8_t* out;
+    size_t capacity;
+    size_t length;
+    uint8_t count;
+    uint16_t prev[IMU_CODEC_WORDS];
+} imu_delta_encoder_t;
+
+static inline void imu_sample_to_words(const imu_sample_t* sample, uint16_t* words) {
+    const uint8_t* raw = (const uint8_t*)sample;
+    words[0] = sample->time_offset;
+    for (int i = 1; i < IMU_CODEC_WORDS; i++) {
+        words[i] = (uint16_t)((raw[i * 2] << 8) | raw[i * 2 + 1]); // channels are big endian
+    }
+}
+
+static inline void imu_words_to_sample(const uint16_t* words, imu_sample_t* sample) {
+    uint8_t* raw = (uint8_t*)sample;
+    sample->time_offset = words[0];
+    for (int i = 1; i < IMU_CODEC_WORDS; i++) {
+        raw[i * 2] = (uint8_t)(words[i] >> 8);
+        raw[i * 2 + 1] = (uint8_t)(words[i] & 0xFF);
+    }
+}
+
+static inline void imu_delta_begin(imu_delta_encoder_t* enc, uint8_t* out, size_t capacity) {
+    enc->out = out;
+    enc->capacity = capacity;
+    enc->length = 0;
+    enc->count = 0;
+}
+
+/**
+ * @brief Append one sample. Returns false (and writes nothing) if it does not fit.
+ */
+static inline bool imu_delta_append(imu_delta_encoder_t* enc, const imu_sample_t* sample) {
+    uint16_t words[IMU_CODEC_WORDS];
+    imu_sample_to_words(sample, words);
+
+    if (enc->count == UINT8_MAX) return false;
+
+    if (enc->count == 0) {
+        if (enc->capacity - enc->length < sizeof(imu_sample_t)) return false;
+        memcpy(enc->out + enc->length, sample, sizeof(imu_sample_t));
+        enc->length += sizeof(imu_sample_t);
+    } else {
+        uint8_t scratch[IMU_DELTA_MAX_SAMPLE_BYTES];
+        size_t n = 0;
+        for (int i = 0; i < IMU_CODEC_WORDS; i++) {
+            int16_t delta = (int16_t)(uint16_t)(words[i] - enc->prev[i]);
+            uint16_t zigzag = (uint16_t)(((uint16_t)delta << 1) ^ (uint16_t)(delta >> 15));
+            while (zigzag >= 0x80) {
+                scratch[n++] = (uint8_t)(zigzag | 0x80);
+                zigzag >>= 7;
+            }
+            scratch[n++] = (uint8_t)zigzag;
+        }
+        if (enc->capacity - enc->length < n) return false;
+        memcpy(enc->out + enc->length, scratch, n);
+        enc->length += n;
+    }
+
+    memcpy(enc->prev, words, sizeof(words));
+    enc->count++;
+    return true;
+}
+
+/**
+ * @brief Decode an IMU_FORMAT_DELTA payload.
+ * @return Number of samples written to out, or -1 if the payload is truncated or malformed.
+ */
+static inline int imu_delta_decode(const uint8_t* payload, size_t length, uint8_t count,
+                                   imu_sample_t* out, size_t max_samples) {
+    if (count == 0) return 0;
+    if (count > max_samples || length < sizeof(imu_sample_t)) return -1;
+
+    memcpy(&out[0], payload, sizeof(imu_sample_t));
+    uint16_t words[IMU_CODEC_WORDS];
+    imu_sample_to_words(&out[0], words);
+
+    size_t pos = sizeof(imu_sample_t);
+    for (int s = 1; s < count; s++) {
+        for (int i = 0; i < IMU_CODEC_WORDS; i++) {
+            uint32_t zigzag = 0;
+            int shift = 0;
+            uint8_t byte;
+            do {
+                if (pos >= length || shift > 14) return -1;
+                byte = payload[pos++];
+                zigzag |= (uint32_t)(byte & 0x7F) << shift;
+                shift += 7;
+            } while (byte & 0x80);
+            int16_t delta = (int16_t)((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+            words[i] = (uint16_t)(words[i] + delta);
+        }
+        imu_words_to_sample(words, &out[s]);
+    }
+    return count;
+}
+
+#endif
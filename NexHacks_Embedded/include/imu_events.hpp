@@ -0,0 +1,234 @@
+#ifndef IMU_EVENTS_H
+#define IMU_EVENTS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "imu_packet.hpp"
+#include "imu_fusion.hpp"
+
+// Streaming rep/step segmentation on the relative gyro signal (sensor B minus sensor A, i.e.
+// the joint's angular velocity), for the event characteristic. One pass per sample, no
+// history beyond the detector state.
+//
+// The hinge axis is the axis with the most relative rotation over the last seconds, picked
+// again whenever the joint is at rest. The rate about it is low-passed, and a rep is:
+//   out    |rate| rises above IMU_EVENT_START_DPS after rest, the excursion is integrated
+//   turn   the rate crosses over to the opposite direction (the peak angle of the rep)
+//   back   ends after IMU_EVENT_REST_MS at rest, or when the joint moves out again
+//          straight away (steps, continuous squats), which also starts the next rep
+// A movement is reported once its excursion reaches IMU_EVENT_MIN_ANGLE_DEG, so small
+// adjustments never produce events. Angles are integrated gyro, i.e. relative to the
+// position the rep started from, not the absolute joint angle.
+
+#define IMU_EVENT_LPF_HZ            4.0f   // Low-pass on the hinge rate, above any voluntary movement
+#define IMU_EVENT_AXIS_TAU_S        2.0f   // Averaging time of the per-axis activity picking the hinge axis
+#define IMU_EVENT_START_DPS         30.0f  // Joint rate that starts a movement / counts as a turn
+#define IMU_EVENT_REST_DPS          10.0f  // Below this the joint is at rest
+#define IMU_EVENT_REST_MS           300    // At rest this long after the turn ends the rep
+#define IMU_EVENT_MIN_ANGLE_DEG     15.0f  // Smallest excursion that is a rep
+#define IMU_EVENT_MAX_REP_MS        10000  // A rep still open after this long is closed (hold, drift)
+#define IMU_EVENT_RETURN_FRACTION   0.3f   // Ending further out than this share of the peak = no return
+
+// "Events:<mode>" on statusChar
+#define IMU_EVENTS_OFF              0
+#define IMU_EVENTS_WITH_RAW         1      // events alongside the selected raw format
+#define IMU_EVENTS_ONLY             2      // live sessions send events only, no data packets
+
+#define IMU_EVENT_REP_START         1
+#define IMU_EVENT_REP_END           2
+
+#define IMU_EVENT_FLAG_NEGATIVE     0x01   // the rep started with negative rate about the hinge axis
+#define IMU_EVENT_FLAG_TIMEOUT      0x02   // closed after IMU_EVENT_MAX_REP_MS
+#define IMU_EVENT_FLAG_NO_RETURN    0x04   // ended away from where it started
+
+// One event notification. Little endian, times on the session timeline (µs since session start).
+typedef struct __attribute__((packed)) {
+    uint8_t type;             // IMU_EVENT_REP_*
+    uint8_t flags;            // IMU_EVENT_FLAG_*
+    uint16_t seq;             // events this session, a gap = a lost notification
+    uint16_t rep;             // rep number this session, from 1
+    uint32_t time_us;         // REP_START: start of the movement, REP_END: end of the rep
+    uint16_t duration_ms;     // REP_END: from the start of the movement
+    int16_t peak_angle_cdeg;  // REP_END: largest excursion from the start position, 0.01 degree
+    uint16_t peak_rate_dps;   // REP_END: largest joint rate, deg/s
+} imu_event_t;
+
+static_assert(sizeof(imu_event_t) == 16, "imu_event_t is 16 bytes on the wire");
+
+#define IMU_EVENT_PHASE_REST        0
+#define IMU_EVENT_PHASE_OUT         1
+#define IMU_EVENT_PHASE_BACK        2
+
+typedef struct {
+    float gyro_lsb_per_dps;
+    float activity[3];        // slow mean square of the relative rate per axis
+    float rate;               // low-passed rate about the hinge axis, deg/s
+    uint8_t axis;
+    uint8_t phase;            // IMU_EVENT_PHASE_*
+    bool started;             // a sample has been seen
+    bool reported;            // REP_START sent for the current movement
+    float direction;          // +1 / -1, sign of the rate when the movement started
+    float angle;              // excursion since the movement started, deg, positive outwards
+    float peak_angle;
+    float peak_rate;
+    uint64_t last_us;
+    uint64_t quiet_us;        // last sample at rest (or not yet moving out again), where a movement is dated from
+    uint64_t start_us;
+    uint64_t rest_since_us;   // 0 = moving
+    uint16_t rep;
+    uint16_t seq;
+} imu_event_detector_t;
+
+/**
+ * @brief Start of a session: no rep open, counters from 0, rates scaled for gyro FS_SEL
+ */
+static inline void imu_event_detector_begin(imu_event_detector_t* d, uint8_t gyro_fs) {
+    memset(d, 0, sizeof(*d));
+    d->gyro_lsb_per_dps = FUSION_GYRO_LSB_PER_DPS / (float)(1 << gyro_fs);
+}
+
+static inline int16_t imu_event_be16(const uint8_t* p) {
+    return (int16_t)((p[0] << 8) | p[1]);
+}
+
+static inline void imu_event_fill(imu_event_detector_t* d, imu_event_t* out, uint8_t type, uint64_t time_us) {
+    out->type = type;
+    out->flags = d->direction < 0 ? IMU_EVENT_FLAG_NEGATIVE : 0;
+    out->seq = d->seq++;
+    out->rep = d->rep;
+    out->time_us = (uint32_t)time_us;
+    out->duration_ms = 0;
+    out->peak_angle_cdeg = 0;
+    out->peak_rate_dps = 0;
+}
+
+// Open a movement dated from start_us, angle = signed rotation since then
+static inline void imu_event_open(imu_event_detector_t* d, uint64_t start_us, float angle) {
+    d->phase = IMU_EVENT_PHASE_OUT;
+    d->reported = false;
+    d->direction = d->rate < 0 ? -1.0f : 1.0f;
+    d->angle = angle * d->direction;
+    d->peak_angle = 0.0f;
+    d->peak_rate = 0.0f;
+    d->start_us = start_us;
+    d->rest_since_us = 0;
+}
+
+// Close the open movement, true (and *out filled) if it had been reported as a rep
+static inline bool imu_event_close(imu_event_detector_t* d, uint64_t t_us, uint8_t flags, imu_event_t* out) {
+    d->phase = IMU_EVENT_PHASE_REST;
+    if (!d->reported) return false;
+
+    imu_event_fill(d, out, IMU_EVENT_REP_END, t_us);
+    if (d->angle > d->peak_angle * IMU_EVENT_RETURN_FRACTION) flags |= IMU_EVENT_FLAG_NO_RETURN;
+    out->flags |= flags;
+    uint64_t duration_ms = (t_us - d->start_us) / 1000;
+    out->duration_ms = duration_ms > UINT16_MAX ? UINT16_MAX : (uint16_t)duration_ms;
+    float angle_cdeg = d->peak_angle * d->direction * 100.0f;
+    out->peak_angle_cdeg = angle_cdeg > INT16_MAX ? INT16_MAX : angle_cdeg < INT16_MIN ? INT16_MIN : (int16_t)angle_cdeg;
+    out->peak_rate_dps = d->peak_rate > UINT16_MAX ? UINT16_MAX : (uint16_t)d->peak_rate;
+    return true;
+}
+
+/**
+ * @brief Feed one sample. block_A/block_B are the big-endian imu_sensor_block of the two
+ *        sensors (block_B nullptr with a single sensor: its own rate is used), t_us the sample
+ *        on the session timeline. Returns true with *out filled when the sample produced an event.
+ */
+static inline bool imu_event_detector_push(imu_event_detector_t* d, uint64_t t_us,
+                                           const uint8_t* block_A, const uint8_t* block_B, imu_event_t* out) {
+    const uint8_t* gyro_A = block_A + imu_sensor_block::offset(IMU_CHANNEL_GYRO);
+    const uint8_t* gyro_B = block_B != nullptr ? block_B + imu_sensor_block::offset(IMU_CHANNEL_GYRO) : nullptr;
+    float relative[3];
+    for (int i = 0; i < 3; i++) {
+        int32_t counts = gyro_B != nullptr ? imu_event_be16(&gyro_B[i * 2]) - imu_event_be16(&gyro_A[i * 2])
+                                           : imu_event_be16(&gyro_A[i * 2]);
+        relative[i] = counts / d->gyro_lsb_per_dps;
+    }
+
+    if (!d->started) {
+        d->started = true;
+        d->last_us = t_us;
+        d->quiet_us = t_us;
+        for (int i = 0; i < 3; i++) d->activity[i] = relative[i] * relative[i];
+        return false;
+    }
+    float dt = (t_us - d->last_us) * 1e-6f;
+    d->last_us = t_us;
+    if (dt <= 0.0f) return false;
+
+    // Hinge axis: most active axis, switched only between movements
+    float axis_alpha = dt / (IMU_EVENT_AXIS_TAU_S + dt);
+    for (int i = 0; i < 3; i++) d->activity[i] += axis_alpha * (relative[i] * relative[i] - d->activity[i]);
+    if (d->phase == IMU_EVENT_PHASE_REST) {
+        uint8_t axis = d->axis;
+        for (uint8_t i = 0; i < 3; i++) {
+            if (d->activity[i] > d->activity[axis]) axis = i;
+        }
+        if (axis != d->axis) {
+            d->axis = axis;
+            d->rate = relative[axis];
+        }
+    }
+
+    const float rc = 1.0f / (6.2831853f * IMU_EVENT_LPF_HZ);
+    d->rate += dt / (rc + dt) * (relative[d->axis] - d->rate);
+    float speed = fabsf(d->rate);
+
+    if (d->phase == IMU_EVENT_PHASE_REST) {
+        // Rotation since the last rest, so the movement's excursion counts from its beginning
+        if (speed < IMU_EVENT_REST_DPS) {
+            d->quiet_us = t_us;
+            d->angle = 0.0f;
+        } else {
+            d->angle += d->rate * dt;
+        }
+        if (speed >= IMU_EVENT_START_DPS) imu_event_open(d, d->quiet_us, d->angle);
+        return false;
+    }
+
+    float outward = d->rate * d->direction;
+    d->angle += outward * dt;
+    if (d->angle > d->peak_angle) d->peak_angle = d->angle;
+    if (speed > d->peak_rate) d->peak_rate = speed;
+
+    if (!d->reported && d->angle >= IMU_EVENT_MIN_ANGLE_DEG) {
+        d->reported = true;
+        d->rep++;
+        imu_event_fill(d, out, IMU_EVENT_REP_START, d->start_us);
+        return true;
+    }
+
+    if (t_us - d->start_us > IMU_EVENT_MAX_REP_MS * 1000ULL) {
+        return imu_event_close(d, t_us, IMU_EVENT_FLAG_TIMEOUT, out);
+    }
+
+    if (speed < IMU_EVENT_REST_DPS) {
+        d->quiet_us = t_us;
+        if (d->rest_since_us == 0) d->rest_since_us = t_us;
+        // A hold at the far end is part of the rep, only rest after the turn (or before the
+        // movement ever became a rep) ends it
+        bool ends = d->phase == IMU_EVENT_PHASE_BACK || !d->reported;
+        if (ends && t_us - d->rest_since_us >= IMU_EVENT_REST_MS * 1000ULL) {
+            return imu_event_close(d, d->rest_since_us, 0, out);
+        }
+        return false;
+    }
+    d->rest_since_us = 0;
+
+    // On the way back a new movement outwards is dated from the last sample it was not one
+    if (d->phase == IMU_EVENT_PHASE_BACK && outward <= 0.0f) d->quiet_us = t_us;
+
+    if (d->phase == IMU_EVENT_PHASE_OUT && outward <= -IMU_EVENT_START_DPS) {
+        d->phase = IMU_EVENT_PHASE_BACK;
+    } else if (d->phase == IMU_EVENT_PHASE_BACK && outward >= IMU_EVENT_START_DPS) {
+        // Straight into the next rep: this one ended where the rate changed sign
+        bool closed = imu_event_close(d, d->quiet_us, 0, out);
+        imu_event_open(d, d->quiet_us, 0.0f);
+        return closed;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef IMU_FUSION_H
+#define IMU_FUSION_H
+
+#include <stdint.h>
+#include <math.h>
+
+// Per-sensor Madgwick orientation filter (accel + gyro, no magnetometer) and the
+// relative angle between two filtered orientations, for IMU_FORMAT_ANGLE.
+//
+// Single precision. The ESP32-C6 has no FPU, so this is soft-float: roughly 200 float
+// operations per sensor per sample, a few percent of the CPU at 100 Hz for two sensors.
+
+#define FUSION_ACCEL_LSB_PER_G      16384.0f // ACCEL_CONFIG AFS_SEL 0, +/-2g (halves per step)
+#define FUSION_GYRO_LSB_PER_DPS     131.0f   // GYRO_CONFIG FS_SEL 0, +/-250 deg/s (halves per step)
+#define FUSION_BETA                 0.1f     // Accel correction gain once settled
+#define FUSION_BETA_SETTLE          2.5f     // Gain while converging after a reset
+#define FUSION_SETTLE_US            1000000  // How long the settle gain is applied
+#define FUSION_ACCEL_TOLERANCE_G    0.3f     // |accel| - 1g at which confidence reaches 0
+
+#define FUSION_DEG_PER_RAD          57.29577951f
+
+typedef struct {
+    float q[4];        // w, x, y, z
+    float accel_lsb_per_g;
+    float gyro_lsb_per_dps;
+    uint32_t age_us;   // time since the filter was (re)started
+    bool initialised;
+} imu_fusion_t;
+
+static inline void imu_fusion_reset(imu_fusion_t* f) {
+    f->q[0] = 1.0f;
+    f->q[1] = f->q[2] = f->q[3] = 0.0f;
+    f->accel_lsb_per_g = FUSION_ACCEL_LSB_PER_G;
+    f->gyro_lsb_per_dps = FUSION_GYRO_LSB_PER_DPS;
+    f->age_us = 0;
+    f->initialised = false;
+}
+
+// Match the sensor's full-scale range selection (AFS_SEL / FS_SEL, 0..3)
+static inline void imu_fusion_set_range(imu_fusion_t* f, uint8_t accel_fs, uint8_t gyro_fs) {
+    f->accel_lsb_per_g = FUSION_ACCEL_LSB_PER_G / (float)(1 << accel_fs);
+    f->gyro_lsb_per_dps = FUSION_GYRO_LSB_PER_DPS / (float)(1 << gyro_fs);
+}
+
+static inline float imu_fusion_accel_g(const imu_fusion_t* f, const int16_t* acc, int axis) {
+    return acc[axis] / f->accel_lsb_per_g;
+}
+
+// Start from the tilt given by gravity so the filter does not have to converge from identity
+static inline void imu_fusion_init_from_accel(imu_fusion_t* f, float ax, float ay, float az) {
+    float roll = atan2f(ay, az);
+    float pitch = atan2f(-ax, sqrtf(ay * ay + az * az));
+    float cr = cosf(roll * 0.5f), sr = sinf(roll * 0.5f);
+    float cp = cosf(pitch * 0.5f), sp = sinf(pitch * 0.5f);
+    f->q[0] = cr * cp;
+    f->q[1] = sr * cp;
+    f->q[2] = cr * sp;
+    f->q[3] = -sr * sp;
+    f->initialised = true;
+}
+
+/**
+ * @brief One filter step. acc/gyro are raw MPU6050 counts (host order), dt in µs.
+ *        Call imu_fusion_set_range() after imu_fusion_reset() if the range is not the default.
+ */
+static inline void imu_fusion_update(imu_fusion_t* f, const int16_t* acc, const int16_t* gyro, uint32_t dt_us) {
+    float ax = imu_fusion_accel_g(f, acc, 0), ay = imu_fusion_accel_g(f, acc, 1), az = imu_fusion_accel_g(f, acc, 2);
+    if (!f->initialised) {
+        if (ax == 0.0f && ay == 0.0f && az == 0.0f) return;
+        imu_fusion_init_from_accel(f, ax, ay, az);
+        return;
+    }
+
+    const float gyro_scale = 1.0f / (f->gyro_lsb_per_dps * FUSION_DEG_PER_RAD);
+    float gx = gyro[0] * gyro_scale, gy = gyro[1] * gyro_scale, gz = gyro[2] * gyro_scale;
+    float dt = dt_us * 1e-6f;
+    float q0 = f->q[0], q1 = f->q[1], q2 = f->q[2], q3 = f->q[3];
+
+    // Rate of change of the quaternion from the gyroscope
+    float qd0 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
+    float qd1 = 0.5f * (q0 * gx + q2 * gz - q3 * gy);
+    float qd2 = 0.5f * (q0 * gy - q1 * gz + q3 * gx);
+    float qd3 = 0.5f * (q0 * gz + q1 * gy - q2 * gx);
+
+    float norm = sqrtf(ax * ax + ay * ay + az * az);
+    if (norm > 0.0f) {
+        ax /= norm; ay /= norm; az /= norm;
+
+        // Gradient descent step towards the orientation that explains gravity
+        float _2q0 = 2.0f * q0, _2q1 = 2.0f * q1, _2q2 = 2.0f * q2, _2q3 = 2.0f * q3;
+        float _4q0 = 4.0f * q0, _4q1 = 4.0f * q1, _4q2 = 4.0f * q2;
+        float _8q1 = 8.0f * q1, _8q2 = 8.0f * q2;
+        float q0q0 = q0 * q0, q1q1 = q1 * q1, q2q2 = q2 * q2, q3q3 = q3 * q3;
+
+        float s0 = _4q0 * q2q2 + _2q2 * ax + _4q0 * q1q1 - _2q1 * ay;
+        float s1 = _4q1 * q3q3 - _2q3 * ax + 4.0f * q0q0 * q1 - _2q0 * ay - _4q1 + _8q1 * q1q1 + _8q1 * q2q2 + _4q1 * az;
+        float s2 = 4.0f * q0q0 * q2 + _2q0 * ax + _4q2 * q3q3 - _2q3 * ay - _4q2 + _8q2 * q1q1 + _8q2 * q2q2 + _4q2 * az;
+        float s3 = 4.0f * q1q1 * q3 - _2q1 * ax + 4.0f * q2q2 * q3 - _2q2 * ay;
+        float s_norm = sqrtf(s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3);
+        if (s_norm > 0.0f) {
+            float beta = f->age_us < FUSION_SETTLE_US ? FUSION_BETA_SETTLE : FUSION_BETA;
+            beta /= s_norm;
+            qd0 -= beta * s0; qd1 -= beta * s1; qd2 -= beta * s2; qd3 -= beta * s3;
+        }
+    }
+
+    q0 += qd0 * dt; q1 += qd1 * dt; q2 += qd2 * dt; q3 += qd3 * dt;
+    float q_norm = sqrtf(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+    f->q[0] = q0 / q_norm; f->q[1] = q1 / q_norm; f->q[2] = q2 / q_norm; f->q[3] = q3 / q_norm;
+    if (f->age_us < FUSION_SETTLE_US) f->age_us += dt_us;
+}
+
+/**
+ * @brief Rotation angle between two orientations in degrees, 0..180
+ */
+static inline float imu_fusion_relative_angle(const imu_fusion_t* a, const imu_fusion_t* b) {
+    // w of conj(a) * b is the dot product of the two quaternions
+    float dot = fabsf(a->q[0] * b->q[0] + a->q[1] * b->q[1] + a->q[2] * b->q[2] + a->q[3] * b->q[3]);
+    if (dot > 1.0f) dot = 1.0f;
+    return 2.0f * acosf(dot) * FUSION_DEG_PER_RAD;
+}
+
+/**
+ * @brief 0 (unusable) .. 255 (static, settled): gravity is only a valid reference while
+ *        the sensor is not accelerating, and the filter needs time after a reset
+ */
+static inline uint8_t imu_fusion_confidence(const imu_fusion_t* f, const int16_t* acc) {
+    if (!f->initialised || f->age_us < FUSION_SETTLE_US) return 0;
+    float ax = imu_fusion_accel_g(f, acc, 0), ay = imu_fusion_accel_g(f, acc, 1), az = imu_fusion_accel_g(f, acc, 2);
+    float error = fabsf(sqrtf(ax * ax + ay * ay + az * az) - 1.0f);
+    if (error >= FUSION_ACCEL_TOLERANCE_G) return 0;
+    return (uint8_t)(255.0f * (1.0f - error / FUSION_ACCEL_TOLERANCE_G));
+}
+
+#endif
@@ -2,21 +2,187 @@
 #define IMU_PACKET_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include "imu_schema.hpp"
+#if defined(__has_include) && __has_include("sdkconfig.h")
+#include "sdkconfig.h"
+#endif
+
+// The wire format and the headers that produce or consume it (imu_schema, imu_codec,
+// packet_builder, imu_fusion, imu_calib, imu_events) are header only and free of ESP-IDF, so the
+// app's native decoder and the tools in bench/ build the firmware's own code on the host.
+
+// Host-side builds (decoders, tools) have no sdkconfig
+#ifndef CONFIG_BT_NIMBLE_ATT_PREFERRED_MTU
+#define CONFIG_BT_NIMBLE_ATT_PREFERRED_MTU 256
+#endif
+
+// Sensor block of every wire format: accel XYZ + gyro XYZ, TEMP_OUT is never sent
+typedef imu_sensor_layout<IMU_CHANNEL_ACCEL | IMU_CHANNEL_GYRO> imu_sensor_block;
+// imu_sample_t: ms (or µs delta) timestamp, then sensors A and B
+typedef imu_sample_layout<2, imu_sensor_block::channels, 2> imu_pair_sample_layout;
+// IMU_FORMAT_MULTI sample of n sensors: µs delta, then every sensor
+template <uint8_t Sensors>
+using imu_multi_sample_layout = imu_sample_layout<Sensors, imu_sensor_block::channels, 2>;
 
 // Packed to ensure byte-perfect alignment for BLE
 typedef struct __attribute__((packed)) {
-    uint16_t time_offset; // ms from start of packet
+    uint16_t time_offset; // ms since session start (µs since the previous sample in IMU_FORMAT_TIMED)
     int16_t acc_A[3];       // X, Y, Z
     int16_t gyro_A[3];      // X, Y, Z
     int16_t acc_B[3];       // X, Y, Z
     int16_t gyro_B[3];      // X, Y, Z
 } imu_sample_t;
 
-// Total size: 4 + (3 * 14) = 46 bytes. 
-// Fits easily in one BLE packet if MTU > 50.
+// IMU_FORMAT_ANGLE sample: relative angle between sensor A and B after on-device fusion
+typedef struct __attribute__((packed)) {
+    uint16_t time_offset; // µs since the previous sample (0 for the first in a packet)
+    int16_t angle_cdeg;   // Joint angle, 0.01 degree
+    uint8_t confidence;   // 0 = unusable .. 255 = sensors static and filters settled
+} imu_angle_sample_t;
+
+// Total size: 4 + (3 * 26) = 82 bytes.
+// Needs an MTU of at least 85.
 typedef struct __attribute__((packed)) {
     uint32_t seq_id;      // Packet sequence number (to detect dropped packets)
     imu_sample_t samples[3];
 } ble_packet_t;
 
-#endif
\ No newline at end of file
+typedef imu_packet_layout<imu_pair_sample_layout, 3, sizeof(uint32_t)> imu_legacy_layout;
+
+static_assert(sizeof(imu_sample_t) == imu_pair_sample_layout::bytes, "imu_sample_t does not match its layout");
+static_assert(offsetof(imu_sample_t, gyro_A) == imu_pair_sample_layout::offset(0, IMU_CHANNEL_GYRO) &&
+              offsetof(imu_sample_t, acc_B) == imu_pair_sample_layout::offset(1, IMU_CHANNEL_ACCEL) &&
+              offsetof(imu_sample_t, gyro_B) == imu_pair_sample_layout::offset(1, IMU_CHANNEL_GYRO),
+              "imu_sample_t channel offsets do not match its layout");
+static_assert(sizeof(ble_packet_t) == imu_legacy_layout::bytes, "ble_packet_t does not match its layout");
+
+// Wire formats, selected by the app with "Format:<n>" on the status characteristic
+#define IMU_FORMAT_LEGACY           0   // ble_packet_t, fixed 3 samples, no header
+#define IMU_FORMAT_BATCH            1   // ble_batch_packet_t, as many samples as fit in the MTU
+#define IMU_FORMAT_DELTA            2   // ble_batch_packet_t, keyframe + zigzag/varint deltas (imu_codec.hpp)
+#define IMU_FORMAT_TIMED            3   // ble_batch_packet_t, 32-bit µs base + per-sample µs deltas
+#define IMU_FORMAT_ANGLE            4   // ble_batch_packet_t, fused joint angle samples (imu_fusion.hpp)
+#define IMU_FORMAT_MULTI            5   // ble_batch_packet_t, every sensor (SENSOR_COUNT), µs timed
+
+// Rate tag: with the adaptive sample rate (SENSOR_ADAPTIVE_RATE) the upper nibble of the batch
+// header's version byte is the rate the packet's samples were captured at, the lower nibble the
+// IMU_FORMAT_*. 0 = untagged, i.e. the session's configured rate. Legacy packets have no header
+// and are never tagged; every format still carries per-sample timestamps.
+#define IMU_VERSION_FORMAT_MASK     0x0F
+#define IMU_VERSION_RATE_SHIFT      4
+
+// Rate codes, the SMPLRT_DIV rates of a 1kHz gyro output rate
+static constexpr uint16_t imu_rate_hz(uint8_t code) {
+    return code == 1 ? 10 : code == 2 ? 20 : code == 3 ? 25 : code == 4 ? 50 : code == 5 ? 100 :
+           code == 6 ? 125 : code == 7 ? 200 : code == 8 ? 250 : code == 9 ? 500 : code == 10 ? 1000 : 0;
+}
+
+// Code of a rate, 0 if it has none
+static constexpr uint8_t imu_rate_code(uint16_t rate_hz) {
+    for (uint8_t code = 1; code <= IMU_VERSION_FORMAT_MASK; code++) {
+        if (imu_rate_hz(code) == rate_hz) return code;
+    }
+    return 0;
+}
+
+static inline uint8_t imu_version_format(uint8_t version) {
+    return version & IMU_VERSION_FORMAT_MASK;
+}
+
+// Capture rate of a packet, 0 = the session's configured rate
+static inline uint16_t imu_version_rate_hz(uint8_t version) {
+    return imu_rate_hz(version >> IMU_VERSION_RATE_SHIFT);
+}
+
+#define ATT_NOTIFY_OVERHEAD         3   // opcode + attribute handle
+#define IMU_BATCH_HEADER_SIZE       6   // version + sample_count + seq_id
+#define IMU_BATCH_MAX_PAYLOAD       (CONFIG_BT_NIMBLE_ATT_PREFERRED_MTU - ATT_NOTIFY_OVERHEAD - IMU_BATCH_HEADER_SIZE)
+#define IMU_BATCH_MAX_SAMPLES       (IMU_BATCH_MAX_PAYLOAD / sizeof(imu_sample_t))
+#define IMU_TIMED_BASE_SIZE         4   // base_us ahead of the samples
+#define IMU_TIMED_MAX_SAMPLES       ((IMU_BATCH_MAX_PAYLOAD - IMU_TIMED_BASE_SIZE) / sizeof(imu_sample_t))
+#define IMU_ANGLE_MAX_SAMPLES       ((IMU_BATCH_MAX_PAYLOAD - IMU_TIMED_BASE_SIZE) / sizeof(imu_angle_sample_t))
+#define IMU_MULTI_BASE_SIZE         5   // sensor_count + base_us ahead of the samples
+#define IMU_SENSOR_BYTES            imu_sensor_block::bytes // accel XYZ + gyro XYZ of one sensor, big endian
+#define IMU_MULTI_SAMPLE_SIZE(n)    (2 + (n) * IMU_SENSOR_BYTES) // uint16 µs delta + n sensors
+
+// Variable-length packet: header followed by payload_length bytes of samples.
+// Only the first IMU_BATCH_HEADER_SIZE + payload_length bytes go on air.
+// The bytes from seq_id onward are laid out exactly like ble_packet_t, so the
+// same buffer is sent from offset IMU_LEGACY_OFFSET in IMU_FORMAT_LEGACY.
+typedef struct __attribute__((packed)) {
+    uint8_t version;      // IMU_FORMAT_* of this packet, rate tag in the upper nibble
+    uint8_t sample_count; // Samples encoded in the payload
+    uint32_t seq_id;      // Packet sequence number (to detect dropped packets)
+    union {
+        imu_sample_t samples[IMU_BATCH_MAX_SAMPLES]; // IMU_FORMAT_LEGACY / IMU_FORMAT_BATCH
+        uint8_t payload[IMU_BATCH_MAX_PAYLOAD];      // IMU_FORMAT_DELTA
+        struct __attribute__((packed)) {             // IMU_FORMAT_TIMED
+            uint32_t base_us;   // µs since session start of the first sample (wraps after ~71 min)
+            imu_sample_t samples[IMU_TIMED_MAX_SAMPLES]; // time_offset = µs since previous sample
+        } timed;
+        struct __attribute__((packed)) {             // IMU_FORMAT_ANGLE
+            uint32_t base_us;   // as in timed
+            imu_angle_sample_t samples[IMU_ANGLE_MAX_SAMPLES];
+        } angle;
+        struct __attribute__((packed)) {             // IMU_FORMAT_MULTI
+            uint8_t sensor_count; // sensors per sample, in the device's sensor order
+            uint32_t base_us;     // as in timed
+            // sample_count samples of IMU_MULTI_SAMPLE_SIZE(sensor_count) bytes: uint16 µs
+            // since the previous sample (0 for the first), then sensor_count x 12 register bytes
+            uint8_t data[IMU_BATCH_MAX_PAYLOAD - IMU_MULTI_BASE_SIZE];
+        } multi;
+    };
+    uint16_t payload_length; // Bytes of payload in use (local only, not sent)
+} ble_batch_packet_t;
+
+#define IMU_LEGACY_OFFSET           offsetof(ble_batch_packet_t, seq_id)
+
+static_assert(offsetof(ble_batch_packet_t, samples) == IMU_BATCH_HEADER_SIZE, "batch header size mismatch");
+static_assert(imu_legacy_layout::bytes + ATT_NOTIFY_OVERHEAD <= CONFIG_BT_NIMBLE_ATT_PREFERRED_MTU,
+              "preferred MTU too small for a legacy packet");
+static_assert(IMU_BATCH_MAX_SAMPLES >= 3, "preferred MTU too small for a legacy batch");
+
+// Samples per packet for a fixed-size format, given the payload bytes after the batch header
+static inline uint8_t imu_batch_capacity(uint8_t format, size_t payload_capacity) {
+    if (format == IMU_FORMAT_LEGACY) return 3;
+
+    size_t room = payload_capacity;
+    size_t sample_size = format == IMU_FORMAT_ANGLE ? sizeof(imu_angle_sample_t) : sizeof(imu_sample_t);
+    if (format == IMU_FORMAT_TIMED || format == IMU_FORMAT_ANGLE) {
+        room = room > IMU_TIMED_BASE_SIZE ? room - IMU_TIMED_BASE_SIZE : 0;
+    }
+    size_t count = room / sample_size;
+    return count > 0 ? count : 1;
+}
+
+// Samples per IMU_FORMAT_MULTI packet, 0 if not even one fits
+static inline uint8_t imu_multi_capacity(uint8_t sensor_count, size_t payload_capacity) {
+    if (payload_capacity < IMU_MULTI_BASE_SIZE) return 0;
+    size_t count = (payload_capacity - IMU_MULTI_BASE_SIZE) / IMU_MULTI_SAMPLE_SIZE(sensor_count);
+    return count > UINT8_MAX ? UINT8_MAX : count;
+}
+
+// Link characteristic (0003): connection state after the streaming profile was negotiated
+typedef struct __attribute__((packed)) {
+    uint16_t conn_interval;       // 1.25ms units
+    uint16_t conn_latency;        // connection events the peripheral may skip
+    uint16_t supervision_timeout; // 10ms units
+    uint16_t mtu;                 // ATT MTU
+    uint16_t data_len;            // LL TX octets requested (27 = no Data Length Extension)
+    uint8_t tx_phy;               // 1 = 1M, 2 = 2M, 3 = Coded
+    uint8_t rx_phy;
+    uint16_t l2cap_psm;           // PSM of the streaming L2CAP channel, 0 = GATT only
+    uint16_t l2cap_mtu;           // SDU size of the open channel, 0 = not connected
+} ble_link_info_t;
+
+// Config characteristic (0004): acquisition settings, applied when the next session starts.
+// Reads return what the next session will use, with the rate rounded to what the divider gives.
+typedef struct __attribute__((packed)) {
+    uint16_t sample_rate_hz;      // 4..1000, realised as 1000 / (SMPLRT_DIV + 1)
+    uint8_t dlpf_cfg;             // CONFIG.DLPF_CFG 1..6 (0 and 7 run the gyro at 8kHz, not supported)
+    uint8_t gyro_fs;              // GYRO_CONFIG.FS_SEL 0..3 = +/-250/500/1000/2000 deg/s
+    uint8_t accel_fs;             // ACCEL_CONFIG.AFS_SEL 0..3 = +/-2/4/8/16 g
+} imu_config_t;
+
+#endif
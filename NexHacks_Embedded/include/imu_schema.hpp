@@ -0,0 +1,121 @@
+#ifndef IMU_SCHEMA_H
+#define IMU_SCHEMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Compile-time description of the sample layouts: which MPU6050 channels a sensor block
+// holds, how many sensors a sample carries, how wide its timestamp is and how many samples
+// a packet holds. Sizes and offsets are constexpr, so layouts are checked against each
+// other and against the MTU by static_assert, and the copies between layouts unroll into
+// fixed moves instead of offsets maintained by hand.
+//
+// Channels keep the MPU6050 register order (which is also the FIFO order): accel XYZ,
+// temperature, gyro XYZ, every value big endian as read.
+
+#define IMU_CHANNEL_ACCEL           0x01  // ACCEL_XOUT_H..ACCEL_ZOUT_L, 6 bytes
+#define IMU_CHANNEL_TEMP            0x02  // TEMP_OUT_H..TEMP_OUT_L, 2 bytes
+#define IMU_CHANNEL_GYRO            0x04  // GYRO_XOUT_H..GYRO_ZOUT_L, 6 bytes
+#define IMU_CHANNEL_ALL             (IMU_CHANNEL_ACCEL | IMU_CHANNEL_TEMP | IMU_CHANNEL_GYRO)
+
+// One sensor's block holding the channels in Channels
+template <uint8_t Channels>
+struct imu_sensor_layout {
+    static_assert(Channels != 0 && (Channels & ~IMU_CHANNEL_ALL) == 0, "unknown channel");
+
+    static constexpr uint8_t channels = Channels;
+
+    static constexpr size_t channel_bytes(uint8_t channel) {
+        return !(Channels & channel) ? 0 : (channel == IMU_CHANNEL_TEMP ? 2 : 6);
+    }
+
+    // Offset of a channel in the block (where it would go if absent)
+    static constexpr size_t offset(uint8_t channel) {
+        return channel == IMU_CHANNEL_ACCEL ? 0
+             : channel == IMU_CHANNEL_TEMP ? channel_bytes(IMU_CHANNEL_ACCEL)
+             : channel_bytes(IMU_CHANNEL_ACCEL) + channel_bytes(IMU_CHANNEL_TEMP);
+    }
+
+    static constexpr size_t bytes = offset(IMU_CHANNEL_GYRO) + channel_bytes(IMU_CHANNEL_GYRO);
+
+    // FIFO_EN bits that make the FIFO store exactly this block per sample
+    static constexpr uint8_t fifo_enable = ((Channels & IMU_CHANNEL_TEMP) ? 0x80 : 0) |
+                                           ((Channels & IMU_CHANNEL_GYRO) ? 0x70 : 0) |
+                                           ((Channels & IMU_CHANNEL_ACCEL) ? 0x08 : 0);
+};
+
+// Data registers from ACCEL_XOUT_H: every channel, what a polled burst read returns
+typedef imu_sensor_layout<IMU_CHANNEL_ALL> imu_register_layout;
+
+/**
+ * @brief Copy the channels Dst holds from a Src block. Every channel of Dst must be in Src.
+ */
+template <typename Dst, typename Src>
+static inline void imu_layout_copy(uint8_t* dst, const uint8_t* src) {
+    static_assert((Dst::channels & ~Src::channels) == 0, "source block lacks a channel");
+    if (Dst::channels == Src::channels) {
+        memcpy(dst, src, Dst::bytes);
+        return;
+    }
+    if (Dst::channels & IMU_CHANNEL_ACCEL) {
+        memcpy(dst + Dst::offset(IMU_CHANNEL_ACCEL), src + Src::offset(IMU_CHANNEL_ACCEL), 6);
+    }
+    if (Dst::channels & IMU_CHANNEL_TEMP) {
+        memcpy(dst + Dst::offset(IMU_CHANNEL_TEMP), src + Src::offset(IMU_CHANNEL_TEMP), 2);
+    }
+    if (Dst::channels & IMU_CHANNEL_GYRO) {
+        memcpy(dst + Dst::offset(IMU_CHANNEL_GYRO), src + Src::offset(IMU_CHANNEL_GYRO), 6);
+    }
+}
+
+// One sample: a little-endian timestamp of TimestampBytes (0 = none), then Sensors blocks
+template <uint8_t Sensors, uint8_t Channels, uint8_t TimestampBytes>
+struct imu_sample_layout {
+    static_assert(Sensors > 0, "a sample needs a sensor");
+    static_assert(TimestampBytes <= 4, "timestamps are at most 32 bits");
+
+    typedef imu_sensor_layout<Channels> sensor;
+
+    static constexpr uint8_t sensors = Sensors;
+    static constexpr size_t timestamp_bytes = TimestampBytes;
+    static constexpr size_t bytes = TimestampBytes + Sensors * sensor::bytes;
+
+    static constexpr size_t sensor_offset(size_t s) { return TimestampBytes + s * sensor::bytes; }
+
+    static constexpr size_t offset(size_t s, uint8_t channel) {
+        return sensor_offset(s) + sensor::offset(channel);
+    }
+
+    /**
+     * @brief Write one sample. blocks[s] is sensor s in the Src layout; a sample with more
+     *        sensors than blocks repeats the last one (single-sensor builds in two-sensor formats).
+     */
+    template <typename Src>
+    static inline void pack(uint8_t* out, uint32_t timestamp, const uint8_t* const* blocks, size_t count) {
+        for (size_t i = 0; i < TimestampBytes; i++) out[i] = (uint8_t)(timestamp >> (8 * i));
+        for (size_t s = 0; s < Sensors; s++) {
+            imu_layout_copy<sensor, Src>(out + sensor_offset(s), blocks[s < count ? s : count - 1]);
+        }
+    }
+};
+
+// A packet: HeaderBytes of header, then Samples samples of the given layout
+template <typename Sample, uint8_t Samples, size_t HeaderBytes>
+struct imu_packet_layout {
+    typedef Sample sample;
+
+    static constexpr uint8_t samples = Samples;
+    static constexpr size_t header_bytes = HeaderBytes;
+    static constexpr size_t bytes = HeaderBytes + Samples * Sample::bytes;
+
+    static constexpr size_t sample_offset(size_t i) { return HeaderBytes + i * Sample::bytes; }
+};
+
+// Samples of a layout that fit a payload after a header, for formats sized to the MTU
+template <typename Sample>
+static constexpr size_t imu_layout_max_samples(size_t payload_bytes, size_t header_bytes) {
+    return payload_bytes < header_bytes ? 0 : (payload_bytes - header_bytes) / Sample::bytes;
+}
+
+#endif
@@ -0,0 +1,300 @@
+#ifndef PACKET_BUILDER_H
+#define PACKET_BUILDER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "imu_packet.hpp"
+#include "imu_codec.hpp"
+#include "imu_fusion.hpp"
+
+// Packs samples of all sensors into ble_batch_packet_t in the wire format the link asks for.
+// IMU_FORMAT_MULTI carries every sensor, the other formats the first two (A and B, or the
+// first one twice when there is only one).
+// The sensor processing task drives one of these with the BLE ring / flash recorder as the
+// sink; bench/replay_bench.cpp drives the same code on the host with a mock sink, and
+// bench/decoder_check.cpp checks the app's native decoder against its packets.
+
+// Where packets come from and go to, and what the link currently allows
+typedef struct {
+    ble_batch_packet_t* (*acquire)(void* ctx);   // Next slot to fill in place, nullptr = none free
+    void (*publish)(void* ctx, ble_batch_packet_t* packet, bool dropped); // dropped = no slot was free
+    uint8_t (*format)(void* ctx);                // Requested IMU_FORMAT_*
+    size_t (*payload_capacity)(void* ctx);       // Payload bytes after the batch header at the current MTU
+    void* ctx;
+} packet_sink_t;
+
+typedef struct {
+    packet_sink_t sink;
+    ble_batch_packet_t* packet;   // slot being filled
+    ble_batch_packet_t scratch;   // used when the sink has no free slot
+    int sample_index;
+    int batch_capacity;
+    int latency_capacity;         // samples per packet that keep packets under max_latency_ms
+    uint32_t max_latency_ms;
+    uint8_t rate_code;            // imu_rate_code of the samples, tagged into the version byte
+    uint32_t sequence;
+    uint64_t last_sample_us;      // IMU_FORMAT_TIMED/ANGLE/MULTI: previous sample, for the µs delta
+    imu_delta_encoder_t delta;
+    imu_fusion_t fusion_A;
+    imu_fusion_t fusion_B;
+    bool fusion_running;
+    uint64_t fusion_last_us;
+    uint8_t accel_fs;
+    uint8_t gyro_fs;
+    uint8_t sensor_count;         // IMU_SENSOR_BYTES blocks per pushed sample
+} packet_builder_t;
+
+static inline void packet_builder_init(packet_builder_t* b, const packet_sink_t* sink, uint8_t sensor_count) {
+    memset(b, 0, sizeof(*b));
+    b->sink = *sink;
+    b->sensor_count = sensor_count;
+    b->batch_capacity = 3;
+    b->latency_capacity = 1;
+}
+
+/**
+ * @brief Start a session: sequence ids restart at 0 and the session's rate and ranges
+ *        decide the packet latency cap and the fusion scaling
+ */
+static inline void packet_builder_begin(packet_builder_t* b, const imu_config_t* config, uint32_t max_latency_ms) {
+    int capacity = config->sample_rate_hz * max_latency_ms / 1000;
+    b->latency_capacity = capacity > 0 ? capacity : 1;
+    b->max_latency_ms = max_latency_ms;
+    b->rate_code = 0;
+    b->accel_fs = config->accel_fs;
+    b->gyro_fs = config->gyro_fs;
+    b->sample_index = 0;
+    b->sequence = 0;
+    b->packet = nullptr;
+    b->fusion_running = false;
+}
+
+static inline int16_t packet_builder_be16(const uint8_t* p) {
+    return (int16_t)((p[0] << 8) | p[1]);
+}
+
+// Run both orientation filters on one sample and return the joint angle sample.
+// The filters only run while IMU_FORMAT_ANGLE is selected and restart when it is.
+static inline imu_angle_sample_t packet_builder_fuse(packet_builder_t* b, uint64_t sample_us,
+                                                     const uint8_t* acc_A, const uint8_t* gyro_A,
+                                                     const uint8_t* acc_B, const uint8_t* gyro_B) {
+    int16_t a_A[3], g_A[3], a_B[3], g_B[3];
+    for (int i = 0; i < 3; i++) {
+        a_A[i] = packet_builder_be16(&acc_A[i * 2]);
+        g_A[i] = packet_builder_be16(&gyro_A[i * 2]);
+        a_B[i] = packet_builder_be16(&acc_B[i * 2]);
+        g_B[i] = packet_builder_be16(&gyro_B[i * 2]);
+    }
+
+    if (!b->fusion_running) {
+        imu_fusion_reset(&b->fusion_A);
+        imu_fusion_reset(&b->fusion_B);
+        imu_fusion_set_range(&b->fusion_A, b->accel_fs, b->gyro_fs);
+        imu_fusion_set_range(&b->fusion_B, b->accel_fs, b->gyro_fs);
+        b->fusion_last_us = sample_us;
+        b->fusion_running = true;
+    }
+    uint32_t dt_us = (uint32_t)(sample_us - b->fusion_last_us);
+    b->fusion_last_us = sample_us;
+
+    imu_fusion_update(&b->fusion_A, a_A, g_A, dt_us);
+    imu_fusion_update(&b->fusion_B, a_B, g_B, dt_us);
+
+    uint8_t conf_A = imu_fusion_confidence(&b->fusion_A, a_A);
+    uint8_t conf_B = imu_fusion_confidence(&b->fusion_B, a_B);
+
+    imu_angle_sample_t out;
+    out.time_offset = 0;
+    out.angle_cdeg = (int16_t)(imu_fusion_relative_angle(&b->fusion_A, &b->fusion_B) * 100.0f);
+    out.confidence = conf_A < conf_B ? conf_A : conf_B;
+    return out;
+}
+
+// Claim the next slot and latch format and batch size for it,
+// so an MTU change never splits a packet
+static inline void packet_builder_open(packet_builder_t* b) {
+    b->packet = b->sink.acquire(b->sink.ctx);
+    if (b->packet == nullptr) b->packet = &b->scratch;
+
+    ble_batch_packet_t* packet = b->packet;
+    size_t room = b->sink.payload_capacity(b->sink.ctx);
+    packet->version = b->sink.format(b->sink.ctx);
+    packet->payload_length = 0;
+    if (room < sizeof(imu_sample_t)) {
+        packet->version = IMU_FORMAT_LEGACY; // MTU not negotiated up yet
+    }
+    if (packet->version == IMU_FORMAT_DELTA) {
+        imu_delta_begin(&b->delta, packet->payload, room);
+        b->batch_capacity = b->latency_capacity;
+    } else if (packet->version == IMU_FORMAT_MULTI) {
+        b->batch_capacity = imu_multi_capacity(b->sensor_count, room);
+        if (b->batch_capacity == 0) {
+            packet->version = IMU_FORMAT_LEGACY; // MTU too small for one sample of every sensor
+            b->batch_capacity = imu_batch_capacity(packet->version, room);
+        }
+    } else if ((packet->version == IMU_FORMAT_TIMED || packet->version == IMU_FORMAT_ANGLE) &&
+               room < IMU_TIMED_BASE_SIZE + sizeof(imu_sample_t)) {
+        packet->version = IMU_FORMAT_LEGACY;
+        b->batch_capacity = imu_batch_capacity(packet->version, room);
+    } else {
+        b->batch_capacity = imu_batch_capacity(packet->version, room);
+    }
+
+    // The legacy format has a fixed sample count
+    if (packet->version != IMU_FORMAT_LEGACY && b->batch_capacity > b->latency_capacity) {
+        b->batch_capacity = b->latency_capacity;
+    }
+}
+
+static inline void packet_builder_flush(packet_builder_t* b) {
+    if (b->packet->version != IMU_FORMAT_LEGACY) b->packet->version |= b->rate_code << IMU_VERSION_RATE_SHIFT;
+    b->packet->sample_count = b->sample_index;
+    b->packet->seq_id = b->sequence++;
+
+    // A packet built in scratch had no slot: it is dropped (real-time preference)
+    // and the app sees a seq_id gap
+    b->sink.publish(b->sink.ctx, b->packet, b->packet == &b->scratch);
+
+    b->packet = nullptr;
+    b->sample_index = 0; // Reset
+}
+
+/**
+ * @brief End of a session: publish the partly filled packet rather than losing its samples
+ */
+static inline void packet_builder_finish(packet_builder_t* b) {
+    if (b->packet != nullptr && b->sample_index > 0) packet_builder_flush(b);
+    b->packet = nullptr;
+}
+
+/**
+ * @brief The following samples are captured at rate_hz (adaptive rate): the partly filled packet
+ *        goes out first so every packet has a single rate, and the latency cap follows the rate
+ */
+static inline void packet_builder_set_rate(packet_builder_t* b, uint16_t rate_hz) {
+    packet_builder_finish(b);
+    int capacity = rate_hz * b->max_latency_ms / 1000;
+    b->latency_capacity = capacity > 0 ? capacity : 1;
+    b->rate_code = imu_rate_code(rate_hz);
+}
+
+/**
+ * @brief Cap the samples per packet below what the MTU and the latency cap allow (benchmarks)
+ */
+static inline void packet_builder_limit_batch(packet_builder_t* b, int samples) {
+    if (samples < b->latency_capacity) b->latency_capacity = samples;
+}
+
+/**
+ * @brief Append one sample to the current packet, publish the packet when full.
+ *        sample_us is the sample time and since_start_us the same on the session timeline,
+ *        imu holds sensor_count x IMU_SENSOR_BYTES raw big-endian register bytes
+ *        (accel XYZ then gyro XYZ per sensor).
+ */
+static inline void packet_builder_push(packet_builder_t* b, uint64_t sample_us, uint64_t since_start_us,
+                                       const uint8_t* imu) {
+    const uint8_t* blocks[2] = {imu, b->sensor_count > 1 ? imu + IMU_SENSOR_BYTES : imu};
+    const uint8_t* acc_A = blocks[0] + imu_sensor_block::offset(IMU_CHANNEL_ACCEL);
+    const uint8_t* gyro_A = blocks[0] + imu_sensor_block::offset(IMU_CHANNEL_GYRO);
+    const uint8_t* acc_B = blocks[1] + imu_sensor_block::offset(IMU_CHANNEL_ACCEL);
+    const uint8_t* gyro_B = blocks[1] + imu_sensor_block::offset(IMU_CHANNEL_GYRO);
+
+    if (b->sink.format(b->sink.ctx) == IMU_FORMAT_ANGLE ||
+        (b->packet != nullptr && b->packet->version == IMU_FORMAT_ANGLE)) {
+        imu_angle_sample_t angle = packet_builder_fuse(b, sample_us, acc_A, gyro_A, acc_B, gyro_B);
+        if (b->sample_index == 0) packet_builder_open(b);
+
+        ble_batch_packet_t* packet = b->packet;
+        if (packet->version == IMU_FORMAT_ANGLE) {
+            if (b->sample_index == 0) {
+                packet->angle.base_us = (uint32_t)since_start_us;
+            } else {
+                uint64_t delta_us = sample_us - b->last_sample_us;
+                angle.time_offset = delta_us > UINT16_MAX ? UINT16_MAX : (uint16_t)delta_us;
+            }
+            b->last_sample_us = sample_us;
+            packet->angle.samples[b->sample_index] = angle;
+            b->sample_index++;
+            packet->payload_length = IMU_TIMED_BASE_SIZE + b->sample_index * sizeof(imu_angle_sample_t);
+            if (b->sample_index >= b->batch_capacity) packet_builder_flush(b);
+            return;
+        }
+        // MTU too small for angle packets yet, packet_builder_open fell back to LEGACY
+    } else {
+        b->fusion_running = false;
+    }
+
+    if (b->sample_index == 0) packet_builder_open(b);
+
+    if (b->packet->version == IMU_FORMAT_MULTI) {
+        ble_batch_packet_t* packet = b->packet;
+        uint16_t delta_us = 0;
+        if (b->sample_index == 0) {
+            packet->multi.sensor_count = b->sensor_count;
+            packet->multi.base_us = (uint32_t)since_start_us;
+        } else {
+            uint64_t delta = sample_us - b->last_sample_us;
+            delta_us = delta > UINT16_MAX ? UINT16_MAX : (uint16_t)delta;
+        }
+        b->last_sample_us = sample_us;
+        uint8_t* out = &packet->multi.data[b->sample_index * IMU_MULTI_SAMPLE_SIZE(b->sensor_count)];
+        out[0] = delta_us & 0xFF; // little endian like the other header fields
+        out[1] = delta_us >> 8;
+        memcpy(&out[2], imu, b->sensor_count * IMU_SENSOR_BYTES);
+        b->sample_index++;
+        packet->payload_length = IMU_MULTI_BASE_SIZE + b->sample_index * IMU_MULTI_SAMPLE_SIZE(b->sensor_count);
+        if (b->sample_index >= b->batch_capacity) packet_builder_flush(b);
+        return;
+    }
+
+    imu_sample_t sample;
+    imu_pair_sample_layout::pack<imu_sensor_block>((uint8_t*)&sample, (uint32_t)(since_start_us / 1000), blocks, 2);
+
+    if (b->packet->version == IMU_FORMAT_DELTA) {
+        // Encoded size varies, so the packet is full when the next sample no longer fits
+        if (!imu_delta_append(&b->delta, &sample)) {
+            packet_builder_flush(b);
+            packet_builder_open(b);
+            imu_delta_append(&b->delta, &sample); // keyframe always fits
+        }
+        b->sample_index++;
+        b->packet->payload_length = b->delta.length;
+        if (b->sample_index >= b->batch_capacity) packet_builder_flush(b);
+        return;
+    }
+
+    ble_batch_packet_t* packet = b->packet;
+    if (packet->version == IMU_FORMAT_TIMED) {
+        if (b->sample_index == 0) {
+            packet->timed.base_us = (uint32_t)since_start_us;
+            sample.time_offset = 0;
+        } else {
+            uint64_t delta_us = sample_us - b->last_sample_us;
+            sample.time_offset = delta_us > UINT16_MAX ? UINT16_MAX : (uint16_t)delta_us;
+        }
+        b->last_sample_us = sample_us;
+        packet->timed.samples[b->sample_index] = sample;
+        b->sample_index++;
+        packet->payload_length = IMU_TIMED_BASE_SIZE + b->sample_index * sizeof(imu_sample_t);
+    } else {
+        packet->samples[b->sample_index] = sample;
+        b->sample_index++;
+        packet->payload_length = b->sample_index * sizeof(imu_sample_t);
+    }
+
+    // Buffer Full? Hand it to the sink.
+    if (b->sample_index >= b->batch_capacity) {
+        packet_builder_flush(b);
+    }
+}
+
+/**
+ * @brief On-air bytes of a finished packet (legacy packets skip the batch header)
+ */
+static inline size_t packet_builder_wire_size(const ble_batch_packet_t* packet) {
+    if (packet->version == IMU_FORMAT_LEGACY) return sizeof(ble_packet_t);
+    return IMU_BATCH_HEADER_SIZE + packet->payload_length;
+}
+
+#endif
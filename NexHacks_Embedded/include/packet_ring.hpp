@@ -0,0 +1,63 @@
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free single-producer/single-consumer ring of fixed-size slots.
+// The producer fills a slot in place between acquire() and commit(); the consumer
+// reads it in place between peek() and release(). Nothing is copied in between.
+// N must be a power of two. Indices run freely and wrap through the mask.
+template <typename T, size_t N>
+class SpscRing {
+  static_assert((N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+ public:
+  // Producer: next free slot, or nullptr when the ring is full
+  T* acquire() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) >= N) return nullptr;
+    return &slots_[head & (N - 1)];
+  }
+
+  // Producer: publish the slot returned by acquire()
+  void commit() {
+    size_t head = head_.load(std::memory_order_relaxed) + 1;
+    head_.store(head, std::memory_order_release);
+    size_t used = head - tail_.load(std::memory_order_relaxed);
+    if (used > high_water_.load(std::memory_order_relaxed)) {
+      high_water_.store(used, std::memory_order_relaxed);
+    }
+  }
+
+  // Consumer: oldest committed slot, or nullptr when empty
+  T* peek() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (head_.load(std::memory_order_acquire) == tail) return nullptr;
+    return &slots_[tail & (N - 1)];
+  }
+
+  // Consumer: hand the slot returned by peek() back to the producer
+  void release() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  size_t count() const {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+  }
+
+  static constexpr size_t capacity() { return N; }
+
+  // Most slots in use at once since the last reset_stats()
+  size_t high_water() const { return high_water_.load(std::memory_order_relaxed); }
+  void reset_stats() { high_water_.store(count(), std::memory_order_relaxed); }
+
+ private:
+  T slots_[N];
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+  std::atomic<size_t> high_water_{0};
+};
+
+#endif
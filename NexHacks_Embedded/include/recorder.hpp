@@ -0,0 +1,34 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "esp_err.h"
+#include "imu_packet.hpp"
+
+#define RECORDER_PARTITION_LABEL    "imulog"
+#define RECORDER_PARTITION_SUBTYPE  0x40  // Custom data subtype, see partitions.csv
+#define RECORDER_PAGE_SIZE          4096  // One flash sector, erased and written in single calls
+
+// Log layout: RECORDER_PAGE_SIZE pages of records. Each record is a little-endian uint16
+// length followed by that many bytes of ble_batch_packet_t (header + payload), exactly as
+// they would have been notified. A length of 0xFFFF (erased flash) ends the page, a page
+// starting with 0xFFFF ends the log.
+
+esp_err_t recorder_init();
+
+// Select whether the next session records to flash ("Record") or streams live ("Start").
+// Returns whether it will record, false without a log partition.
+bool recorder_arm(bool enable);
+
+// sensor processing task: start of a session, returns true if this session records to flash
+bool recorder_begin();
+// sensor processing task: append one finished packet, false if it had to be dropped
+bool recorder_append(const ble_batch_packet_t* packet);
+// sensor processing task: end of a session, flushes the last page and terminates the log
+void recorder_end();
+
+// Stream the recorded log through the BLE ring at full link speed ("Offload"). The session
+// controller is SESSION_OFFLOADING until it finishes, so no session can start meanwhile.
+bool recorder_start_offload();
+void recorder_abort_offload();
+
+#endif
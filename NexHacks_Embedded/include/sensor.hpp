@@ -2,13 +2,141 @@
 #define SENSOR_H
 
 #include <atomic>
+#include "imu_packet.hpp"
+#include "diag.hpp"
+#include "i2c_helper.h"
 
 #define MPU_ADDR_A                  0x68
 #define MPU_ADDR_B                  0x69
-#define REG_PWR_MGMT_1              0x6B
+#define REG_SMPLRT_DIV              0x19
+#define REG_CONFIG                  0x1A
+#define REG_GYRO_CONFIG             0x1B
+#define REG_ACCEL_CONFIG            0x1C
+#define REG_FIFO_EN                 0x23
+#define REG_INT_PIN_CFG             0x37
+#define REG_INT_ENABLE              0x38
+#define REG_INT_STATUS              0x3A
 #define REG_ACCEL_XOUT_H            0x3B
+#define REG_USER_CTRL               0x6A
+#define REG_PWR_MGMT_1              0x6B
+#define REG_FIFO_COUNTH             0x72
+#define REG_FIFO_R_W                0x74
+#define REG_WHO_AM_I                0x75
+
+// Register bits
+#define FIFO_EN_SAMPLE              sensor_fifo_layout::fifo_enable // XG | YG | ZG | ACCEL for the accel + gyro block
+#define USER_CTRL_FIFO_EN           0x40
+#define USER_CTRL_FIFO_RESET        0x04
+#define INT_STATUS_FIFO_OFLOW       0x10
+#define INT_ENABLE_DATA_RDY         0x01
+#define INT_PIN_CFG_RD_CLEAR        0x10  // Active high push-pull 50us pulse, cleared by any read
+#define PWR_MGMT_1_CLK_PLL_XGYRO    0x01  // PLL on X gyro, more stable than the 8MHz oscillator
+#define PWR_MGMT_1_SLEEP            0x40
+#define GYRO_CONFIG_FS_SEL_SHIFT    3
+#define ACCEL_CONFIG_AFS_SEL_SHIFT  3
+
+// Sensors, listed in sensor.cpp (sensor_slots) in packet order. Formats 0..4 carry the
+// first two as A and B, IMU_FORMAT_MULTI carries all of them.
+#define SENSOR_COUNT                2     // 1..SENSOR_MAX_COUNT
+#define SENSOR_MAX_COUNT            8     // 0x68 + 0x69 on each of four mux channels, or two buses
+#define SENSOR_NO_INT               -1    // sensor_slot_t.int_io when the INT pin is not wired
+
+typedef struct {
+  i2c_target_t target;          // bus, mux channel and address
+  int int_io;                   // data-ready GPIO for SENSOR_USE_INT, SENSOR_NO_INT if none
+} sensor_slot_t;
+
+// Acquisition
+#define SENSOR_USE_FIFO             1     // 1 = drain hardware FIFO, 0 = poll data registers every tick
+// Boot defaults, the config characteristic (imu_config_t) changes them between sessions
+#define SENSOR_SAMPLE_RATE_HZ       100   // FIFO mode supports up to 1000 (gyro output rate with DLPF on)
+#define SENSOR_DLPF_CFG             1     // CONFIG.DLPF_CFG: 1 = 188Hz bandwidth, gyro output rate 1kHz
+#define SENSOR_GYRO_FS              0     // +/-250 deg/s, what the app assumes unless told otherwise
+#define SENSOR_ACCEL_FS             0     // +/-2 g
+#define SENSOR_RATE_MIN_HZ          4     // SMPLRT_DIV is 8 bits: 1000 / 256
+#define SENSOR_RATE_MAX_HZ          1000
+#define SENSOR_BATCH_MAX_LATENCY_MS 100   // Flush packets at least this often, so slow rates stay live
+#define SENSOR_WAKE_SETTLE_MS       40    // Gyro start-up after leaving sleep mode (30ms typical)
+#define SENSOR_USE_FUSION           1     // Allow IMU_FORMAT_ANGLE (orientation filter per sample in the processing task)
+#define SENSOR_USE_EVENTS           1     // Allow "Events:<mode>" (rep detection per sample in the processing task, imu_events.hpp)
+
+// FIFO, filled with exactly the block the raw ring and the wire formats carry
+typedef imu_sensor_block sensor_fifo_layout;
+#define FIFO_SIZE_BYTES             1024
+#define FIFO_SAMPLE_BYTES           sensor_fifo_layout::bytes // accel XYZ + gyro XYZ, big endian, in register order
+#define FIFO_DRAIN_PERIOD_MS        10    // How often the FIFOs are checked for a full batch
+#define FIFO_DRAIN_MAX_SAMPLES      32    // Largest single burst read (384 bytes)
+// FIFO_COUNT stops at 1024 once the FIFO overflows. A count with no room for another sample is
+// treated as an overflow, so INT_STATUS does not have to be read every round.
+#define FIFO_OVERFLOW_BYTES         ((int)(FIFO_SIZE_BYTES - FIFO_SAMPLE_BYTES))
+#define FIFO_MAX_SKEW_SAMPLES       4     // Allowed count difference between sensors before realigning
+
+// Data-ready interrupts
+#define SENSOR_USE_INT              0     // 1 = wake on MPU6050 INT pins instead of the FreeRTOS tick (needs INT wired)
+#define MPU_INT_A_IO                2     // XIAO ESP32C6: D2/GPIO2 = INT of Sensor A
+#define MPU_INT_B_IO                21    // XIAO ESP32C6: D3/GPIO21 = INT of Sensor B
+#define INT_WAIT_TIMEOUT_MS         100   // No data-ready for this long means INT wiring/sensor fault
+#define INT_TS_RING_SIZE            128   // ISR timestamps kept per sensor, must exceed FIFO depth (85)
+#define FIFO_INT_PERIOD_MS          10    // In FIFO mode wake every this many ms worth of data-ready edges
+
+// Capture / processing split. sensor_task only timestamps and copies register bytes;
+// fusion, encoding, batching and fault logging run in a lower priority processing task (tasks.hpp).
+#define SENSOR_RAW_RING_SLOTS       128   // Raw samples between the two (1.28s at 100Hz), power of two
+#define SENSOR_LOG_INTERVAL_MS      1000  // Capture faults are counted and reported at most this often
+#define SENSOR_BUS_PROBE_ROUNDS     50    // Error-free WHO_AM_I + data reads needed to keep Fast Mode Plus
+#define SENSOR_BUS_MEASURE_ROUNDS   20    // Data reads of every sensor averaged for the boot-time bus measurement
+
+// Pre-trigger, opt-in with "Pretrigger:1" on statusChar: while a central is connected,
+// sensor_task keeps sampling between sessions into a RAM ring. "Start"/"Record" sends the last
+// SENSOR_PRETRIGGER_MS of it ahead of the live stream, so the session timeline
+// (session_timeline_us) begins up to that much before the command; ackChar reports by how much,
+// "Pretriggered:<ms>", before the first data packet.
+// Power: sampling at the session rate for as long as the app stays connected, both MPUs measuring
+// (~3.8mA each) and the CPU and I2C bus woken every drain, where they would otherwise sleep.
+#define SENSOR_PRETRIGGER_MS        500   // 0 = sample only during sessions
+#define SENSOR_PRETRIGGER_SLOTS     128   // Samples kept, power of two; caps SENSOR_PRETRIGGER_MS above 256Hz
+
+// Adaptive rate ("Adaptive:<0|1>" on statusChar, from the next session on): the processing task
+// watches the peak gyro rate of all sensors per SENSOR_ADAPTIVE_WINDOW_MS and sensor_task retunes
+// SMPLRT_DIV and DLPF between capture rounds. At rest the sensors run at SENSOR_ADAPTIVE_REST_HZ,
+// while moving at the configured rate, during fast movements at SENSOR_ADAPTIVE_FAST_HZ. Faster
+// levels start at once, slower ones after SENSOR_ADAPTIVE_HOLD_WINDOWS quiet windows. Packets are
+// rate tagged (imu_packet.hpp).
+#define SENSOR_ADAPTIVE_RATE        1     // Allow "Adaptive:<0|1>"
+#define SENSOR_ADAPTIVE_REST_HZ     25    // Rates must have an imu_rate_code
+#define SENSOR_ADAPTIVE_FAST_HZ     200   // Capped by the capture mode (the tick rate when polling without INT)
+#define SENSOR_ADAPTIVE_MOTION_DPS  20    // Peak gyro rate of a moving limb
+#define SENSOR_ADAPTIVE_FAST_DPS    150   // Peak gyro rate of a fast movement
+#define SENSOR_ADAPTIVE_WINDOW_MS   250
+#define SENSOR_ADAPTIVE_HOLD_WINDOWS 8    // 2s below a level before stepping down to the next slower one
+
+// Benchmark ("Bench:<rate>:<batch>:<seconds>", see BLE.hpp): a session whose samples come from a
+// generator in sensor_task instead of the sensors and run through the same raw ring, processing
+// task and BLE path, for throughput and latency runs against a phone (bench/hil_bench.cpp).
+// Every sensor block of sample k carries, big endian, accel XYZ = the 48-bit µs since session
+// start it was generated at and gyro XY = k (32 bits); gyro Z is 0.
+#define SENSOR_USE_BENCH            1     // Allow "Bench:..."
+#define SENSOR_BENCH_MAX_HZ         4000  // Generated per FIFO_DRAIN_PERIOD_MS round, the raw ring must hold a round
+#define SENSOR_BENCH_MAX_SECONDS    600
 
 void sensor_task(void *pvParameters);
-extern uint64_t session_start;
+// Validate and queue a new acquisition config for the next session, false if out of range
+bool sensor_set_config(const imu_config_t* config);
+// Config the next session will use (the queued one if any)
+void sensor_get_config(imu_config_t* config);
+// Arm the next session as a benchmark, rate_hz 0 = a normal session. batch caps the samples per
+// packet (0 = MTU and SENSOR_BATCH_MAX_LATENCY_MS decide). False if out of range or not built in.
+bool sensor_arm_bench(uint32_t rate_hz, uint32_t batch, uint32_t seconds);
+// Adaptive rate from the next session on, false when enabling it without SENSOR_ADAPTIVE_RATE
+bool sensor_set_adaptive(bool enable);
+// Pre-trigger sampling between sessions, false when enabling it with SENSOR_PRETRIGGER_MS 0
+bool sensor_set_pretrigger(bool enable);
+// Capture side of the diagnostics report, counters since the current session started
+void sensor_diag(diag_report_t* report);
+// Where sensor index 0..SENSOR_COUNT-1 is wired
+const sensor_slot_t* sensor_slot(int index);
+// Boot-time bus check after the sensors are awake: picks the I2C clock (Fast Mode Plus if enabled
+// and reliable) and measures one data read of every sensor
+void sensor_bus_selftest();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,72 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Session controller. One atomic state shared by the BLE host task (commands, disconnects),
+// sensor_task (capture), the sensor processing task and the recorder task. Every transition
+// is a compare-and-swap, so no caller ever blocks, and the ones sensor_task has to act on
+// wake it with a task notification.
+//
+//   IDLE -> ARMING                "Start" / "Record" / "Calibrate", BLE host task
+//   ARMING -> RUNNING             sensor_task, at its next capture round
+//   ARMING/RUNNING -> DRAINING    "Stop", last central gone or calibration stored
+//   DRAINING -> IDLE              processing task, once the session's last packet is published
+//   IDLE -> OFFLOADING -> IDLE    "Offload", until the recorder task has streamed the log
+//
+// Only the BLE host task moves the state out of IDLE, so a command that found it idle owns
+// the next session.
+
+typedef enum : uint8_t {
+  SESSION_IDLE,
+  SESSION_ARMING,
+  SESSION_RUNNING,
+  SESSION_DRAINING,
+  SESSION_OFFLOADING,
+} session_state_t;
+
+// Notification value bit sensor_task is woken with, above the SENSOR_USE_INT data-ready bits
+#define SESSION_NOTIFY_BIT          (1u << 31)
+
+// sensor_task registers itself before it first waits for a session
+void session_attach_capture_task(TaskHandle_t task);
+session_state_t session_state();
+
+// IDLE -> ARMING, false if a session or an offload is in progress. pretrigger: the session
+// starts with the samples sensor_task kept from before the request (SENSOR_PRETRIGGER_MS).
+bool session_request_start(bool pretrigger);
+// ARMING/RUNNING -> DRAINING, false if no session was capturing. Never blocks.
+bool session_request_stop();
+
+// sensor_task: ARMING -> RUNNING, false if the session was stopped while arming. timeline_us
+// (esp_timer) becomes time 0 of the session, published before the state changes.
+bool session_enter_running(uint64_t timeline_us);
+// sensor_task: keep sampling (RUNNING)
+bool session_capturing();
+// sensor_task: the armed session asked for the pre-trigger samples
+bool session_pretrigger();
+// processing task: DRAINING -> IDLE, after the session end marker
+void session_drained();
+// esp_timer time between the last start request and RUNNING
+uint32_t session_start_latency_us();
+// esp_timer time of the last start request
+int64_t session_start_requested_us();
+// Time 0 of the running (or last) session: its oldest pre-trigger sample, else the start
+// request. Written only by sensor_task, not yet valid for a session that is still ARMING.
+uint64_t session_timeline_us();
+
+// IDLE -> OFFLOADING, false if not idle
+bool session_begin_offload();
+// OFFLOADING -> IDLE
+void session_end_offload();
+
+// Keep the sensors awake and configured between sessions (a central is connected), so a start
+// skips SENSOR_WAKE_SETTLE_MS
+void session_set_prewarm(bool enable);
+bool session_prewarm();
+// Wake sensor_task to look at its inputs again (a config queued for the next session)
+void session_wake_capture();
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef TASKS_H
+#define TASKS_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+// Task placement: stack, priority and core of every task the firmware creates, in one place.
+//
+//   capture (sensor_task)    timestamps and copies register bytes, bounded work per wake,
+//                            blocks on the I2C transfers
+//   NimBLE host              ESP-IDF's, CONFIG_BT_NIMBLE_PINNED_TO_CORE, configMAX_PRIORITIES - 4
+//   processing               fusion, encoding, batching
+//   ble_task                 fan-out, history, resends; each notify wakes the host
+//   recorder                 flash writes, a sector erase takes tens of ms
+//
+// Single core (the C6): capture runs above the NimBLE host, so a burst of notifications (and the
+// host's TX-complete handling) never delays a sample read; polled and SENSOR_USE_INT capture
+// timestamp at the read. The host tolerates the few ms a FIFO drain holds it off, connection
+// events are timed by the controller. Dual core: the capture and processing tasks go to the core
+// the host is not pinned to and capture keeps its old priority, ble_task shares the host's core
+// so a notify never crosses cores.
+//
+// The C6 LP core is not used: it only reaches the LP I2C pins (I2C_BUS1_*), the sensors sit on
+// the HP bus, and the HP core already idles between FIFO drains (SENSOR_USE_FIFO).
+
+#ifdef CONFIG_BT_NIMBLE_PINNED_TO_CORE
+#define TASK_HOST_CORE              CONFIG_BT_NIMBLE_PINNED_TO_CORE
+#else
+#define TASK_HOST_CORE              0
+#endif
+#define TASK_HOST_PRIORITY          (configMAX_PRIORITIES - 4) // nimble_port_freertos, not configurable
+
+#if CONFIG_FREERTOS_NUMBER_OF_CORES > 1
+#define TASK_CAPTURE_CORE           (1 - TASK_HOST_CORE)
+#define TASK_PROCESS_CORE           TASK_CAPTURE_CORE
+#define TASK_BLE_CORE               TASK_HOST_CORE
+#define TASK_CAPTURE_ABOVE_HOST     0     // Own core, nothing to preempt it
+#else
+#define TASK_CAPTURE_CORE           tskNO_AFFINITY
+#define TASK_PROCESS_CORE           tskNO_AFFINITY
+#define TASK_BLE_CORE               tskNO_AFFINITY
+#define TASK_CAPTURE_ABOVE_HOST     1     // 0 = below the host, reads wait out notify bursts
+#endif
+#define TASK_RECORDER_CORE          tskNO_AFFINITY
+
+#if TASK_CAPTURE_ABOVE_HOST
+#define TASK_CAPTURE_PRIORITY       (TASK_HOST_PRIORITY + 1) // Shared with the esp_timer task
+#else
+#define TASK_CAPTURE_PRIORITY       10
+#endif
+#define TASK_PROCESS_PRIORITY       7     // Below capture, above BLE
+#define TASK_BLE_PRIORITY           5
+#define TASK_RECORDER_PRIORITY      3     // Below the BLE task
+
+#define TASK_CAPTURE_STACK          4096
+#define TASK_PROCESS_STACK          4096
+#define TASK_BLE_STACK              8192
+#define TASK_RECORDER_STACK         4096
+
+static_assert(TASK_CAPTURE_PRIORITY > TASK_PROCESS_PRIORITY && TASK_PROCESS_PRIORITY > TASK_BLE_PRIORITY &&
+              TASK_BLE_PRIORITY > TASK_RECORDER_PRIORITY, "task priorities out of order");
+static_assert(TASK_PROCESS_PRIORITY < TASK_HOST_PRIORITY, "processing must not hold off the NimBLE host");
+static_assert(TASK_CAPTURE_PRIORITY < configMAX_PRIORITIES, "capture priority out of range");
+
+#endif
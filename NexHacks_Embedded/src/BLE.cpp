@@ -5,22 +5,253 @@
 #include "imu_packet.hpp"
 #include "esp_log.h"
 #include "sensor.hpp"
+#include "recorder.hpp"
+#include "calibration.hpp"
+#include "session.hpp"
+#include "diag.hpp"
+#include "tasks.hpp"
 #include "driver/gpio.h"
+#include "host/ble_hs.h"
+#include "esp_timer.h"
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
 
 static const char* TAG = "IMU_SYSTEM";
 
-QueueHandle_t ble_queue;
+static std::atomic<uint16_t> negotiated_mtu{23}; // smallest MTU among the data subscribers, see refresh_mtu()
+static std::atomic<uint8_t> packet_format{IMU_FORMAT_LEGACY};
+static std::atomic<uint8_t> event_mode{IMU_EVENTS_OFF};
+
+// Benchmark result, handed over by the processing task once the run's last packet is published
+static std::atomic<bool> bench_done{false};
+static uint32_t bench_samples;
+static uint32_t bench_packets;
+static uint32_t bench_duration_ms;
+
+// Connections subscribed to dataChar / diagChar notifications, BLE_HS_CONN_HANDLE_NONE = free
+typedef std::atomic<uint16_t> subscriber_set_t[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+static subscriber_set_t data_subscribers;
+static subscriber_set_t diag_subscribers;
+// Given on every BLE_GAP_EVENT_NOTIFY_TX, i.e. whenever the stack frees a notification mbuf
+static SemaphoreHandle_t tx_done_semaphore;
+
+static void set_subscribed(subscriber_set_t& subscribers, uint16_t conn_handle, bool subscribed) {
+  for (auto& slot : subscribers) {
+    if (slot.load() == conn_handle) slot = BLE_HS_CONN_HANDLE_NONE;
+  }
+  if (!subscribed) return;
+  for (auto& slot : subscribers) {
+    uint16_t expected = BLE_HS_CONN_HANDLE_NONE;
+    if (slot.compare_exchange_strong(expected, conn_handle)) return;
+  }
+}
+
+static bool any_subscribed(const subscriber_set_t& subscribers) {
+  for (auto& slot : subscribers) {
+    if (slot.load() != BLE_HS_CONN_HANDLE_NONE) return true;
+  }
+  return false;
+}
+
+static bool is_subscribed(const subscriber_set_t& subscribers, uint16_t conn_handle) {
+  for (auto& slot : subscribers) {
+    if (slot.load() == conn_handle) return true;
+  }
+  return false;
+}
+
+// Open connections and their ATT MTU. Only the host task (server callbacks) touches them.
+static struct {
+  uint16_t conn_handle;  // BLE_HS_CONN_HANDLE_NONE = free
+  uint16_t mtu;
+} connections[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+
+static void set_connection(uint16_t conn_handle, uint16_t mtu, bool open) {
+  for (auto& c : connections) {
+    if (c.conn_handle == conn_handle) c.conn_handle = BLE_HS_CONN_HANDLE_NONE;
+  }
+  if (!open) return;
+  for (auto& c : connections) {
+    if (c.conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+      c.conn_handle = conn_handle;
+      c.mtu = mtu;
+      return;
+    }
+  }
+}
+
+static int connection_count() {
+  int count = 0;
+  for (auto& c : connections) {
+    if (c.conn_handle != BLE_HS_CONN_HANDLE_NONE) count++;
+  }
+  return count;
+}
+
+// Every subscriber gets the same packets, so they are sized for the smallest MTU among the
+// data subscribers (among all connections while nobody is subscribed)
+static void refresh_mtu() {
+  bool subscribers = any_subscribed(data_subscribers);
+  uint16_t mtu = 0;
+  for (auto& c : connections) {
+    if (c.conn_handle == BLE_HS_CONN_HANDLE_NONE) continue;
+    if (subscribers && !is_subscribed(data_subscribers, c.conn_handle)) continue;
+    if (mtu == 0 || c.mtu < mtu) mtu = c.mtu;
+  }
+  negotiated_mtu = mtu != 0 ? mtu : 23;
+}
+
+// Packets taken off the ring, slot seq_id % BLE_HISTORY_SLOTS: the send queue of every
+// subscriber (see fanout_send) and the source of "Resend". Only ble_task touches them.
+static ble_batch_packet_t history[BLE_HISTORY_SLOTS];
+static bool history_valid[BLE_HISTORY_SLOTS];
+static uint32_t history_head = 0;              // seq_id after the newest packet
+static std::atomic<bool> history_clear{false}; // seq_id restarts with every session / offload
+
+// Position of each data subscriber in the history, cursor i follows data_subscribers[i].
+// Only ble_task touches them.
+typedef struct {
+  uint16_t conn_handle;  // subscriber the cursor was started for, BLE_HS_CONN_HANDLE_NONE = unused
+  uint32_t next_seq;     // next packet to notify
+  int64_t retry_at_us;   // the stack had no buffer for it: leave this connection alone until then
+} fanout_cursor_t;
+
+static fanout_cursor_t cursors[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+
+typedef struct {
+  uint32_t first;
+  uint32_t count;
+  uint32_t next;         // next seq_id to resend
+  uint32_t resent;       // packets found in the history so far
+  uint16_t conn_handle;  // requesting connection
+} resend_range_t;
+
+static QueueHandle_t resend_queue;
+static QueueHandle_t event_queue;  // imu_event_t from sensor processing, notified by ble_task
+
+static bool streaming_session = false; // last session was started with "Start" (host task only)
+static bool recording_session = false; // last session was started with "Record" and records to flash
+
+static ble_link_info_t link_info = {0, 0, 0, 23, 27, 1, 1, 0, 0};
+static esp_timer_handle_t adv_slow_timer;
+static esp_timer_handle_t diag_timer;  // runs only while diagChar is subscribed
+
+static void reset_tx_stats() {
+  ble_tx_stats.sent = 0;
+  ble_tx_stats.retries = 0;
+  ble_tx_stats.drop_ring_full = 0;
+  ble_tx_stats.drop_no_subscriber = 0;
+  ble_tx_stats.drop_stack_nomem = 0;
+  ble_tx_stats.drop_stack_error = 0;
+  ble_tx_stats.resent = 0;
+}
+
+// Forget the history when seq_id starts over, ble_task clears it before its next packet
+static void reset_history() {
+  history_clear = true;
+  xQueueReset(resend_queue);
+}
+
+ble_ring_t ble_ring;
+ble_tx_stats_t ble_tx_stats;
 TaskHandle_t BLE_manager_task_handle;
-SemaphoreHandle_t sensor_run_semaphore;
 
 NimBLECharacteristic* statusChar;
 NimBLECharacteristic* dataChar;
 NimBLECharacteristic* ackChar;
+NimBLECharacteristic* linkChar;
+NimBLECharacteristic* configChar;
+NimBLECharacteristic* diagChar;
+NimBLECharacteristic* eventChar;
+
+static void refresh_link_char() {
+  linkChar->setValue((uint8_t*)&link_info, sizeof(link_info));
+  linkChar->notify();
+}
+
+#if BLE_USE_L2CAP
+// Streaming channel opened by a central on BLE_L2CAP_PSM. While it is connected ble_task
+// writes every packet there and leaves that central out of the dataChar fan-out, so it never
+// gets a packet twice; the other centrals keep their notifications.
+static NimBLEL2CAPChannel* l2cap_channel = nullptr;
+static std::atomic<uint16_t> l2cap_sdu_size{0}; // 0 = no channel
+static std::atomic<uint16_t> l2cap_conn_handle{BLE_HS_CONN_HANDLE_NONE}; // central on the channel
+
+class DataChannelCallbacks : public NimBLEL2CAPChannelCallbacks {
+  void onConnect(NimBLEL2CAPChannel* channel, uint16_t negotiatedMTU) {
+    printf("L2CAP channel open, peer MTU %u\n", negotiatedMTU);
+    l2cap_conn_handle = channel->getConnHandle();
+    l2cap_sdu_size = negotiatedMTU < BLE_L2CAP_MTU ? negotiatedMTU : BLE_L2CAP_MTU;
+    link_info.l2cap_mtu = l2cap_sdu_size;
+    refresh_link_char();
+  }
+  void onRead(NimBLEL2CAPChannel* channel, std::vector<uint8_t>& data) {
+    // Nothing is expected from the central, commands stay on statusChar
+  }
+  void onDisconnect(NimBLEL2CAPChannel* channel) {
+    printf("L2CAP channel closed\n");
+    l2cap_sdu_size = 0;
+    l2cap_conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    link_info.l2cap_mtu = 0;
+    refresh_link_char();
+  }
+};
+#endif
+
+// Connection that reads the L2CAP channel, its dataChar subscription is not served
+static bool on_l2cap(uint16_t conn_handle) {
+  #if BLE_USE_L2CAP
+  return conn_handle != BLE_HS_CONN_HANDLE_NONE && conn_handle == l2cap_conn_handle.load();
+  #else
+  (void)conn_handle;
+  return false;
+  #endif
+}
+
+// Fast advertising window, restarted on boot and on every disconnect; the timer then backs off
+static void adv_start_fast(NimBLEAdvertising* pAdvertising) {
+  pAdvertising->setMinInterval(BLE_ADV_FAST_INTERVAL_MIN);
+  pAdvertising->setMaxInterval(BLE_ADV_FAST_INTERVAL_MAX);
+  esp_timer_stop(adv_slow_timer);
+  esp_timer_start_once(adv_slow_timer, BLE_ADV_FAST_DURATION_MS * 1000ULL);
+}
+
+static void adv_start_slow(NimBLEAdvertising* pAdvertising) {
+  pAdvertising->stop();
+  pAdvertising->setMinInterval(BLE_ADV_SLOW_INTERVAL_MIN);
+  pAdvertising->setMaxInterval(BLE_ADV_SLOW_INTERVAL_MAX);
+  pAdvertising->start();
+}
+
+static void adv_slow_down(void* arg) {
+  if (NimBLEDevice::getServer()->getConnectedCount() >= CONFIG_BT_NIMBLE_MAX_CONNECTIONS) return;
+
+  adv_start_slow(NimBLEDevice::getAdvertising());
+  printf("Advertising slowed down\n");
+}
+
+static void diag_refresh() {
+  diag_report_t report;
+  diag_build_report(&report);
+  diagChar->setValue((uint8_t*)&report, sizeof(report));
+}
+
+static void diag_publish(void* arg) {
+  diag_refresh();
+  diagChar->notify();
+}
 
 NimBLEAdvertising* initBLE() {
-  // 2. Create Queue (Hold up to 10 packets)
-  ble_queue = xQueueCreate(10, sizeof(ble_packet_t));
-  sensor_run_semaphore = xSemaphoreCreateBinary();
+  tx_done_semaphore = xSemaphoreCreateBinary();
+  resend_queue = xQueueCreate(BLE_RESEND_QUEUE_LEN, sizeof(resend_range_t));
+  event_queue = xQueueCreate(BLE_EVENT_QUEUE_LEN, sizeof(imu_event_t));
+  for (auto& slot : data_subscribers) slot = BLE_HS_CONN_HANDLE_NONE;
+  for (auto& slot : diag_subscribers) slot = BLE_HS_CONN_HANDLE_NONE;
+  for (auto& c : connections) c.conn_handle = BLE_HS_CONN_HANDLE_NONE;
+  for (auto& c : cursors) c.conn_handle = BLE_HS_CONN_HANDLE_NONE;
   
   NimBLEDevice::init("SmartPT_Device");
   
@@ -60,8 +291,58 @@ NimBLEAdvertising* initBLE() {
                           NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::NOTIFY
                         );
   dataChar->createDescriptor("2902"); // notifications
+  dataChar->setCallbacks(charCallbacks); // subscription + TX-complete tracking
+
+  // 0x0003 - link characteristic (negotiated interval/PHY/DLE, ble_link_info_t)
+  linkChar = pService->createCharacteristic(
+                          "0003",
+                          NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::NOTIFY
+                        );
+  linkChar->createDescriptor("2902"); // notifications
+  linkChar->setValue((uint8_t*)&link_info, sizeof(link_info));
+
+  // 0x0004 - config characteristic (sample rate, DLPF, full-scale ranges, imu_config_t)
+  configChar = pService->createCharacteristic(
+                          "0004",
+                          NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::WRITE
+                        );
+  configChar->setCallbacks(charCallbacks);
+  imu_config_t config;
+  sensor_get_config(&config);
+  configChar->setValue((uint8_t*)&config, sizeof(config));
 
-  xTaskCreate(ble_task, "BLE", 8192, NULL, 5, &BLE_manager_task_handle);
+  // 0x0005 - diagnostics characteristic (stage histograms, drops, stack marks, diag_report_t)
+  diagChar = pService->createCharacteristic(
+                          "0005",
+                          NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::NOTIFY
+                        );
+  diagChar->createDescriptor("2902"); // notifications
+  diagChar->setCallbacks(charCallbacks); // refreshed on read, published periodically when subscribed
+
+  // 0x0006 - event characteristic (rep start/end, imu_event_t), reads give the last event
+  eventChar = pService->createCharacteristic(
+                          "0006",
+                          NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::NOTIFY
+                        );
+  eventChar->createDescriptor("2902"); // notifications
+
+  const esp_timer_create_args_t diag_timer_args = {
+    .callback = diag_publish,
+    .arg = NULL,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "diag",
+    .skip_unhandled_events = true,
+  };
+  esp_timer_create(&diag_timer_args, &diag_timer);
+
+  #if BLE_USE_L2CAP
+  NimBLEL2CAPServer* l2capServer = NimBLEDevice::createL2CAPServer();
+  l2cap_channel = l2capServer->createService(BLE_L2CAP_PSM, BLE_L2CAP_MTU, new DataChannelCallbacks());
+  if (l2cap_channel != nullptr) link_info.l2cap_psm = BLE_L2CAP_PSM;
+  #endif
+
+  xTaskCreatePinnedToCore(ble_task, "BLE", TASK_BLE_STACK, NULL, TASK_BLE_PRIORITY,
+                          &BLE_manager_task_handle, TASK_BLE_CORE);
   // Start
   pService->start();
   
@@ -70,6 +351,16 @@ NimBLEAdvertising* initBLE() {
   pAdvertising->setName("SmartPT_Device");
   pAdvertising->enableScanResponse(true);
   pAdvertising->setPreferredParams(0x06, 0x12);  // Connection interval preferences
+
+  const esp_timer_create_args_t timer_args = {
+    .callback = adv_slow_down,
+    .arg = NULL,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "adv_slow",
+    .skip_unhandled_events = true,
+  };
+  esp_timer_create(&timer_args, &adv_slow_timer);
+  adv_start_fast(pAdvertising);
   pAdvertising->start();
 
   printf("BLE Started. Waiting...\n");
@@ -77,57 +368,611 @@ NimBLEAdvertising* initBLE() {
   return pAdvertising;
 }
 
+void ble_send_status(const char* status) {
+  ackChar->setValue(std::string(status));
+  ackChar->notify();
+}
+
+void ble_bench_done(uint32_t samples, uint32_t packets, uint32_t duration_ms) {
+  bench_samples = samples;
+  bench_packets = packets;
+  bench_duration_ms = duration_ms;
+  bench_done = true;
+  if (BLE_manager_task_handle != NULL) xTaskNotifyGive(BLE_manager_task_handle);
+}
+
+/**
+ * @brief ble_task: "Bench:Done:..." once every subscriber has the run's last packet
+ */
+static void bench_report() {
+  static diag_report_t report; // ~250 bytes, kept off the task stack
+  diag_build_report(&report);
+  uint32_t ms = bench_duration_ms > 0 ? bench_duration_ms : 1;
+  char reply[192];
+  snprintf(reply, sizeof(reply), "Bench:Done:%lu:%lu:%lu:%lu:%lu:%lu:%lu:%lu:%u:%u:%lu:%lu",
+           (unsigned long)bench_samples, (unsigned long)bench_packets, (unsigned long)report.ble_sent,
+           (unsigned long)report.ble_retries, (unsigned long)report.ble_drop_ring_full,
+           (unsigned long)report.ble_drop_stack_nomem, (unsigned long)report.ble_drop_stack_error,
+           (unsigned long)report.raw_ring_full, report.raw_ring_high_water, report.ble_ring_high_water,
+           (unsigned long)ms, (unsigned long)((uint64_t)report.ble_sent * 1000 / ms));
+  ble_send_status(reply);
+  printf("%s\n", reply);
+}
+
+uint8_t ble_packet_format() {
+  return packet_format.load();
+}
+
+size_t ble_payload_capacity() {
+  uint16_t mtu = negotiated_mtu.load();
+  size_t room = mtu > ATT_NOTIFY_OVERHEAD + IMU_BATCH_HEADER_SIZE
+                  ? mtu - ATT_NOTIFY_OVERHEAD - IMU_BATCH_HEADER_SIZE : 0;
+  return room < IMU_BATCH_MAX_PAYLOAD ? room : IMU_BATCH_MAX_PAYLOAD;
+}
+
+uint8_t ble_batch_capacity(uint8_t format) {
+  return imu_batch_capacity(format, ble_payload_capacity());
+}
+
+uint8_t ble_event_mode() {
+  return event_mode.load();
+}
+
+bool ble_send_event(const imu_event_t* event) {
+  if (xQueueSend(event_queue, event, 0) != pdTRUE) return false;
+  xTaskNotifyGive(BLE_manager_task_handle);
+  return true;
+}
+
+// Refresh the link characteristic from the connection and tell subscribers
+static void publish_link_info(NimBLEConnInfo& connInfo) {
+  link_info.conn_interval = connInfo.getConnInterval();
+  link_info.conn_latency = connInfo.getConnLatency();
+  link_info.supervision_timeout = connInfo.getConnTimeout();
+  link_info.mtu = connInfo.getMTU();
+  refresh_link_char();
+}
+
 void MyServerCallbacks::onConnect(NimBLEServer* pServer, NimBLEConnInfo& connInfo) {
-  printf("Client connected\n");
+  set_connection(connInfo.getConnHandle(), connInfo.getMTU(), true);
+  refresh_mtu();
+  printf("Client connected (%d open)\n", connection_count());
+  session_set_prewarm(true); // sensors awake and configured, "Start" samples right away
+
+  #if BLE_STREAMING_PROFILE
+  // Ask for the shortest interval, the 2M PHY and 251-byte LL PDUs.
+  // The central has the final say; results arrive in onConnParamsUpdate/onPhyUpdate.
+  uint16_t conn_handle = connInfo.getConnHandle();
+  pServer->updateConnParams(conn_handle, BLE_STREAM_INTERVAL_MIN, BLE_STREAM_INTERVAL_MAX,
+                            BLE_STREAM_LATENCY, BLE_STREAM_TIMEOUT);
+  pServer->updatePhy(conn_handle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK, 0);
+  pServer->setDataLen(conn_handle, BLE_STREAM_DATA_LEN);
+  link_info.data_len = BLE_STREAM_DATA_LEN;
+  #endif
+
+  link_info.tx_phy = BLE_GAP_LE_PHY_1M;
+  link_info.rx_phy = BLE_GAP_LE_PHY_1M;
+  publish_link_info(connInfo);
   gpio_set_level(GPIO_NUM_17, 1);
+
+  // Advertising stops on connect. Keep it going slowly while there is room for another
+  // central (the app plus a gateway or a second viewer), they join the running session.
+  if (connection_count() < CONFIG_BT_NIMBLE_MAX_CONNECTIONS) {
+    esp_timer_stop(adv_slow_timer);
+    adv_start_slow(NimBLEDevice::getAdvertising());
+  }
 };
 
 void MyServerCallbacks::onDisconnect(NimBLEServer* pServer, NimBLEConnInfo& connInfo, int reason) {
-  printf("Client disconnected - reason: %d\n", reason);
-  xSemaphoreTake(sensor_run_semaphore, pdMS_TO_TICKS(50)); // stop any recording loop.
+  set_connection(connInfo.getConnHandle(), 0, false);
+  set_subscribed(data_subscribers, connInfo.getConnHandle(), false);
+  set_subscribed(diag_subscribers, connInfo.getConnHandle(), false);
+  refresh_mtu();
+  int remaining = connection_count();
+  printf("Client disconnected - reason: %d (%d open)\n", reason, remaining);
+  if (!any_subscribed(diag_subscribers)) esp_timer_stop(diag_timer);
+  adv_start_fast(NimBLEDevice::getAdvertising()); // advertiseOnDisconnect restarts it with these
+  if (remaining > 0) return; // the session carries on for the others
+
+  // A flash recording outlives the link (out of range, phone locked) until "Stop" from the next
+  // central or a full log partition. Everything else was for a central that is gone.
+  session_state_t state = session_state();
+  if (!(recording_session && (state == SESSION_ARMING || state == SESSION_RUNNING))) session_request_stop();
+  recorder_abort_offload(); // nobody left to stream it to, the log stays for the next "Offload"
+  session_set_prewarm(false);
   gpio_set_level(GPIO_NUM_17, 0);
 }
 
+void MyServerCallbacks::onMTUChange(uint16_t MTU, NimBLEConnInfo& connInfo) {
+  printf("MTU changed to %u\n", MTU);
+  set_connection(connInfo.getConnHandle(), MTU, true);
+  refresh_mtu();
+  publish_link_info(connInfo);
+}
+
+void MyServerCallbacks::onConnParamsUpdate(NimBLEConnInfo& connInfo) {
+  printf("Connection params: interval %u x 1.25ms, latency %u, timeout %u x 10ms\n",
+         connInfo.getConnInterval(), connInfo.getConnLatency(), connInfo.getConnTimeout());
+  publish_link_info(connInfo);
+}
+
+void MyServerCallbacks::onPhyUpdate(NimBLEConnInfo& connInfo, uint8_t txPhy, uint8_t rxPhy) {
+  printf("PHY updated: tx %u, rx %u\n", txPhy, rxPhy);
+  link_info.tx_phy = txPhy;
+  link_info.rx_phy = rxPhy;
+  publish_link_info(connInfo);
+}
+
 void MyCharCallbacks::onRead(NimBLECharacteristic* pChar, NimBLEConnInfo& connInfo) {
+  if (pChar == diagChar) {
+    diag_refresh();
+    return;
+  }
   printf("Characteristic Read\n");
 }
 
 void MyCharCallbacks::onWrite(NimBLECharacteristic* pChar, NimBLEConnInfo& connInfo) {
+  int64_t rx_us = esp_timer_get_time(); // clock sync: take the receive time before anything else
   std::string val = pChar->getValue();
   
   if (pChar == statusChar) {
-    if (val == "Start") {
-      session_start = esp_timer_get_time();
+    session_state_t state = session_state();
+    bool idle = state == SESSION_IDLE;
+    bool capturing = state == SESSION_ARMING || state == SESSION_RUNNING;
+    if ((val == "Start" || val == "Record" || val == "Offload" || val == "Calibrate") && state == SESSION_OFFLOADING) {
+      ble_send_status("Busy"); // the offload owns the BLE ring until it finishes
+    } else if (val == "Start" && capturing && streaming_session) {
+      // Another central joining the live session: seq_id and timeline carry on
+      ble_send_status("ACK");
+      printf("Start command received, joined the running session\n");
+    } else if ((val == "Start" || val == "Record") && !idle) {
+      ble_send_status("Busy"); // a recording or calibration, or the last one still draining
+    } else if (val == "Start" || val == "Record") {
+      // "Record" captures to flash for a later "Offload" instead of streaming live
+      recording_session = recorder_arm(val == "Record");
+      sensor_arm_bench(0, 0, 0);
+      streaming_session = val == "Start";
+      reset_tx_stats();
+      reset_history();
+      diag_reset();
       ackChar->setValue("ACK");
       ackChar->notify();
-      xSemaphoreGive(sensor_run_semaphore);
-      printf("start command received\n");
+      session_request_start(true);
+      printf("%s command received\n", val.c_str());
+    } else if (val == "Calibrate") {
+      // Stationary capture, ends by itself and replies Calib:... (see calibration.hpp)
+      if (!idle) {
+        ble_send_status("Calib:ERR:busy");
+      } else {
+        calibration_arm();
+        recording_session = recorder_arm(false);
+        sensor_arm_bench(0, 0, 0);
+        streaming_session = false;
+        reset_tx_stats();
+        diag_reset();
+        session_request_start(false); // at rest from the command on, earlier samples may still show it moving
+        printf("Calibration capture started\n");
+      }
+    } else if (val.rfind("Bench:", 0) == 0) {
+      // Synthetic throughput/latency run, see BLE.hpp
+      char* end;
+      unsigned long rate = strtoul(val.c_str() + 6, &end, 10);
+      unsigned long batch = *end == ':' ? strtoul(end + 1, &end, 10) : 0;
+      unsigned long seconds = *end == ':' ? strtoul(end + 1, &end, 10) : 0;
+      if (!idle) {
+        ble_send_status("Busy");
+      } else if (rate == 0 || !sensor_arm_bench(rate, batch, seconds)) {
+        ble_send_status("Bench:ERR");
+      } else {
+        recording_session = recorder_arm(false);
+        streaming_session = true;
+        reset_tx_stats();
+        reset_history();
+        diag_reset();
+        ble_send_status("ACK");
+        session_request_start(false);
+        printf("Benchmark: %lu Hz, batch %lu, %lu s\n", rate, batch, seconds);
+      }
+    } else if (val == "Calibrate:Clear") {
+      ble_send_status(idle && calibration_clear() == ESP_OK ? "Calib:Cleared" : "Calib:ERR:busy");
+    } else if (val == "Offload") {
+      if (!idle || !recorder_start_offload()) {
+        ble_send_status("Offload:ERR");
+      } else {
+        reset_tx_stats();
+        reset_history();
+        printf("Offloading recorded session\n");
+      }
     } else if (val == "Stop") {
-      printf("Stopping sensor task\n");
-      xSemaphoreTake(sensor_run_semaphore, pdMS_TO_TICKS(50));
+      recorder_abort_offload();
+      printf("Stopping sensor task (sent %lu, retries %lu, resent %lu, drops: ring %lu, unsubscribed %lu, nomem %lu, error %lu)\n",
+             ble_tx_stats.sent.load(), ble_tx_stats.retries.load(), ble_tx_stats.resent.load(),
+             ble_tx_stats.drop_ring_full.load(), ble_tx_stats.drop_no_subscriber.load(),
+             ble_tx_stats.drop_stack_nomem.load(), ble_tx_stats.drop_stack_error.load());
+      session_request_stop();
+    } else if (val.rfind("Ping:", 0) == 0) {
+      // Clock sync, see BLE.hpp. Reply with the app's send time and our receive/transmit times
+      char pong[96];
+      if (state == SESSION_ARMING) {
+        // The new timeline is fixed once capture starts, a few ms from now
+        snprintf(pong, sizeof(pong), "Pong:%s:Busy", val.c_str() + 5);
+      } else {
+        int64_t timeline_us = (int64_t)session_timeline_us();
+        int64_t tx_us = esp_timer_get_time();
+        snprintf(pong, sizeof(pong), "Pong:%s:%lld:%lld", val.c_str() + 5,
+                 (long long)(rx_us - timeline_us), (long long)(tx_us - timeline_us));
+      }
+      ble_send_status(pong);
+    } else if (val.rfind("Resend:", 0) == 0) {
+      // seq_id range the app found missing, served by ble_task from its history
+      const char* digits = val.c_str() + 7;
+      char* end;
+      uint32_t first = strtoul(digits, &end, 10);
+      bool valid = end != digits && isdigit((unsigned char)*digits);
+      uint32_t last = first;
+      if (valid && *end == ':') {
+        digits = end + 1;
+        last = strtoul(digits, &end, 10);
+        valid = end != digits && isdigit((unsigned char)*digits);
+      }
+      valid = valid && *end == '\0';
+      resend_range_t range = {first, last - first + 1, first, 0, connInfo.getConnHandle()};
+      if (!valid || last < first || last - first >= BLE_HISTORY_SLOTS ||
+          xQueueSend(resend_queue, &range, 0) != pdTRUE) {
+        ble_send_status("Resend:ERR");
+      } else {
+        xTaskNotifyGive(BLE_manager_task_handle);
+      }
+    } else if (val.rfind("Format:", 0) == 0) {
+      // Reply on ackChar so the app knows whether the device supports the format
+      int format = atoi(val.c_str() + 7);
+      if (format == IMU_FORMAT_LEGACY || format == IMU_FORMAT_BATCH || format == IMU_FORMAT_DELTA ||
+          format == IMU_FORMAT_TIMED || (SENSOR_USE_FUSION && format == IMU_FORMAT_ANGLE) ||
+          format == IMU_FORMAT_MULTI) {
+        packet_format = format;
+        ble_send_status(val.c_str());
+        printf("Packet format set to %d\n", format);
+      } else {
+        ble_send_status("Format:ERR");
+      }
+    } else if (val.rfind("Events:", 0) == 0) {
+      int mode = atoi(val.c_str() + 7);
+      if (SENSOR_USE_EVENTS && mode >= IMU_EVENTS_OFF && mode <= IMU_EVENTS_ONLY) {
+        event_mode = mode;
+        ble_send_status(val.c_str());
+        printf("Event mode set to %d\n", mode);
+      } else {
+        ble_send_status("Events:ERR");
+      }
+    } else if (val == "Adaptive:0" || val == "Adaptive:1") {
+      // Like the config, taken up by the next session
+      if (sensor_set_adaptive(val == "Adaptive:1")) {
+        ble_send_status(val.c_str());
+        printf("Adaptive rate %s\n", val == "Adaptive:1" ? "on" : "off");
+      } else {
+        ble_send_status("Adaptive:ERR");
+      }
+    } else if (val == "Pretrigger:0" || val == "Pretrigger:1") {
+      // Sampling between sessions starts or stops right away, the next "Start" replays it
+      if (sensor_set_pretrigger(val == "Pretrigger:1")) {
+        ble_send_status(val.c_str());
+        printf("Pre-trigger sampling %s\n", val == "Pretrigger:1" ? "on" : "off");
+      } else {
+        ble_send_status("Pretrigger:ERR");
+      }
+    }
+  } else if (pChar == configChar) {
+    // Applied by sensor_task when the next session starts, reply with what it will use
+    imu_config_t config;
+    bool ok = val.size() == sizeof(config);
+    if (ok) {
+      memcpy(&config, val.data(), sizeof(config));
+      ok = sensor_set_config(&config);
+    }
+    sensor_get_config(&config);
+    configChar->setValue((uint8_t*)&config, sizeof(config));
+    ble_send_status(ok ? "Config:OK" : "Config:ERR");
+    printf("Config %s: %u Hz, DLPF %u, gyro FS %u, accel FS %u\n", ok ? "queued" : "rejected",
+           config.sample_rate_hz, config.dlpf_cfg, config.gyro_fs, config.accel_fs);
+  }
+}
+
+void MyCharCallbacks::onSubscribe(NimBLECharacteristic* pChar, NimBLEConnInfo& connInfo, uint16_t subValue) {
+  if (pChar == dataChar) {
+    set_subscribed(data_subscribers, connInfo.getConnHandle(), subValue & 0x0001);
+    refresh_mtu();
+    xTaskNotifyGive(BLE_manager_task_handle); // start (or drop) its cursor
+  } else if (pChar == diagChar) {
+    set_subscribed(diag_subscribers, connInfo.getConnHandle(), subValue & 0x0001);
+    // Keep the periodic wake-up away from light sleep unless somebody is listening
+    esp_timer_stop(diag_timer);
+    if (any_subscribed(diag_subscribers)) esp_timer_start_periodic(diag_timer, DIAG_PUBLISH_PERIOD_MS * 1000ULL);
+  }
+}
+
+void MyCharCallbacks::onStatus(NimBLECharacteristic* pChar, int code) {
+  if (pChar == dataChar) {
+    xSemaphoreGive(tx_done_semaphore);
+  }
+}
+
+// Hand one notification to the stack. Returns 0 on success or the host error code.
+static int notify_once(uint16_t conn_handle, const uint8_t* payload, size_t length) {
+  // The mbuf is consumed by the stack whatever the outcome
+  struct os_mbuf* om = ble_hs_mbuf_from_flat(payload, length);
+  return (om != NULL) ? ble_gatts_notify_custom(conn_handle, dataChar->getHandle(), om) : BLE_HS_ENOMEM;
+}
+
+// Notify one connection, retrying while the mbuf pool is exhausted.
+// Returns 0 on success or the last host error code.
+static int notify_with_retry(uint16_t conn_handle, const uint8_t* payload, size_t length) {
+  int rc = BLE_HS_ENOMEM;
+  for (int attempt = 0; attempt <= BLE_NOTIFY_MAX_RETRIES; attempt++) {
+    if (attempt > 0) {
+      ble_tx_stats.retries++;
+      // Wait for the controller to free a buffer, the next connection event at the latest
+      xSemaphoreTake(tx_done_semaphore, pdMS_TO_TICKS(BLE_NOTIFY_RETRY_MS));
+    }
+    rc = notify_once(conn_handle, payload, length);
+    if (rc != BLE_HS_ENOMEM) break;
+  }
+  return rc;
+}
+
+#if BLE_USE_L2CAP
+// Frames packed into the next SDU, written when the next frame would not fit
+static std::vector<uint8_t> l2cap_sdu;
+static uint32_t l2cap_sdu_frames = 0;
+
+static void l2cap_flush() {
+  if (l2cap_sdu.empty()) return;
+  // write() blocks while the central has no credits left, which is the flow control
+  if (l2cap_channel->write(l2cap_sdu)) {
+    ble_tx_stats.sent += l2cap_sdu_frames;
+  } else {
+    ble_tx_stats.drop_stack_error += l2cap_sdu_frames;
+  }
+  l2cap_sdu.clear();
+  l2cap_sdu_frames = 0;
+}
+
+static void l2cap_queue_frame(const ble_batch_packet_t* packet, uint16_t sdu_size) {
+  size_t length = IMU_BATCH_HEADER_SIZE + packet->payload_length;
+  if (l2cap_sdu.size() + 2 + length > sdu_size) l2cap_flush();
+
+  const uint8_t* bytes = (const uint8_t*)packet;
+  l2cap_sdu.push_back(length & 0xFF);
+  l2cap_sdu.push_back(length >> 8);
+  l2cap_sdu.insert(l2cap_sdu.end(), bytes, bytes + length);
+  l2cap_sdu_frames++;
+}
+#endif
+
+// Bytes that go over the air for a packet on dataChar
+static const uint8_t* notify_bytes(const ble_batch_packet_t* packet, size_t* length) {
+  // (uint8_t*) cast treats the struct memory as a raw byte array
+  const uint8_t* payload = (const uint8_t*)packet;
+  *length = IMU_BATCH_HEADER_SIZE + packet->payload_length;
+  if (packet->version == IMU_FORMAT_LEGACY) {
+    payload += IMU_LEGACY_OFFSET;
+    *length = sizeof(ble_packet_t);
+  }
+  return payload;
+}
+
+// Cursor i belongs to a live subscriber that has not sent seq yet
+static bool cursor_behind(size_t i, uint32_t seq) {
+  const fanout_cursor_t* c = &cursors[i];
+  if (c->conn_handle == BLE_HS_CONN_HANDLE_NONE || c->conn_handle != data_subscribers[i].load()) return false;
+  if (on_l2cap(c->conn_handle)) return false;
+  return (int32_t)(seq - c->next_seq) >= 0;
+}
+
+// Storing seq would overwrite a packet some subscriber still has to send
+static bool history_would_drop(uint32_t seq) {
+  size_t slot = seq % BLE_HISTORY_SLOTS;
+  if (!history_valid[slot]) return false;
+  for (size_t i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+    if (cursor_behind(i, history[slot].seq_id)) return true;
+  }
+  return false;
+}
+
+static void history_store(const ble_batch_packet_t* packet) {
+  size_t slot = packet->seq_id % BLE_HISTORY_SLOTS;
+  if (history_valid[slot]) {
+    // A subscriber that has not sent the packet being replaced has fallen a whole history
+    // behind: it loses that packet and continues after it
+    uint32_t replaced = history[slot].seq_id;
+    for (size_t i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+      if (!cursor_behind(i, replaced)) continue;
+      ble_tx_stats.drop_stack_nomem++;
+      cursors[i].next_seq = replaced + 1;
+    }
+  }
+  history[slot] = *packet;
+  history_valid[slot] = true;
+  history_head = packet->seq_id + 1;
+}
+
+/**
+ * @brief Notify every data subscriber from its own position in the history.
+ *        Connections take turns, BLE_FANOUT_BURST packets at a time, and one the stack has
+ *        no buffer for backs off alone while the others carry on.
+ * @return How long ble_task may sleep before the next round (portMAX_DELAY = all caught up)
+ */
+static TickType_t fanout_send() {
+  int64_t now_us = esp_timer_get_time();
+  TickType_t wait = portMAX_DELAY;
+
+  for (size_t i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+    fanout_cursor_t* c = &cursors[i];
+    uint16_t conn_handle = data_subscribers[i].load();
+    if (conn_handle != c->conn_handle) {
+      // New subscriber (or the slot was reused): it starts with the next live packet
+      c->conn_handle = conn_handle;
+      c->next_seq = history_head;
+      c->retry_at_us = 0;
+    }
+    if (conn_handle == BLE_HS_CONN_HANDLE_NONE) continue;
+    if (on_l2cap(conn_handle)) {
+      c->next_seq = history_head; // written to its channel as the ring drained
+      continue;
+    }
+
+    if (now_us >= c->retry_at_us) {
+      for (int sent = 0; sent < BLE_FANOUT_BURST && c->next_seq != history_head; ) {
+        size_t slot = c->next_seq % BLE_HISTORY_SLOTS;
+        if (!history_valid[slot] || history[slot].seq_id != c->next_seq) {
+          c->next_seq++; // dropped before ble_task, already counted as drop_ring_full
+          continue;
+        }
+        size_t length;
+        const uint8_t* payload = notify_bytes(&history[slot], &length);
+        uint32_t notify_start = diag_now();
+        int rc = notify_once(conn_handle, payload, length);
+        diag_record_since(DIAG_STAGE_NOTIFY, notify_start);
+
+        if (rc == BLE_HS_ENOMEM) {
+          // Buffers free up as the controller sends, the next connection event at the latest
+          ble_tx_stats.retries++;
+          c->retry_at_us = now_us + BLE_NOTIFY_RETRY_MS * 1000;
+          break;
+        }
+        if (rc == 0) ble_tx_stats.sent++;
+        else ble_tx_stats.drop_stack_error++;
+        c->next_seq++;
+        sent++;
+      }
+    }
+
+    if (c->next_seq == history_head) continue;
+    TickType_t cursor_wait = 0; // burst used up, its next turn is the next round
+    if (c->retry_at_us > now_us) {
+      cursor_wait = pdMS_TO_TICKS((c->retry_at_us - now_us + 999) / 1000);
+      if (cursor_wait == 0) cursor_wait = 1;
     }
+    if (cursor_wait < wait) wait = cursor_wait;
   }
+  return wait;
+}
+
+// Send the next packet of a resend range to the requester, false once the range is done
+static bool resend_next(resend_range_t* range) {
+  uint32_t seq = range->next++;
+  size_t slot = seq % BLE_HISTORY_SLOTS;
+  if (history_valid[slot] && history[slot].seq_id == seq) {
+    const ble_batch_packet_t* packet = &history[slot];
+    bool ok;
+    #if BLE_USE_L2CAP
+    uint16_t sdu_size = l2cap_sdu_size.load();
+    if (sdu_size > 0 && on_l2cap(range->conn_handle)) {
+      // The live SDU was flushed when the ring drained, this one carries just the resent frame
+      l2cap_queue_frame(packet, sdu_size);
+      ok = l2cap_channel->write(l2cap_sdu);
+      l2cap_sdu.clear();
+      l2cap_sdu_frames = 0;
+    } else
+    #endif
+    {
+      size_t length;
+      const uint8_t* payload = notify_bytes(packet, &length);
+      ok = notify_with_retry(range->conn_handle, payload, length) == 0;
+    }
+    if (ok) ble_tx_stats.resent++;
+    range->resent++;
+  }
+  return range->next - range->first < range->count;
 }
 
 void ble_task(void *pvParameters) {
-  ble_packet_t received_packet;
-  
+  diag_register_task(DIAG_TASK_BLE);
+  #if BLE_USE_L2CAP
+  l2cap_sdu.reserve(BLE_L2CAP_MTU);
+  #endif
+
+  resend_range_t resend;
+  bool resending = false;
+  TickType_t fanout_wait = portMAX_DELAY;
+
   while (1) {
-    // Event driven infinite wait, doesn't block other tasks.
-    if (xQueueReceive(ble_queue, &received_packet, portMAX_DELAY) == pdTRUE) {
-      if (NimBLEDevice::getServer()->getConnectedCount() > 0) {
-        // 3. Set the raw bytes of the struct as the characteristic value
-        // (uint8_t*) cast treats the struct memory as a raw byte array
-        dataChar->setValue((uint8_t*)&received_packet, sizeof(ble_packet_t));
-
-        // 4. Push the notification
-        dataChar->notify();
-
-        // Debug: Only log occasionally or on specific sequence numbers to avoid spamming Serial
-        if (received_packet.seq_id % 100 == 0) {
-            ESP_LOGI(TAG, "Sent Packet Seq #%lu", received_packet.seq_id);
-        }
+    // Event driven infinite wait, sensor processing notifies after each commit.
+    // Subscribers with packets left wake it when they may retry. Pending resends only poll
+    // once fan-out is idle, a subscriber in backoff blocks the task like live data does.
+    bool resend_ready = fanout_wait == portMAX_DELAY && (resending || uxQueueMessagesWaiting(resend_queue) > 0);
+    ulTaskNotifyTake(pdTRUE, resend_ready ? 0 : fanout_wait);
+
+    if (history_clear.exchange(false)) {
+      memset(history_valid, 0, sizeof(history_valid));
+      history_head = 0;
+      for (auto& c : cursors) c.next_seq = 0;
+      resending = false;
+    }
+
+    // Events first, they are rare, small and what the app counts reps from
+    imu_event_t event;
+    while (xQueueReceive(event_queue, &event, 0) == pdTRUE) {
+      eventChar->setValue((uint8_t*)&event, sizeof(event));
+      eventChar->notify();
+    }
+
+    // Move everything pending into the history, which frees the ring straight away however
+    // slow a subscriber is. The subscribers are served from there. An offload has no deadline:
+    // rather than overwrite what the slowest subscriber still has to send, leave the packet on
+    // the ring, offload_record waits for a free slot meanwhile.
+    bool offloading = session_state() == SESSION_OFFLOADING;
+    ble_batch_packet_t* packet;
+    while ((packet = ble_ring.peek()) != nullptr) {
+      if (offloading && history_would_drop(packet->seq_id)) break;
+      #if BLE_USE_L2CAP
+      uint16_t sdu_size = l2cap_sdu_size.load();
+      if (sdu_size > 0) {
+        // Channel open: frames always carry the batch header, the version byte tells the layout
+        uint32_t notify_start = diag_now();
+        l2cap_queue_frame(packet, sdu_size);
+        diag_record_since(DIAG_STAGE_NOTIFY, notify_start);
+      } else
+      #endif
+      if (!any_subscribed(data_subscribers)) {
+        ble_tx_stats.drop_no_subscriber++;
+      }
+      history_store(packet);
+
+      // Every 100th packet, notified to the subscribers by fanout_send below
+      if (packet->seq_id % 100 == 0) {
+          ESP_LOGI(TAG, "Queued packet seq #%lu (ring high-water %u/%u, drops ring/nomem/err %lu/%lu/%lu)",
+                   packet->seq_id, (unsigned)ble_ring.high_water(), (unsigned)ble_ring.capacity(),
+                   ble_tx_stats.drop_ring_full.load(), ble_tx_stats.drop_stack_nomem.load(),
+                   ble_tx_stats.drop_stack_error.load());
       }
+      ble_ring.release();
+    }
+
+    #if BLE_USE_L2CAP
+    // Ring drained: don't hold a partial SDU back until the next packet arrives
+    if (l2cap_sdu_size.load() > 0) {
+      l2cap_flush();
+    } else {
+      l2cap_sdu.clear();
+      l2cap_sdu_frames = 0;
+    }
+    #endif
+
+    fanout_wait = fanout_send();
+
+    if (bench_done.load() && ble_ring.peek() == nullptr && fanout_wait == portMAX_DELAY) {
+      bench_done = false;
+      bench_report();
+    }
+
+    // Retransmissions below live data: one packet per pass, only once every subscriber caught up
+    if (!resending) resending = xQueueReceive(resend_queue, &resend, 0) == pdTRUE;
+    if (resending && ble_ring.peek() == nullptr && fanout_wait == portMAX_DELAY && !resend_next(&resend)) {
+      char reply[48];
+      snprintf(reply, sizeof(reply), "Resent:%lu:%lu:%lu", (unsigned long)resend.first,
+               (unsigned long)(resend.first + resend.count - 1), (unsigned long)resend.resent);
+      ble_send_status(reply);
+      resending = false;
     }
   }
 }
\ No newline at end of file
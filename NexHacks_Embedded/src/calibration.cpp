@@ -0,0 +1,170 @@
+#include "calibration.hpp"
+#include "sensor.hpp"
+#include "BLE.hpp"
+#include "nvs.h"
+#include "esp_log.h"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+static const char* TAG = "CALIBRATION";
+
+typedef struct __attribute__((packed)) {
+  uint8_t version;        // CALIB_BLOB_VERSION
+  uint8_t sensor_count;   // SENSOR_COUNT when stored, a different wiring invalidates it
+  imu_calib_t sensors[SENSOR_COUNT];
+} calib_blob_t;
+
+// Owned by the sensor processing task while sessions run, by the BLE host task in between
+static imu_calib_t calib[SENSOR_COUNT];
+static bool calib_active[SENSOR_COUNT];
+static uint8_t accel_fs = 0;  // ranges of the current session
+static uint8_t gyro_fs = 0;
+
+static std::atomic<bool> armed{false};
+static bool capturing = false;
+static imu_calib_accum_t accum[SENSOR_COUNT];
+
+static void refresh_active() {
+  for (int s = 0; s < SENSOR_COUNT; s++) calib_active[s] = imu_calib_active(&calib[s]);
+}
+
+static void log_calibration(int s) {
+  const imu_calib_t* c = &calib[s];
+  ESP_LOGI(TAG, "Sensor %c: gyro bias %d %d %d, accel offset %d %d %d, scale %u %u %u (Q14), points 0x%02x",
+           'A' + s, c->gyro_bias[0], c->gyro_bias[1], c->gyro_bias[2],
+           c->accel_offset[0], c->accel_offset[1], c->accel_offset[2],
+           c->accel_scale[0], c->accel_scale[1], c->accel_scale[2], c->accel_points);
+}
+
+static esp_err_t calibration_save() {
+  calib_blob_t blob;
+  blob.version = CALIB_BLOB_VERSION;
+  blob.sensor_count = SENSOR_COUNT;
+  memcpy(blob.sensors, calib, sizeof(calib));
+
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(CALIB_NVS_NAMESPACE, NVS_READWRITE, &handle);
+  if (ret != ESP_OK) return ret;
+  ret = nvs_set_blob(handle, CALIB_NVS_KEY, &blob, sizeof(blob));
+  if (ret == ESP_OK) ret = nvs_commit(handle);
+  nvs_close(handle);
+  return ret;
+}
+
+esp_err_t calibration_init() {
+  for (int s = 0; s < SENSOR_COUNT; s++) imu_calib_reset(&calib[s]);
+  refresh_active();
+
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(CALIB_NVS_NAMESPACE, NVS_READONLY, &handle);
+  if (ret == ESP_ERR_NVS_NOT_FOUND) {
+    ESP_LOGI(TAG, "No stored calibration, sending raw samples");
+    return ESP_OK;
+  }
+  if (ret != ESP_OK) return ret;
+
+  calib_blob_t blob;
+  size_t length = sizeof(blob);
+  ret = nvs_get_blob(handle, CALIB_NVS_KEY, &blob, &length);
+  nvs_close(handle);
+  if (ret != ESP_OK) return ret == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : ret;
+
+  if (length != sizeof(blob) || blob.version != CALIB_BLOB_VERSION || blob.sensor_count != SENSOR_COUNT) {
+    ESP_LOGW(TAG, "Stored calibration does not match this build (%u sensors), ignored", blob.sensor_count);
+    return ESP_OK;
+  }
+  memcpy(calib, blob.sensors, sizeof(calib));
+  refresh_active();
+  for (int s = 0; s < SENSOR_COUNT; s++) log_calibration(s);
+  return ESP_OK;
+}
+
+void calibration_arm() {
+  armed = true;
+}
+
+esp_err_t calibration_clear() {
+  for (int s = 0; s < SENSOR_COUNT; s++) imu_calib_reset(&calib[s]);
+  refresh_active();
+
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(CALIB_NVS_NAMESPACE, NVS_READWRITE, &handle);
+  if (ret != ESP_OK) return ret;
+  ret = nvs_erase_key(handle, CALIB_NVS_KEY);
+  if (ret == ESP_OK || ret == ESP_ERR_NVS_NOT_FOUND) ret = nvs_commit(handle);
+  nvs_close(handle);
+  return ret;
+}
+
+bool calibration_begin(const imu_config_t* config) {
+  accel_fs = config->accel_fs;
+  gyro_fs = config->gyro_fs;
+  capturing = armed.exchange(false);
+  if (capturing) {
+    for (int s = 0; s < SENSOR_COUNT; s++) imu_calib_accum_reset(&accum[s]);
+  }
+  return capturing;
+}
+
+/**
+ * @brief Fold the capture into the calibration, store it and tell the app
+ */
+static void calibration_finish() {
+  capturing = false;
+
+  imu_calib_t updated[SENSOR_COUNT];
+  memcpy(updated, calib, sizeof(calib));
+  char moved[SENSOR_COUNT + 1];
+  int moved_count = 0;
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    if (!imu_calib_update(&updated[s], &accum[s], accel_fs, gyro_fs,
+                          CALIB_MAX_GYRO_SPREAD_DPS * CALIB_GYRO_LSB_PER_DPS)) {
+      moved[moved_count++] = 'A' + s;
+    }
+  }
+
+  char reply[32];
+  if (moved_count > 0) {
+    // All or nothing, so every sensor's calibration comes from the same captures
+    moved[moved_count] = '\0';
+    ESP_LOGW(TAG, "Sensor(s) %s moved during the capture, calibration unchanged", moved);
+    snprintf(reply, sizeof(reply), "Calib:ERR:%s", moved);
+    ble_send_status(reply);
+    return;
+  }
+
+  memcpy(calib, updated, sizeof(calib));
+  refresh_active();
+  int faces = 6;
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    log_calibration(s);
+    int points = __builtin_popcount(calib[s].accel_points);
+    if (points < faces) faces = points;
+  }
+  esp_err_t ret = calibration_save();
+  if (ret != ESP_OK) ESP_LOGE(TAG, "Saving the calibration failed (%s)", esp_err_to_name(ret));
+
+  snprintf(reply, sizeof(reply), ret == ESP_OK ? "Calib:OK:%d" : "Calib:ERR:nvs", faces);
+  ble_send_status(reply);
+}
+
+bool calibration_add(const uint8_t* imu, uint64_t since_start_us) {
+  if (!capturing) return false;
+  for (int s = 0; s < SENSOR_COUNT; s++) imu_calib_accum_add(&accum[s], &imu[s * IMU_SENSOR_BYTES]);
+  if (since_start_us < CALIB_CAPTURE_MS * 1000ULL) return false;
+
+  calibration_finish();
+  return true;
+}
+
+void calibration_end() {
+  if (!capturing) return;
+  capturing = false;
+  ble_send_status("Calib:ERR:stopped");
+}
+
+void calibration_apply(int sensor, uint8_t* imu) {
+  if (!calib_active[sensor]) return;
+  imu_calib_apply(&calib[sensor], imu, accel_fs, gyro_fs);
+}
@@ -0,0 +1,55 @@
+#include "diag.hpp"
+#include "BLE.hpp"
+#include "sensor.hpp"
+#include "imu_packet.hpp"
+#include "esp_timer.h"
+#include <cstring>
+
+static_assert(sizeof(diag_report_t) <= CONFIG_BT_NIMBLE_ATT_PREFERRED_MTU - ATT_NOTIFY_OVERHEAD,
+              "diagnostics report must fit one notification");
+
+// Written by one task per stage, read racily by the report builder. A torn read skews one
+// bucket of one report, not worth a lock on the hot path.
+static diag_histogram_t histograms[DIAG_STAGE_COUNT];
+static TaskHandle_t tasks[DIAG_TASK_COUNT];
+
+void diag_record(uint8_t stage, uint32_t cycles) {
+  diag_histogram_t* hist = &histograms[stage];
+  int bucket = 0;
+  if (cycles >> DIAG_HIST_MIN_SHIFT) {
+    bucket = (32 - __builtin_clz(cycles)) - DIAG_HIST_MIN_SHIFT;
+    if (bucket >= DIAG_HIST_BUCKETS) bucket = DIAG_HIST_BUCKETS - 1;
+  }
+  if (hist->buckets[bucket] != UINT16_MAX) hist->buckets[bucket]++;
+  if (cycles > hist->max_cycles) hist->max_cycles = cycles;
+}
+
+void diag_register_task(uint8_t task) {
+  tasks[task] = xTaskGetCurrentTaskHandle();
+}
+
+void diag_reset() {
+  memset(histograms, 0, sizeof(histograms));
+}
+
+void diag_build_report(diag_report_t* report) {
+  memset(report, 0, sizeof(*report));
+  report->version = DIAG_REPORT_VERSION;
+  report->cpu_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+  report->uptime_ms = (uint32_t)(esp_timer_get_time() / 1000);
+  memcpy(report->stages, histograms, sizeof(report->stages));
+
+  sensor_diag(report);
+
+  report->ble_ring_high_water = ble_ring.high_water();
+  report->ble_sent = ble_tx_stats.sent.load();
+  report->ble_retries = ble_tx_stats.retries.load();
+  report->ble_drop_ring_full = ble_tx_stats.drop_ring_full.load();
+  report->ble_drop_no_subscriber = ble_tx_stats.drop_no_subscriber.load();
+  report->ble_drop_stack_nomem = ble_tx_stats.drop_stack_nomem.load();
+  report->ble_drop_stack_error = ble_tx_stats.drop_stack_error.load();
+
+  for (int i = 0; i < DIAG_TASK_COUNT; i++) {
+    if (tasks[i] != NULL) report->stack_free[i] = uxTaskGetStackHighWaterMark(tasks[i]);
+  }
+}
@@ -1,60 +1,240 @@
 #include "i2c_helper.h"
-#include "driver/i2c.h"
+#include "driver/i2c_master.h"
+
+typedef struct {
+  i2c_master_bus_handle_t handle;
+  // Register address / payload bytes of queued transactions. The driver reads them when the
+  // transaction runs, so each queue entry gets its own slot, reused in submission order.
+  // One spare slot: a slot is written before submit blocks on a full queue.
+  uint8_t tx_slots[I2C_ASYNC_QUEUE_DEPTH + 1][2];
+  size_t tx_slot_next;
+  volatile esp_err_t async_status;
+  uint8_t mux_selected;  // channel the mux was last switched to, I2C_MUX_NONE = unknown
+} i2c_bus_t;
+
+static i2c_bus_t buses[I2C_BUS_COUNT];
+
+static uint32_t scl_speed_hz = I2C_MASTER_FREQ_HZ;
+static volatile uint32_t recoveries = 0;
+
+static struct {
+  uint8_t bus;
+  uint8_t addr;
+  i2c_master_dev_handle_t handle;
+} devices[I2C_MAX_DEVICES];
+static size_t device_count = 0;
+
+// Runs in ISR context when a queued transaction finishes, arg is its bus
+static bool on_trans_done(i2c_master_dev_handle_t dev, const i2c_master_event_data_t *evt, void *arg) {
+  i2c_bus_t* bus = (i2c_bus_t*)arg;
+  if (evt->event != I2C_EVENT_DONE && bus->async_status == ESP_OK) {
+    bus->async_status = (evt->event == I2C_EVENT_TIMEOUT) ? ESP_ERR_TIMEOUT : ESP_FAIL;
+  }
+  return false;
+}
+
+/**
+ * @brief Persistent device handle for an address on a bus, attached on first use
+ */
+static i2c_master_dev_handle_t get_device(uint8_t bus, uint8_t addr) {
+  if (bus >= I2C_BUS_COUNT) return NULL;
+  for (size_t i = 0; i < device_count; i++) {
+    if (devices[i].bus == bus && devices[i].addr == addr) return devices[i].handle;
+  }
+  if (device_count >= I2C_MAX_DEVICES) return NULL;
+
+  i2c_device_config_t dev_conf = {
+    .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+    .device_address = addr,
+    .scl_speed_hz = scl_speed_hz,
+  };
+  i2c_master_dev_handle_t handle;
+  if (i2c_master_bus_add_device(buses[bus].handle, &dev_conf, &handle) != ESP_OK) return NULL;
+
+  // A registered callback switches every transaction on this device to asynchronous
+  i2c_master_event_callbacks_t cbs = {
+    .on_trans_done = on_trans_done,
+  };
+  if (i2c_master_register_event_callbacks(handle, &cbs, &buses[bus]) != ESP_OK) {
+    i2c_master_bus_rm_device(handle);
+    return NULL;
+  }
+
+  devices[device_count].bus = bus;
+  devices[device_count].addr = addr;
+  devices[device_count].handle = handle;
+  device_count++;
+  return handle;
+}
+
+static uint8_t* next_tx_slot(i2c_bus_t* bus) {
+  uint8_t* slot = bus->tx_slots[bus->tx_slot_next];
+  bus->tx_slot_next = (bus->tx_slot_next + 1) % (I2C_ASYNC_QUEUE_DEPTH + 1);
+  return slot;
+}
+
+/**
+ * @brief Queue a mux channel switch ahead of a transaction if the target needs a different one
+ */
+static esp_err_t select_channel(const i2c_target_t* target) {
+  if (target->mux_channel == I2C_MUX_NONE) return ESP_OK;
+  i2c_bus_t* bus = &buses[target->bus];
+  if (bus->mux_selected == target->mux_channel) return ESP_OK;
+
+  i2c_master_dev_handle_t mux = get_device(target->bus, I2C_MUX_ADDR);
+  if (mux == NULL) return ESP_ERR_NOT_FOUND;
+
+  uint8_t* tx = next_tx_slot(bus);
+  tx[0] = 1u << target->mux_channel;
+  esp_err_t ret = i2c_master_transmit(mux, tx, 1, I2C_XFER_TIMEOUT_MS);
+  bus->mux_selected = (ret == ESP_OK) ? target->mux_channel : I2C_MUX_NONE;
+  return ret;
+}
+
+static esp_err_t wait_bus(uint8_t index) {
+  i2c_bus_t* bus = &buses[index];
+  esp_err_t ret = i2c_master_bus_wait_all_done(bus->handle, I2C_WAIT_TIMEOUT_MS);
+  if (ret == ESP_OK) ret = bus->async_status;
+  bus->async_status = ESP_OK;
+  if (ret == ESP_OK) return ret;
+
+  bus->mux_selected = I2C_MUX_NONE; // a failed switch leaves the channel unknown
+  if (ret != ESP_FAIL) {
+    // Timeout: a slave may be holding SDA low mid-byte. Clock it free and restart the
+    // controller so the next round starts clean instead of timing out again. A NACK
+    // (ESP_FAIL) leaves the bus idle and needs nothing.
+    i2c_master_bus_reset(bus->handle);
+    recoveries++;
+  }
+  return ret;
+}
 
 /**
- * @brief Initialize the ESP32-C6 I2C Master Interface
+ * @brief Initialize the ESP32-C6 I2C Master Interface (and the LP I2C bus if enabled)
  */
 esp_err_t i2c_master_init() {
-  i2c_config_t conf = {
-    .mode = I2C_MODE_MASTER,
+  i2c_master_bus_config_t conf = {
+    .i2c_port = I2C_MASTER_NUM,
     .sda_io_num = I2C_MASTER_SDA_IO,
     .scl_io_num = I2C_MASTER_SCL_IO,
-    .sda_pullup_en = GPIO_PULLUP_ENABLE, // Internal pullups (Use external 2.2k if possible)
-    .scl_pullup_en = GPIO_PULLUP_ENABLE,
-    .master.clk_speed = I2C_MASTER_FREQ_HZ,
+    .clk_source = I2C_CLK_SRC_DEFAULT,
+    .glitch_ignore_cnt = 7,
+    .trans_queue_depth = I2C_ASYNC_QUEUE_DEPTH,
+    .flags.enable_internal_pullup = true, // Internal pullups (Use external 2.2k if possible)
   };
-  i2c_param_config(I2C_MASTER_NUM, &conf);
-  return i2c_driver_install(I2C_MASTER_NUM, conf.mode, 0, 0, 0);
+  esp_err_t ret = i2c_new_master_bus(&conf, &buses[0].handle);
+  buses[0].mux_selected = I2C_MUX_NONE;
+
+  #if I2C_BUS_COUNT > 1
+  i2c_master_bus_config_t lp_conf = {
+    .i2c_port = LP_I2C_NUM_0,
+    .sda_io_num = I2C_BUS1_SDA_IO,
+    .scl_io_num = I2C_BUS1_SCL_IO,
+    .lp_source_clk = LP_I2C_SCLK_DEFAULT,
+    .glitch_ignore_cnt = 7,
+    .trans_queue_depth = I2C_ASYNC_QUEUE_DEPTH,
+    .flags.enable_internal_pullup = true,
+  };
+  if (ret == ESP_OK) ret = i2c_new_master_bus(&lp_conf, &buses[1].handle);
+  buses[1].mux_selected = I2C_MUX_NONE;
+  #endif
+  return ret;
 }
 
 /**
  * @brief Write a single byte to a register (Used for waking up MPU)
  */
-esp_err_t mpu6050_write_byte(uint8_t addr, uint8_t reg, uint8_t data) {
-  i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-  i2c_master_start(cmd);
-  i2c_master_write_byte(cmd, (addr << 1) | I2C_MASTER_WRITE, true);
-  i2c_master_write_byte(cmd, reg, true);
-  i2c_master_write_byte(cmd, data, true);
-  i2c_master_stop(cmd);
-  esp_err_t ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
-  i2c_cmd_link_delete(cmd);
+esp_err_t i2c_write_byte(const i2c_target_t* target, uint8_t reg, uint8_t data) {
+  i2c_master_dev_handle_t dev = get_device(target->bus, target->addr);
+  if (dev == NULL) return ESP_ERR_NOT_FOUND;
+
+  esp_err_t ret = select_channel(target);
+  if (ret != ESP_OK) return ret;
+
+  uint8_t* tx = next_tx_slot(&buses[target->bus]);
+  tx[0] = reg;
+  tx[1] = data;
+  ret = i2c_master_transmit(dev, tx, 2, I2C_XFER_TIMEOUT_MS);
+  if (ret != ESP_OK) return ret;
+  return wait_bus(target->bus);
+}
+
+/**
+ * @brief Queue a register-addressed burst read without waiting for it
+ */
+esp_err_t i2c_read_burst_async(const i2c_target_t* target, uint8_t start_reg, uint8_t *buffer, size_t len) {
+  i2c_master_dev_handle_t dev = get_device(target->bus, target->addr);
+  if (dev == NULL) return ESP_ERR_NOT_FOUND;
+
+  esp_err_t ret = select_channel(target);
+  if (ret != ESP_OK) return ret;
+
+  // Write the register address, repeated start, read N bytes (last one NACKed by the driver)
+  uint8_t* tx = next_tx_slot(&buses[target->bus]);
+  tx[0] = start_reg;
+  return i2c_master_transmit_receive(dev, tx, 1, buffer, len, I2C_XFER_TIMEOUT_MS);
+}
+
+/**
+ * @brief Block until every bus queue is empty and report how the queued transactions went
+ */
+esp_err_t i2c_wait_all() {
+  esp_err_t ret = ESP_OK;
+  for (uint8_t bus = 0; bus < I2C_BUS_COUNT; bus++) {
+    esp_err_t bus_ret = wait_bus(bus);
+    if (ret == ESP_OK) ret = bus_ret;
+  }
   return ret;
 }
 
+/**
+ * @brief Change the SCL clock: device handles carry the speed, so they are dropped and
+ *        attached again at the new speed on their next use
+ */
+esp_err_t i2c_set_speed(uint32_t hz) {
+  esp_err_t ret = i2c_wait_all();
+  for (size_t i = 0; i < device_count; i++) {
+    i2c_master_bus_rm_device(devices[i].handle);
+  }
+  device_count = 0;
+  for (uint8_t bus = 0; bus < I2C_BUS_COUNT; bus++) buses[bus].mux_selected = I2C_MUX_NONE;
+  scl_speed_hz = hz;
+  return ret;
+}
+
+uint32_t i2c_get_speed() {
+  return scl_speed_hz;
+}
+
+uint32_t i2c_recovery_count() {
+  return recoveries;
+}
+
 /**
  * @brief Read multiple bytes in one go (Burst Read)
  * This is the critical function for speed.
  */
+esp_err_t i2c_read_burst(const i2c_target_t* target, uint8_t start_reg, uint8_t *buffer, size_t len) {
+  esp_err_t ret = i2c_read_burst_async(target, start_reg, buffer, len);
+  if (ret != ESP_OK) return ret;
+  return wait_bus(target->bus);
+}
+
+esp_err_t mpu6050_write_byte(uint8_t addr, uint8_t reg, uint8_t data) {
+  i2c_target_t target = { 0, I2C_MUX_NONE, addr };
+  return i2c_write_byte(&target, reg, data);
+}
+
+esp_err_t mpu6050_read_burst_async(uint8_t addr, uint8_t start_reg, uint8_t *buffer, size_t len) {
+  i2c_target_t target = { 0, I2C_MUX_NONE, addr };
+  return i2c_read_burst_async(&target, start_reg, buffer, len);
+}
+
+esp_err_t mpu6050_wait_all() {
+  return i2c_wait_all();
+}
+
 esp_err_t mpu6050_read_burst(uint8_t addr, uint8_t start_reg, uint8_t *buffer, size_t len) {
-  i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-  
-  // 1. Write the register address we want to start reading from
-  i2c_master_start(cmd);
-  i2c_master_write_byte(cmd, (addr << 1) | I2C_MASTER_WRITE, true);
-  i2c_master_write_byte(cmd, start_reg, true);
-  
-  // 2. Restart and Read N bytes
-  i2c_master_start(cmd);
-  i2c_master_write_byte(cmd, (addr << 1) | I2C_MASTER_READ, true);
-  if (len > 1) {
-    i2c_master_read(cmd, buffer, len - 1, I2C_MASTER_ACK);
-  }
-  i2c_master_read_byte(cmd, buffer + len - 1, I2C_MASTER_NACK); // Last byte gets NACK
-  i2c_master_stop(cmd);
-  
-  // 3. Execute the transaction
-  esp_err_t ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
-  i2c_cmd_link_delete(cmd);
-  return ret;
-}
\ No newline at end of file
+  i2c_target_t target = { 0, I2C_MUX_NONE, addr };
+  return i2c_read_burst(&target, start_reg, buffer, len);
+}
@@ -6,13 +6,24 @@
 #include "esp_log.h"
 #include "sensor.hpp"
 #include "BLE.hpp"
+#include "recorder.hpp"
+#include "calibration.hpp"
+#include "tasks.hpp"
+#include "nvs_flash.h"
 #include "driver/gpio.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
 #include <cstring>
 
 static const char* TAG = "IMU_SYSTEM";
 
 #define LED_RED GPIO_NUM_17
 
+// Dynamic frequency scaling between sessions, sensor_task holds the max clock while sampling
+#define PM_MAX_FREQ_MHZ 160
+#define PM_MIN_FREQ_MHZ 40   // XTAL frequency, the lowest the C6 runs the radio at
+
 // Blink red LED forever to indicate sensor error
 static void blink_red_forever() {
   while (1) {
@@ -33,56 +44,60 @@ static bool is_data_all_zeros(const uint8_t* data, size_t len) {
 
 // Validate sensor connections by reading data and checking for zeros
 static bool validate_sensors() {
-  uint8_t raw_data[14];
-  bool sensor_a_ok = false;
-  bool sensor_b_ok = false;
+  uint8_t raw_data[imu_register_layout::bytes];
+  bool all_ok = true;
 
   // Wake up sensors
-  esp_err_t retA = mpu6050_write_byte(MPU_ADDR_A, REG_PWR_MGMT_1, 0x00);
-  esp_err_t retB = mpu6050_write_byte(MPU_ADDR_B, REG_PWR_MGMT_1, 0x00);
-
-  if (retA != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to wake Sensor A (0x68)");
-    return false;
-  }
-  if (retB != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to wake Sensor B (0x69)");
-    return false;
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    const i2c_target_t* target = &sensor_slot(s)->target;
+    if (i2c_write_byte(target, REG_PWR_MGMT_1, 0x00) != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to wake Sensor %c (0x%02x, bus %u, mux %u)", 'A' + s, target->addr,
+               target->bus, target->mux_channel);
+      return false;
+    }
   }
 
   // Wait for sensors to stabilize after wake
   vTaskDelay(pdMS_TO_TICKS(100));
 
-  // Read and validate Sensor A
-  memset(raw_data, 0, sizeof(raw_data));
-  if (mpu6050_read_burst(MPU_ADDR_A, REG_ACCEL_XOUT_H, raw_data, 14) == ESP_OK) {
-    if (!is_data_all_zeros(raw_data, 14)) {
-      sensor_a_ok = true;
-      ESP_LOGI(TAG, "Sensor A (0x68) OK");
+  // Read and validate every sensor
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    const i2c_target_t* target = &sensor_slot(s)->target;
+    memset(raw_data, 0, sizeof(raw_data));
+    if (i2c_read_burst(target, REG_ACCEL_XOUT_H, raw_data, sizeof(raw_data)) == ESP_OK) {
+      if (!is_data_all_zeros(raw_data, sizeof(raw_data))) {
+        ESP_LOGI(TAG, "Sensor %c (0x%02x) OK", 'A' + s, target->addr);
+      } else {
+        ESP_LOGE(TAG, "Sensor %c (0x%02x) returns all zeros - bad connection", 'A' + s, target->addr);
+        all_ok = false;
+      }
     } else {
-      ESP_LOGE(TAG, "Sensor A (0x68) returns all zeros - bad connection");
+      ESP_LOGE(TAG, "Sensor %c (0x%02x) read failed", 'A' + s, target->addr);
+      all_ok = false;
     }
-  } else {
-    ESP_LOGE(TAG, "Sensor A (0x68) read failed");
   }
 
-  // Read and validate Sensor B
-  memset(raw_data, 0, sizeof(raw_data));
-  if (mpu6050_read_burst(MPU_ADDR_B, REG_ACCEL_XOUT_H, raw_data, 14) == ESP_OK) {
-    if (!is_data_all_zeros(raw_data, 14)) {
-      sensor_b_ok = true;
-      ESP_LOGI(TAG, "Sensor B (0x69) OK");
-    } else {
-      ESP_LOGE(TAG, "Sensor B (0x69) returns all zeros - bad connection");
-    }
-  } else {
-    ESP_LOGE(TAG, "Sensor B (0x69) read failed");
-  }
+  return all_ok;
+}
 
-  return sensor_a_ok && sensor_b_ok;
+// Let the CPU scale down and enter light sleep automatically whenever nothing holds a PM lock
+static void power_init() {
+  #if CONFIG_PM_ENABLE
+  esp_pm_config_t pm_config = {
+    .max_freq_mhz = PM_MAX_FREQ_MHZ,
+    .min_freq_mhz = PM_MIN_FREQ_MHZ,
+    .light_sleep_enable = true,
+  };
+  esp_err_t ret = esp_pm_configure(&pm_config);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Power management not enabled (%s)", esp_err_to_name(ret));
+  }
+  #endif
 }
 
 void mainfunc() {
+  power_init();
+
   // 1. Init GPIOs for LEDs
   gpio_reset_pin(GPIO_NUM_19);
   gpio_reset_pin(GPIO_NUM_17);
@@ -102,10 +117,26 @@ void mainfunc() {
   }
   ESP_LOGI(TAG, "Sensors validated successfully");
 
+  // Bus clock and timing, before streaming starts
+  sensor_bus_selftest();
+
+  // Flash session log (optional, streaming works without it)
+  recorder_init();
+
+  // Stored sensor calibration (NimBLE shares the NVS partition for its bonding keys)
+  esp_err_t nvs_ret = nvs_flash_init();
+  if (nvs_ret == ESP_ERR_NVS_NO_FREE_PAGES || nvs_ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+    ESP_ERROR_CHECK(nvs_flash_erase());
+    nvs_ret = nvs_flash_init();
+  }
+  if (nvs_ret != ESP_OK || calibration_init() != ESP_OK) {
+    ESP_LOGE(TAG, "Calibration storage unavailable, sending raw samples");
+  }
+
   // 4. Start Tasks
-  // Sensor Task: Priority 10 (High)
-  // BLE Task: Priority 5 (Medium)
-  xTaskCreate(sensor_task, "SensorTask", 4096, NULL, 10, NULL);
+  // Sensor Task starts its processing task, initBLE the BLE task (placement in tasks.hpp)
+  xTaskCreatePinnedToCore(sensor_task, "SensorTask", TASK_CAPTURE_STACK, NULL, TASK_CAPTURE_PRIORITY, NULL,
+                          TASK_CAPTURE_CORE);
   initBLE();
 }
 
@@ -0,0 +1,231 @@
+#include "recorder.hpp"
+#include "diag.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_partition.h"
+#include "esp_log.h"
+#include "BLE.hpp"
+#include "session.hpp"
+#include "tasks.hpp"
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+
+static const char* TAG = "RECORDER";
+
+typedef enum {
+  RECORDER_CMD_BEGIN,       // rewind to the start of the partition
+  RECORDER_CMD_WRITE_PAGE,  // page = index of the page buffer to write
+  RECORDER_CMD_FINALIZE,    // terminate the log after the last written page
+  RECORDER_CMD_OFFLOAD,
+} recorder_cmd_type_t;
+
+typedef struct {
+  recorder_cmd_type_t type;
+  int page;
+} recorder_cmd_t;
+
+static const esp_partition_t* log_partition = NULL;
+static QueueHandle_t cmd_queue;
+
+// Double buffered pages: the sensor processing task fills one while the recorder task writes the other
+static uint8_t pages[2][RECORDER_PAGE_SIZE];
+static std::atomic<bool> page_busy[2];
+static int fill_page = 0;
+static size_t fill_pos = 0;
+static size_t pages_queued = 0;   // pages handed to the recorder task this session
+
+static size_t write_offset = 0;   // recorder task only: next sector to erase and write
+static std::atomic<bool> armed{false};
+static std::atomic<bool> offload_abort{false};
+
+static uint32_t records_written = 0;
+static uint32_t records_dropped = 0;
+static bool log_full = false; // this session filled the partition and asked to stop
+
+static void write_page(int page) {
+  if (write_offset + RECORDER_PAGE_SIZE > log_partition->size) {
+    ESP_LOGE(TAG, "Log partition full, page dropped");
+  } else {
+    esp_err_t ret = esp_partition_erase_range(log_partition, write_offset, RECORDER_PAGE_SIZE);
+    if (ret == ESP_OK) ret = esp_partition_write(log_partition, write_offset, pages[page], RECORDER_PAGE_SIZE);
+    if (ret != ESP_OK) ESP_LOGE(TAG, "Page write failed: %s", esp_err_to_name(ret));
+    write_offset += RECORDER_PAGE_SIZE;
+  }
+  page_busy[page] = false;
+}
+
+static void finalize_log() {
+  // Erased sector after the last page marks the end of the log
+  if (write_offset + RECORDER_PAGE_SIZE <= log_partition->size) {
+    esp_partition_erase_range(log_partition, write_offset, RECORDER_PAGE_SIZE);
+  }
+  printf("Recording saved: %lu records, %lu dropped, %u bytes of flash\n",
+         records_written, records_dropped, (unsigned)write_offset);
+}
+
+// Hand one record to the BLE task, waiting for a free ring slot rather than dropping.
+// Offload only runs while no sensor session is active, so this task is the ring's only producer.
+static bool offload_record(const uint8_t* data, uint16_t length) {
+  ble_batch_packet_t* slot;
+  while ((slot = ble_ring.acquire()) == nullptr) {
+    if (offload_abort) return false;
+    vTaskDelay(1);
+  }
+  memcpy(slot, data, length);
+  slot->payload_length = length - IMU_BATCH_HEADER_SIZE;
+  ble_ring.commit();
+  xTaskNotifyGive(BLE_manager_task_handle);
+  return true;
+}
+
+static void offload_log() {
+  uint8_t* page = pages[0];
+  uint32_t records = 0;
+  bool done = false;
+
+  for (size_t offset = 0; !done && offset + RECORDER_PAGE_SIZE <= log_partition->size;
+       offset += RECORDER_PAGE_SIZE) {
+    if (esp_partition_read(log_partition, offset, page, RECORDER_PAGE_SIZE) != ESP_OK) break;
+
+    size_t pos = 0;
+    while (pos + 2 <= RECORDER_PAGE_SIZE) {
+      uint16_t length = page[pos] | (page[pos + 1] << 8);
+      if (length == 0xFFFF) {
+        done = (pos == 0); // empty page = end of log
+        break;
+      }
+      if (length < IMU_BATCH_HEADER_SIZE || length > IMU_BATCH_HEADER_SIZE + IMU_BATCH_MAX_PAYLOAD ||
+          pos + 2 + length > RECORDER_PAGE_SIZE) {
+        ESP_LOGE(TAG, "Corrupt record at 0x%x", (unsigned)(offset + pos));
+        done = true;
+        break;
+      }
+      if (!offload_record(&page[pos + 2], length)) {
+        done = true;
+        break;
+      }
+      records++;
+      pos += 2 + length;
+    }
+  }
+
+  char status[32];
+  snprintf(status, sizeof(status), "Offload:%s:%lu", offload_abort ? "Aborted" : "Done", records);
+  ble_send_status(status);
+  printf("%s\n", status);
+  session_end_offload();
+}
+
+static void recorder_task(void *pvParameters) {
+  diag_register_task(DIAG_TASK_RECORDER);
+  recorder_cmd_t cmd;
+  while (1) {
+    if (xQueueReceive(cmd_queue, &cmd, portMAX_DELAY) != pdTRUE) continue;
+    switch (cmd.type) {
+      case RECORDER_CMD_BEGIN:      write_offset = 0;     break;
+      case RECORDER_CMD_WRITE_PAGE: write_page(cmd.page); break;
+      case RECORDER_CMD_FINALIZE:   finalize_log();       break;
+      case RECORDER_CMD_OFFLOAD:    offload_log();        break;
+    }
+  }
+}
+
+esp_err_t recorder_init() {
+  log_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                           (esp_partition_subtype_t)RECORDER_PARTITION_SUBTYPE,
+                                           RECORDER_PARTITION_LABEL);
+  if (log_partition == NULL) {
+    ESP_LOGE(TAG, "No '%s' partition, flash recording disabled", RECORDER_PARTITION_LABEL);
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  cmd_queue = xQueueCreate(4, sizeof(recorder_cmd_t));
+  xTaskCreatePinnedToCore(recorder_task, "Recorder", TASK_RECORDER_STACK, NULL, TASK_RECORDER_PRIORITY,
+                          NULL, TASK_RECORDER_CORE);
+  return ESP_OK;
+}
+
+bool recorder_arm(bool enable) {
+  armed = enable && log_partition != NULL;
+  return armed;
+}
+
+static void submit_page() {
+  memset(&pages[fill_page][fill_pos], 0xFF, RECORDER_PAGE_SIZE - fill_pos); // end-of-page marker
+  page_busy[fill_page] = true;
+  recorder_cmd_t cmd = { RECORDER_CMD_WRITE_PAGE, fill_page };
+  xQueueSend(cmd_queue, &cmd, portMAX_DELAY);
+  pages_queued++;
+
+  fill_page ^= 1;
+  fill_pos = 0;
+}
+
+bool recorder_begin() {
+  if (!armed) return false;
+
+  // Queued behind any pages the previous session still has in flight
+  recorder_cmd_t cmd = { RECORDER_CMD_BEGIN, 0 };
+  xQueueSend(cmd_queue, &cmd, portMAX_DELAY);
+
+  while (page_busy[0] || page_busy[1]) vTaskDelay(1);
+  fill_page = 0;
+  fill_pos = 0;
+  pages_queued = 0;
+  records_written = 0;
+  records_dropped = 0;
+  log_full = false;
+  return true;
+}
+
+bool recorder_append(const ble_batch_packet_t* packet) {
+  size_t length = IMU_BATCH_HEADER_SIZE + packet->payload_length;
+
+  if (fill_pos + 2 + length > RECORDER_PAGE_SIZE) {
+    // Keep the last sector free for the end-of-log marker
+    if ((pages_queued + 2) * RECORDER_PAGE_SIZE > log_partition->size) {
+      // Flash full: end the session, it may be running without any central to send "Stop"
+      records_dropped++;
+      if (!log_full) {
+        log_full = true;
+        ESP_LOGW(TAG, "Log partition full, stopping the recording");
+        session_request_stop();
+      }
+      return false;
+    }
+    if (page_busy[fill_page ^ 1]) {
+      records_dropped++; // still writing the other page
+      return false;
+    }
+    submit_page();
+  }
+
+  uint8_t* page = pages[fill_page];
+  page[fill_pos] = length & 0xFF;
+  page[fill_pos + 1] = length >> 8;
+  memcpy(&page[fill_pos + 2], packet, length);
+  fill_pos += 2 + length;
+  records_written++;
+  return true;
+}
+
+void recorder_end() {
+  if (fill_pos > 0) submit_page();
+  recorder_cmd_t cmd = { RECORDER_CMD_FINALIZE, 0 };
+  xQueueSend(cmd_queue, &cmd, portMAX_DELAY);
+}
+
+bool recorder_start_offload() {
+  if (log_partition == NULL || !session_begin_offload()) return false;
+  offload_abort = false;
+  recorder_cmd_t cmd = { RECORDER_CMD_OFFLOAD, 0 };
+  xQueueSend(cmd_queue, &cmd, portMAX_DELAY);
+  return true;
+}
+
+void recorder_abort_offload() {
+  offload_abort = true;
+}
+
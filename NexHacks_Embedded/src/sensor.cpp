@@ -3,85 +3,1331 @@
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "imu_packet.hpp"
+#include "packet_builder.hpp"
 #include "i2c_helper.h"
 #include "esp_timer.h"
 #include "esp_log.h"
 #include "BLE.hpp"
-
-#define DUAL_SENSOR 1
+#include "recorder.hpp"
+#include "calibration.hpp"
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "packet_ring.hpp"
+#include "session.hpp"
+#include "tasks.hpp"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+#include <atomic>
+#include <cstdio>
+#include <cstring>
 
 static const char* TAG = "IMU_SYSTEM";
-uint64_t session_start;
 
-void sensor_task(void *pvParameters) {
-  ble_packet_t packet_buffer;
+// Sensors in packet order: Sensor A (AD0 low) and Sensor B (AD0 high) wired to bus 0.
+// Hip + knee + ankle through a TCA9548A at I2C_MUX_ADDR (SENSOR_COUNT 4):
+//   {{0, 0, MPU_ADDR_A}, SENSOR_NO_INT},  // pelvis, mux channel 0
+//   {{0, 0, MPU_ADDR_B}, SENSOR_NO_INT},  // thigh
+//   {{0, 1, MPU_ADDR_A}, SENSOR_NO_INT},  // shank, mux channel 1
+//   {{0, 1, MPU_ADDR_B}, SENSOR_NO_INT},  // foot
+// or half of them on the LP I2C bus (bus 1, I2C_BUS_COUNT 2), which transfers in parallel with bus 0.
+// With SENSOR_USE_INT the first sensor's INT times the samples.
+static const sensor_slot_t sensor_slots[] = {
+  {{0, I2C_MUX_NONE, MPU_ADDR_A}, MPU_INT_A_IO},
+  {{0, I2C_MUX_NONE, MPU_ADDR_B}, MPU_INT_B_IO},
+};
 
-  // Wake up sensors
-  mpu6050_write_byte(MPU_ADDR_A, REG_PWR_MGMT_1, 0x00);
-  #if DUAL_SENSOR
-  mpu6050_write_byte(MPU_ADDR_B, REG_PWR_MGMT_1, 0x00);
+static_assert(sizeof(sensor_slots) / sizeof(sensor_slots[0]) == SENSOR_COUNT, "sensor_slots must list SENSOR_COUNT sensors");
+static_assert(SENSOR_COUNT >= 1 && SENSOR_COUNT <= SENSOR_MAX_COUNT, "unsupported SENSOR_COUNT");
+
+// Sample of every sensor as IMU_FORMAT_MULTI carries it, and the most a packet holds at the preferred MTU
+typedef imu_multi_sample_layout<SENSOR_COUNT> sensor_sample_layout;
+typedef imu_packet_layout<sensor_sample_layout,
+                          imu_layout_max_samples<sensor_sample_layout>(IMU_BATCH_MAX_PAYLOAD, IMU_MULTI_BASE_SIZE),
+                          IMU_BATCH_HEADER_SIZE + IMU_MULTI_BASE_SIZE> sensor_multi_packet_layout;
+static_assert(sensor_sample_layout::bytes == IMU_MULTI_SAMPLE_SIZE(SENSOR_COUNT), "multi sample size mismatch");
+static_assert(sensor_multi_packet_layout::samples >= 1, "one IMU_FORMAT_MULTI sample must fit a packet");
+static_assert(sensor_multi_packet_layout::bytes + ATT_NOTIFY_OVERHEAD <= CONFIG_BT_NIMBLE_ATT_PREFERRED_MTU,
+              "IMU_FORMAT_MULTI packets must fit the preferred MTU");
+
+const sensor_slot_t* sensor_slot(int index) {
+  return &sensor_slots[index];
+}
+
+// Capture -> processing hand-off, one slot per paired sample plus session markers
+#define RAW_SAMPLE          0
+#define RAW_SESSION_BEGIN   1
+#define RAW_SESSION_END     2
+#define RAW_RATE_CHANGE     3   // adaptive rate: the following samples run at the uint16 rate it carries
+
+typedef struct {
+  uint64_t sample_us;            // esp_timer time of the sample
+  uint32_t capture_cycles;       // cycle count at commit, for DIAG_STAGE_QUEUE_WAIT
+  uint8_t kind;                  // RAW_*
+  uint8_t imu[SENSOR_COUNT][IMU_SENSOR_BYTES]; // imu_sensor_block per sensor: accel XYZ + gyro XYZ, big endian register bytes
+} raw_sample_t;
+
+// Payload of the session start marker
+typedef struct __attribute__((packed)) {
+  imu_config_t config;
+  uint8_t adaptive;              // the session adapts its rate (SENSOR_ADAPTIVE_RATE)
+  uint8_t bench;                 // synthetic samples (SENSOR_USE_BENCH), config rate = the generator's
+  uint8_t bench_batch;           // samples per packet cap, 0 = none
+  uint16_t pretrigger_ms;        // the timeline starts this long before the start request
+} session_marker_t;
+
+static_assert(sizeof(session_marker_t) <= IMU_SENSOR_BYTES, "config must fit a session start marker");
+
+static SpscRing<raw_sample_t, SENSOR_RAW_RING_SLOTS> raw_ring;
+static TaskHandle_t process_task_handle;
+
+// Capture faults: counted in the hot loop, logged later by the processing task
+typedef struct {
+  std::atomic<uint32_t> i2c_error;
+  std::atomic<uint32_t> fifo_overflow;
+  std::atomic<uint32_t> int_timeout;
+  std::atomic<uint32_t> raw_ring_full;
+  std::atomic<uint32_t> loop_overrun;  // capture iterations that started late / missed a sample
+} capture_faults_t;
+
+// Plain copy of capture_faults, for the differences since a session start or the last log
+typedef struct {
+  uint32_t i2c_error;
+  uint32_t fifo_overflow;
+  uint32_t int_timeout;
+  uint32_t raw_ring_full;
+  uint32_t loop_overrun;
+} capture_fault_counts_t;
+
+static capture_faults_t capture_faults;
+static capture_fault_counts_t session_fault_base; // capture_faults at session start, for sensor_diag
+static uint32_t session_recovery_base;  // i2c_recovery_count() at session start
+static uint32_t bus_round_us;           // sensor_bus_selftest: one data read of every sensor
+
+static capture_fault_counts_t capture_faults_snapshot() {
+  capture_fault_counts_t counts;
+  counts.i2c_error = capture_faults.i2c_error.load();
+  counts.fifo_overflow = capture_faults.fifo_overflow.load();
+  counts.int_timeout = capture_faults.int_timeout.load();
+  counts.raw_ring_full = capture_faults.raw_ring_full.load();
+  counts.loop_overrun = capture_faults.loop_overrun.load();
+  return counts;
+}
+
+// int_timeout has no diag_report_t field, report_capture_faults logs it
+void sensor_diag(diag_report_t* report) {
+  capture_fault_counts_t now = capture_faults_snapshot();
+  report->i2c_errors = now.i2c_error - session_fault_base.i2c_error;
+  report->fifo_overflows = now.fifo_overflow - session_fault_base.fifo_overflow;
+  report->raw_ring_full = now.raw_ring_full - session_fault_base.raw_ring_full;
+  report->loop_overruns = now.loop_overrun - session_fault_base.loop_overrun;
+  report->raw_ring_high_water = raw_ring.high_water();
+  report->i2c_khz = i2c_get_speed() / 1000;
+  report->i2c_round_us = bus_round_us > UINT16_MAX ? UINT16_MAX : bus_round_us;
+  report->i2c_recoveries = i2c_recovery_count() - session_recovery_base;
+}
+
+// Acquisition config. active_config belongs to sensor_task and only changes between sessions;
+// it reaches the processing task inside the session start marker (session_config).
+static imu_config_t active_config = {SENSOR_SAMPLE_RATE_HZ, SENSOR_DLPF_CFG, SENSOR_GYRO_FS, SENSOR_ACCEL_FS};
+static imu_config_t pending_config;
+static bool config_pending = false;
+static portMUX_TYPE config_mux = portMUX_INITIALIZER_UNLOCKED;
+static imu_config_t session_config = active_config;
+
+// Polling without data-ready interrupts is paced by the FreeRTOS tick
+#if SENSOR_USE_FIFO || SENSOR_USE_INT
+#define CAPTURE_RATE_MAX_HZ SENSOR_RATE_MAX_HZ
+#else
+#define CAPTURE_RATE_MAX_HZ configTICK_RATE_HZ
+#endif
+
+static uint8_t rate_smplrt_div(uint16_t rate_hz) {
+  return (uint8_t)(1000 / rate_hz - 1); // DLPF on: 1kHz gyro output rate
+}
+
+static uint32_t rate_period_us(uint16_t rate_hz) {
+  return (rate_smplrt_div(rate_hz) + 1) * 1000;
+}
+
+static uint8_t config_smplrt_div(const imu_config_t* config) {
+  return rate_smplrt_div(config->sample_rate_hz);
+}
+
+static uint32_t config_period_us(const imu_config_t* config) {
+  return rate_period_us(config->sample_rate_hz);
+}
+
+bool sensor_set_config(const imu_config_t* config) {
+  if (config->sample_rate_hz < SENSOR_RATE_MIN_HZ || config->sample_rate_hz > CAPTURE_RATE_MAX_HZ ||
+      config->dlpf_cfg < 1 || config->dlpf_cfg > 6 || config->gyro_fs > 3 || config->accel_fs > 3) {
+    return false;
+  }
+
+  imu_config_t rounded = *config;
+  rounded.sample_rate_hz = 1000 / (config_smplrt_div(config) + 1);
+
+  portENTER_CRITICAL(&config_mux);
+  pending_config = rounded;
+  config_pending = true;
+  portEXIT_CRITICAL(&config_mux);
+  if (!session_capturing()) session_wake_capture(); // applied right away while the sensors are kept warm
+  return true;
+}
+
+static bool config_waiting() {
+  portENTER_CRITICAL(&config_mux);
+  bool waiting = config_pending;
+  portEXIT_CRITICAL(&config_mux);
+  return waiting;
+}
+
+// sensor_task: adopt the config queued since the last session, true if there was one
+static bool take_pending_config() {
+  portENTER_CRITICAL(&config_mux);
+  bool reconfigure = config_pending;
+  if (reconfigure) active_config = pending_config;
+  config_pending = false;
+  portEXIT_CRITICAL(&config_mux);
+  return reconfigure;
+}
+
+void sensor_get_config(imu_config_t* config) {
+  portENTER_CRITICAL(&config_mux);
+  *config = config_pending ? pending_config : active_config;
+  portEXIT_CRITICAL(&config_mux);
+}
+
+// Rate the sensors run at, sensor_task only. active_config's rate except in adaptive sessions.
+static uint16_t capture_rate_hz = SENSOR_SAMPLE_RATE_HZ;
+
+#if SENSOR_ADAPTIVE_RATE
+#define ADAPTIVE_REST       0
+#define ADAPTIVE_MOTION     1   // the configured rate
+#define ADAPTIVE_FAST       2
+#define ADAPTIVE_LEVELS     3
+
+static_assert(imu_rate_code(SENSOR_ADAPTIVE_REST_HZ) != 0 && imu_rate_code(SENSOR_ADAPTIVE_FAST_HZ) != 0,
+              "adaptive rates must have a rate code");
+
+static std::atomic<bool> adaptive_enabled{false};              // "Adaptive:<0|1>", latched at session start
+static std::atomic<uint8_t> adaptive_request{ADAPTIVE_MOTION}; // processing task -> sensor_task
+// sensor_task: the running session's levels and the one the sensors are at
+static bool adaptive_session = false;
+static uint8_t adaptive_level = ADAPTIVE_MOTION;
+static uint16_t adaptive_rate_hz[ADAPTIVE_LEVELS];
+static uint8_t adaptive_dlpf_cfg[ADAPTIVE_LEVELS];
+#endif
+
+#if SENSOR_USE_BENCH
+static_assert(SENSOR_BENCH_MAX_HZ * FIFO_DRAIN_PERIOD_MS / 1000 < SENSOR_RAW_RING_SLOTS,
+              "one benchmark round must fit the raw ring");
+
+// Armed by the BLE host task right before it requests the session, taken by sensor_task
+static std::atomic<bool> bench_armed{false};
+static uint32_t bench_rate_hz;
+static uint8_t bench_batch;
+static uint32_t bench_seconds;
+static bool bench_session = false;  // sensor_task: the session being started is a benchmark
+#endif
+
+bool sensor_arm_bench(uint32_t rate_hz, uint32_t batch, uint32_t seconds) {
+  #if SENSOR_USE_BENCH
+  if (rate_hz == 0) {
+    bench_armed = false;
+    return true;
+  }
+  if (rate_hz > SENSOR_BENCH_MAX_HZ || batch > UINT8_MAX || seconds < 1 || seconds > SENSOR_BENCH_MAX_SECONDS) {
+    return false;
+  }
+  bench_rate_hz = rate_hz;
+  bench_batch = batch;
+  bench_seconds = seconds;
+  bench_armed = true; // the parameters reach sensor_task with the flag
+  return true;
+  #else
+  return rate_hz == 0;
   #endif
-  
-  // Optional: Configure Range (e.g., +/- 2000 deg/s) here if needed
+}
 
-  const TickType_t xFrequency = pdMS_TO_TICKS(10); // 10ms = 100Hz
-      
-  uint8_t raw_data[14];
+bool sensor_set_adaptive(bool enable) {
+  #if SENSOR_ADAPTIVE_RATE
+  adaptive_enabled = enable;
+  return true;
+  #else
+  return !enable;
+  #endif
+}
 
-  while (1) {
-    int sample_index = 0;
-    uint32_t sequence_counter = 0;
-
-    // Block until semaphore is given
-    xSemaphoreTake(sensor_run_semaphore, portMAX_DELAY);
-    
-    // Give it back immediately so BLE can take it to stop
-    xSemaphoreGive(sensor_run_semaphore);
-    
-    // Reset timing reference when starting
-    TickType_t xLastWakeTime = xTaskGetTickCount();
-    
-    // Running state - tight loop with precise timing
-    while (uxSemaphoreGetCount(sensor_run_semaphore) > 0) {
-      vTaskDelayUntil(&xLastWakeTime, xFrequency);
-    
-      uint64_t now_us = esp_timer_get_time();
-
-      // 1. Read Sensor A and copy to packet buffer
-      esp_err_t retA = mpu6050_read_burst(MPU_ADDR_A, REG_ACCEL_XOUT_H, raw_data, 14);
-
-      memcpy(packet_buffer.samples[sample_index].acc_A, &raw_data[0], 6);
-      memcpy(packet_buffer.samples[sample_index].gyro_A, &raw_data[8], 6);
-                                          
-      // 2. Read Sensor B and copy to packet buffer
-      #if DUAL_SENSOR
-      esp_err_t retB = mpu6050_read_burst(MPU_ADDR_B, REG_ACCEL_XOUT_H, raw_data, 14);
-      #else
-      esp_err_t retB = mpu6050_read_burst(MPU_ADDR_A, REG_ACCEL_XOUT_H, raw_data, 14);
+#if SENSOR_USE_INT
+static TaskHandle_t sensor_task_handle;
+static portMUX_TYPE int_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t int_bits_all = 0;                                     // one bit per sensor with INT wired
+static volatile uint32_t int_count[SENSOR_COUNT];                     // data-ready edges since last reset
+static volatile uint64_t int_ts_ring[SENSOR_COUNT][INT_TS_RING_SIZE]; // esp_timer time of each edge
+static volatile uint32_t int_batch = 1;                               // FIFO mode: edges per task wake-up
+static volatile bool int_armed = false;                               // wake the task only while capturing
+
+// Data-ready ISR, arg is the sensor index.
+// Timestamps the edge and wakes the sensor task once a sample (or a FIFO batch) is ready.
+static void IRAM_ATTR mpu_int_isr(void* arg) {
+  uint32_t sensor = (uint32_t)(uintptr_t)arg;
+  uint64_t now_us = esp_timer_get_time();
+
+  portENTER_CRITICAL_ISR(&int_mux);
+  uint32_t n = int_count[sensor];
+  int_ts_ring[sensor][n % INT_TS_RING_SIZE] = now_us;
+  int_count[sensor] = n + 1;
+  portEXIT_CRITICAL_ISR(&int_mux);
+
+  if (!int_armed) return; // warm sensors between sessions keep interrupting
+  #if SENSOR_USE_FIFO
+  if (((n + 1) % int_batch) != 0) return;
+  #endif
+
+  BaseType_t woken = pdFALSE;
+  xTaskNotifyFromISR(sensor_task_handle, 1u << sensor, eSetBits, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+/**
+ * @brief Route data-ready to the INT pin and attach the GPIO interrupt for one sensor
+ */
+static esp_err_t mpu6050_int_setup(const sensor_slot_t* slot, uint32_t sensor) {
+  if (slot->int_io == SENSOR_NO_INT) return sensor == 0 ? ESP_ERR_INVALID_ARG : ESP_OK;
+
+  esp_err_t ret = i2c_write_byte(&slot->target, REG_INT_PIN_CFG, INT_PIN_CFG_RD_CLEAR);
+  if (ret == ESP_OK) ret = i2c_write_byte(&slot->target, REG_INT_ENABLE, INT_ENABLE_DATA_RDY);
+  if (ret != ESP_OK) return ret;
+
+  gpio_num_t pin = (gpio_num_t)slot->int_io;
+  gpio_config_t io_conf = {
+    .pin_bit_mask = 1ULL << pin,
+    .mode = GPIO_MODE_INPUT,
+    .pull_up_en = GPIO_PULLUP_DISABLE,
+    .pull_down_en = GPIO_PULLDOWN_ENABLE,
+    .intr_type = GPIO_INTR_POSEDGE,
+  };
+  ret = gpio_config(&io_conf);
+  if (ret == ESP_OK) ret = gpio_isr_handler_add(pin, mpu_int_isr, (void*)(uintptr_t)sensor);
+  if (ret == ESP_OK) int_bits_all |= 1u << sensor;
+  return ret;
+}
+
+static void int_counters_reset() {
+  portENTER_CRITICAL(&int_mux);
+  for (int s = 0; s < SENSOR_COUNT; s++) int_count[s] = 0;
+  portEXIT_CRITICAL(&int_mux);
+  xTaskNotifyWait(0, UINT32_MAX, NULL, 0); // drop stale notifications
+}
+
+// Block until every sensor with INT wired has signalled since the last call. Returns false on
+// timeout (counted) or right away when the session changes (SESSION_NOTIFY_BIT).
+static bool wait_for_data() {
+  uint32_t pending = 0;
+  while ((pending & int_bits_all) != int_bits_all) {
+    uint32_t bits = 0;
+    if (xTaskNotifyWait(0, UINT32_MAX, &bits, pdMS_TO_TICKS(INT_WAIT_TIMEOUT_MS)) != pdTRUE) {
+      capture_faults.int_timeout++;
+      return false;
+    }
+    if (bits & SESSION_NOTIFY_BIT) return false;
+    pending |= bits;
+  }
+  return true;
+}
+
+static uint64_t int_timestamp(uint32_t sensor, uint32_t index) {
+  return int_ts_ring[sensor][index % INT_TS_RING_SIZE];
+}
+#endif
+
+static packet_builder_t builder;
+static bool recording = false; // this session goes to flash instead of the ring
+static bool calibrating = false; // this session is a stationary capture, nothing is packed
+
+// Packet sink for the builder: the BLE ring while streaming, the flash recorder while recording
+static ble_batch_packet_t* sink_acquire(void* ctx) {
+  return recording ? nullptr : ble_ring.acquire();
+}
+
+static void sink_publish(void* ctx, ble_batch_packet_t* packet, bool dropped) {
+  // Publish the slot to the BLE task. Recording builds in scratch and copies to flash.
+  if (recording) {
+    recorder_append(packet);
+  } else if (!dropped) {
+    ble_ring.commit();
+    if (BLE_manager_task_handle != NULL) xTaskNotifyGive(BLE_manager_task_handle);
+  } else {
+    ble_tx_stats.drop_ring_full++;
+  }
+}
+
+static uint8_t sink_format(void* ctx) {
+  return ble_packet_format();
+}
+
+static size_t sink_payload_capacity(void* ctx) {
+  return ble_payload_capacity();
+}
+
+static const packet_sink_t ble_sink = {sink_acquire, sink_publish, sink_format, sink_payload_capacity, nullptr};
+
+// Capture between sessions goes to the pre-trigger ring, overwriting the oldest sample.
+// sensor_task only.
+static_assert((SENSOR_PRETRIGGER_SLOTS & (SENSOR_PRETRIGGER_SLOTS - 1)) == 0, "SENSOR_PRETRIGGER_SLOTS must be a power of two");
+static raw_sample_t pretrigger_ring[SENSOR_PRETRIGGER_SLOTS];
+static uint32_t pretrigger_count = 0;  // samples written since the capture loop started
+static std::atomic<bool> pretrigger_enabled{false}; // "Pretrigger:<0|1>", sampling between sessions
+static bool capture_live = false;      // samples go to the processing task (a session is running)
+
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t session_pm_lock;
+#endif
+
+// Hot path: store one sample of every sensor for the processing task, dropped if it is behind.
+// raw_bytes[s] is the block of sensor s as read, laid out as Src (data registers or FIFO frame).
+template <typename Src>
+static void capture_sample(uint64_t sample_us, const uint8_t* const* raw_bytes) {
+  raw_sample_t* raw;
+  if (capture_live) {
+    raw = raw_ring.acquire();
+    if (raw == nullptr) {
+      capture_faults.raw_ring_full++;
+      return;
+    }
+  } else {
+    raw = &pretrigger_ring[pretrigger_count++ % SENSOR_PRETRIGGER_SLOTS];
+  }
+  raw->sample_us = sample_us;
+  raw->capture_cycles = diag_now();
+  raw->kind = RAW_SAMPLE;
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    imu_layout_copy<imu_sensor_block, Src>(raw->imu[s], raw_bytes[s]);
+  }
+  if (capture_live) raw_ring.commit();
+}
+
+static void capture_notify() {
+  if (capture_live) xTaskNotifyGive(process_task_handle);
+}
+
+// Session boundaries must not be lost, wait for the processing task to make room.
+// data (up to IMU_SENSOR_BYTES) travels in the sample bytes of the marker.
+static void capture_marker(uint8_t kind, const void* data, size_t length) {
+  raw_sample_t* raw;
+  while ((raw = raw_ring.acquire()) == nullptr) {
+    capture_notify();
+    vTaskDelay(1);
+  }
+  raw->sample_us = esp_timer_get_time();
+  raw->kind = kind;
+  if (length > 0) memcpy(raw->imu[0], data, length);
+  raw_ring.commit();
+  capture_notify();
+}
+
+// Keep sampling between sessions (sensors warm and no config waiting to be applied)
+static bool pretrigger_wanted() {
+  return SENSOR_PRETRIGGER_MS > 0 && pretrigger_enabled && session_prewarm() && !config_waiting();
+}
+
+bool sensor_set_pretrigger(bool enable) {
+  if (SENSOR_PRETRIGGER_MS == 0 && enable) return false;
+  if (pretrigger_enabled.exchange(enable) != enable) session_wake_capture();
+  return true;
+}
+
+/**
+ * @brief Hand a slot of the raw ring to the processing task, waiting for room like the markers
+ */
+static void capture_replay(const raw_sample_t* sample) {
+  raw_sample_t* raw;
+  while ((raw = raw_ring.acquire()) == nullptr) {
+    capture_notify();
+    vTaskDelay(1);
+  }
+  *raw = *sample;
+  raw->capture_cycles = diag_now(); // queue wait counts from the replay, not the capture
+  raw_ring.commit();
+}
+
+// Capture timing (and the data-ready batch) follows a new sensor rate
+static void capture_set_rate(uint16_t rate_hz) {
+  capture_rate_hz = rate_hz;
+  #if SENSOR_USE_INT
+  uint32_t batch = rate_hz * FIFO_INT_PERIOD_MS / 1000;
+  int_batch = batch > 0 ? batch : 1;
+  #endif
+}
+
+#if SENSOR_ADAPTIVE_RATE
+/**
+ * @brief Widest DLPF_CFG that still keeps the gyro bandwidth under half the sample rate
+ */
+static uint8_t dlpf_for_rate(uint16_t rate_hz) {
+  static const uint16_t bandwidth_hz[] = {0, 188, 98, 42, 20, 10, 5}; // gyro bandwidth per DLPF_CFG
+  uint8_t cfg = 1;
+  while (cfg < 6 && bandwidth_hz[cfg] > rate_hz / 2) cfg++;
+  return cfg;
+}
+
+// Levels of the armed session around its configured rate. The other levels never filter less
+// at rest or more during fast movements than the configured DLPF does.
+static void adaptive_plan() {
+  uint16_t rate = active_config.sample_rate_hz;
+  uint8_t dlpf = active_config.dlpf_cfg;
+  uint16_t rest = SENSOR_ADAPTIVE_REST_HZ < rate ? SENSOR_ADAPTIVE_REST_HZ : rate;
+  uint16_t fast = SENSOR_ADAPTIVE_FAST_HZ < CAPTURE_RATE_MAX_HZ ? SENSOR_ADAPTIVE_FAST_HZ : CAPTURE_RATE_MAX_HZ;
+  if (fast < rate) fast = rate;
+  uint8_t rest_dlpf = dlpf_for_rate(rest);
+  uint8_t fast_dlpf = dlpf_for_rate(fast);
+
+  adaptive_rate_hz[ADAPTIVE_REST] = rest;
+  adaptive_rate_hz[ADAPTIVE_MOTION] = rate;
+  adaptive_rate_hz[ADAPTIVE_FAST] = fast;
+  adaptive_dlpf_cfg[ADAPTIVE_REST] = rest == rate || rest_dlpf < dlpf ? dlpf : rest_dlpf;
+  adaptive_dlpf_cfg[ADAPTIVE_MOTION] = dlpf;
+  adaptive_dlpf_cfg[ADAPTIVE_FAST] = fast == rate || fast_dlpf > dlpf ? dlpf : fast_dlpf;
+}
+
+/**
+ * @brief Retune sample rate divider and DLPF of every sensor, ranges and FIFO setup stay
+ */
+static void sensors_set_rate(uint16_t rate_hz, uint8_t dlpf_cfg) {
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    const i2c_target_t* target = &sensor_slots[s].target;
+    esp_err_t ret = i2c_write_byte(target, REG_CONFIG, dlpf_cfg);
+    if (ret == ESP_OK) ret = i2c_write_byte(target, REG_SMPLRT_DIV, rate_smplrt_div(rate_hz));
+    if (ret != ESP_OK) capture_faults.i2c_error++;
+  }
+  capture_set_rate(rate_hz);
+}
+#endif
+
+// sensor_task, between capture rounds: move the sensors to the level the processing task asks
+// for. True if they now run at another rate; the capture loop then restarts its sample timing.
+static bool capture_adapt() {
+  #if SENSOR_ADAPTIVE_RATE
+  if (!adaptive_session) return false;
+  uint8_t level = adaptive_request.load();
+  if (level == adaptive_level) return false;
+
+  bool retune = adaptive_rate_hz[level] != adaptive_rate_hz[adaptive_level] ||
+                adaptive_dlpf_cfg[level] != adaptive_dlpf_cfg[adaptive_level];
+  adaptive_level = level;
+  if (!retune) return false; // levels collapsed onto the configured rate
+
+  uint16_t rate = adaptive_rate_hz[level];
+  sensors_set_rate(rate, adaptive_dlpf_cfg[level]);
+  // In order with the samples, so the processing task closes the packet at the switch
+  capture_marker(RAW_RATE_CHANGE, &rate, sizeof(rate));
+  return true;
+  #else
+  return false;
+  #endif
+}
+
+static void capture_end() {
+  capture_marker(RAW_SESSION_END, nullptr, 0);
+  capture_live = false;
+  #if SENSOR_ADAPTIVE_RATE
+  // Pre-trigger samples and the next session start at the configured rate
+  if (adaptive_session && adaptive_level != ADAPTIVE_MOTION) {
+    sensors_set_rate(active_config.sample_rate_hz, active_config.dlpf_cfg);
+  }
+  adaptive_session = false;
+  #endif
+  #if CONFIG_PM_ENABLE
+  esp_pm_lock_release(session_pm_lock);
+  #endif
+}
+
+// The armed session starts with this capture round. Pre-trigger samples are replayed first and
+// the session timeline moves back to the oldest of them, the live samples follow seamlessly.
+static void capture_begin() {
+  #if CONFIG_PM_ENABLE
+  esp_pm_lock_acquire(session_pm_lock);
+  #endif
+  session_fault_base = capture_faults_snapshot();
+  session_recovery_base = i2c_recovery_count();
+  raw_ring.reset_stats();
+
+  uint32_t replay = 0;
+  if (session_pretrigger()) {
+    replay = active_config.sample_rate_hz * SENSOR_PRETRIGGER_MS / 1000;
+    if (replay > SENSOR_PRETRIGGER_SLOTS) replay = SENSOR_PRETRIGGER_SLOTS;
+    if (replay > pretrigger_count) replay = pretrigger_count;
+  }
+  uint32_t first = pretrigger_count - replay;
+  uint64_t requested_us = session_start_requested_us();
+  uint64_t timeline_us = requested_us;
+  if (replay > 0) {
+    uint64_t oldest_us = pretrigger_ring[first % SENSOR_PRETRIGGER_SLOTS].sample_us;
+    if (oldest_us < timeline_us) timeline_us = oldest_us;
+  }
+
+  // A stop while arming ends the session before it has a sample
+  bool running = session_enter_running(timeline_us);
+  if (!running) replay = 0;
+
+  session_marker_t marker = {active_config, 0, 0, 0, (uint16_t)((requested_us - timeline_us) / 1000)};
+  #if SENSOR_USE_BENCH
+  if (bench_session) {
+    marker.config.sample_rate_hz = bench_rate_hz;
+    marker.bench = 1;
+    marker.bench_batch = bench_batch;
+  }
+  #endif
+  #if SENSOR_ADAPTIVE_RATE
+  adaptive_session = running && !marker.bench && adaptive_enabled.load();
+  if (adaptive_session) adaptive_plan();
+  adaptive_level = ADAPTIVE_MOTION;
+  adaptive_request = ADAPTIVE_MOTION;
+  marker.adaptive = adaptive_session;
+  #endif
+
+  capture_live = true;
+  capture_marker(RAW_SESSION_BEGIN, &marker, sizeof(marker));
+  for (uint32_t i = first; i < pretrigger_count; i++) {
+    capture_replay(&pretrigger_ring[i % SENSOR_PRETRIGGER_SLOTS]);
+  }
+  capture_notify();
+  pretrigger_count = 0;
+
+  if (!running) capture_end();
+}
+
+// sensor_task, once per capture round: start the armed session, and tell the capture loop
+// whether to go on. Ends it after the round that saw the session stop, or once sampling
+// between sessions is no longer wanted.
+static bool capture_follow_session() {
+  if (capture_live) return session_capturing();
+  #if SENSOR_USE_BENCH
+  if (bench_armed) return false; // a benchmark replaces the capture loop, sensor_task starts it
+  #endif
+  if (session_state() == SESSION_ARMING) capture_begin();
+  return capture_live || pretrigger_wanted();
+}
+
+/**
+ * @brief Configure clock source, DLPF, sample rate divider and full-scale ranges on one MPU6050
+ */
+static esp_err_t mpu6050_config_apply(const i2c_target_t* target, const imu_config_t* config) {
+  esp_err_t ret = i2c_write_byte(target, REG_PWR_MGMT_1, PWR_MGMT_1_CLK_PLL_XGYRO);
+  if (ret == ESP_OK) ret = i2c_write_byte(target, REG_CONFIG, config->dlpf_cfg);
+  if (ret == ESP_OK) ret = i2c_write_byte(target, REG_SMPLRT_DIV, config_smplrt_div(config));
+  if (ret == ESP_OK) ret = i2c_write_byte(target, REG_GYRO_CONFIG, config->gyro_fs << GYRO_CONFIG_FS_SEL_SHIFT);
+  if (ret == ESP_OK) ret = i2c_write_byte(target, REG_ACCEL_CONFIG, config->accel_fs << ACCEL_CONFIG_AFS_SEL_SHIFT);
+  return ret;
+}
+
+static void sensors_apply_config() {
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    if (mpu6050_config_apply(&sensor_slots[s].target, &active_config) != ESP_OK) {
+      ESP_LOGE(TAG, "Config failed on Sensor %c", 'A' + s);
+    }
+  }
+
+  capture_set_rate(active_config.sample_rate_hz);
+  ESP_LOGI(TAG, "Sampling %d sensors at %u Hz, DLPF %u, gyro FS %u, accel FS %u", SENSOR_COUNT,
+           active_config.sample_rate_hz, active_config.dlpf_cfg, active_config.gyro_fs, active_config.accel_fs);
+}
+
+// Between sessions the MPU6050s sit in sleep mode (a few uA instead of ~4mA each).
+// Registers, including the config, are kept.
+static void sensors_sleep() {
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    i2c_write_byte(&sensor_slots[s].target, REG_PWR_MGMT_1, PWR_MGMT_1_SLEEP | PWR_MGMT_1_CLK_PLL_XGYRO);
+  }
+}
+
+static void sensors_wake() {
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    i2c_write_byte(&sensor_slots[s].target, REG_PWR_MGMT_1, PWR_MGMT_1_CLK_PLL_XGYRO);
+  }
+  vTaskDelay(pdMS_TO_TICKS(SENSOR_WAKE_SETTLE_MS));
+}
+
+#if SENSOR_USE_FIFO
+/**
+ * @brief Enable the FIFO (accel + gyro) on one MPU6050
+ */
+static esp_err_t mpu6050_fifo_setup(const i2c_target_t* target) {
+  return i2c_write_byte(target, REG_FIFO_EN, FIFO_EN_SAMPLE);
+}
+
+/**
+ * @brief Flush the FIFO and start filling it again from the next sample
+ */
+static esp_err_t mpu6050_fifo_reset(const i2c_target_t* target) {
+  esp_err_t ret = i2c_write_byte(target, REG_USER_CTRL, USER_CTRL_FIFO_RESET);
+  if (ret == ESP_OK) ret = i2c_write_byte(target, REG_USER_CTRL, USER_CTRL_FIFO_EN);
+  return ret;
+}
+
+/**
+ * @brief Queue the FIFO_COUNT read of one sensor (2 bytes into regs)
+ */
+static esp_err_t mpu6050_fifo_status_async(const i2c_target_t* target, uint8_t* regs) {
+  return i2c_read_burst_async(target, REG_FIFO_COUNTH, regs, 2);
+}
+
+/**
+ * @brief Number of complete samples waiting in the FIFO, -1 on overflow
+ */
+static int fifo_samples(const uint8_t* regs) {
+  int bytes = (regs[0] << 8) | regs[1];
+  if (bytes >= FIFO_OVERFLOW_BYTES) return -1; // (about to be) overwritten, frame alignment is lost
+  return bytes / FIFO_SAMPLE_BYTES;
+}
+
+static esp_err_t fifo_reset_all() {
+  esp_err_t ret = ESP_OK;
+  for (int s = 0; s < SENSOR_COUNT && ret == ESP_OK; s++) {
+    ret = mpu6050_fifo_reset(&sensor_slots[s].target);
+  }
+  #if SENSOR_USE_INT
+  // The next data-ready edge is the first sample written to the fresh FIFO
+  int_counters_reset();
+  #endif
+  return ret;
+}
+
+// Drain every FIFO in large bursts until the session stops (or sampling between sessions ends).
+// Samples are matched by index and timestamped from the first sensor's sample clock
+// (or from its data-ready ISR timestamps when SENSOR_USE_INT is set).
+// Each round queues the transactions of all sensors (on all buses) before waiting once.
+static void run_fifo() {
+  static uint8_t fifo[SENSOR_COUNT][FIFO_DRAIN_MAX_SAMPLES * FIFO_SAMPLE_BYTES];
+
+  fifo_reset_all();
+  #if !SENSOR_USE_INT
+  uint64_t clock_start_us = esp_timer_get_time();
+  #endif
+  uint64_t sample_clock = 0; // samples of the first sensor since the FIFO reset
+  #if !SENSOR_USE_INT
+  uint32_t period_us = rate_period_us(capture_rate_hz);
+  #endif
+
+  bool looped = false;
+  uint32_t loop_start = 0;
+  // Once the session stops, one last round drains what the FIFOs hold up to the stop
+  bool stopping = false;
+
+  #if SENSOR_USE_INT
+  while (!stopping) {
+    if (looped) diag_record_since(DIAG_STAGE_CAPTURE_LOOP, loop_start);
+    bool ready = wait_for_data();
+    stopping = !capture_follow_session();
+    if (!ready && !stopping) {
+      looped = false;
+      continue;
+    }
+  #else
+  const TickType_t xFrequency = pdMS_TO_TICKS(FIFO_DRAIN_PERIOD_MS);
+  TickType_t xLastWakeTime = xTaskGetTickCount();
+
+  while (!stopping) {
+    if (looped) diag_record_since(DIAG_STAGE_CAPTURE_LOOP, loop_start);
+    if (xTaskDelayUntil(&xLastWakeTime, xFrequency) == pdFALSE) capture_faults.loop_overrun++;
+    stopping = !capture_follow_session();
+  #endif
+    loop_start = diag_now();
+    looped = true;
+
+    // Status of every sensor in one queued batch
+    uint32_t i2c_start = diag_now();
+    uint8_t status[SENSOR_COUNT][2];
+    esp_err_t ret = ESP_OK;
+    for (int s = 0; s < SENSOR_COUNT && ret == ESP_OK; s++) {
+      ret = mpu6050_fifo_status_async(&sensor_slots[s].target, status[s]);
+    }
+    esp_err_t wait_ret = i2c_wait_all();
+    if (ret == ESP_OK) ret = wait_ret;
+    diag_record_since(DIAG_STAGE_I2C, i2c_start);
+
+    int count[SENSOR_COUNT];
+    int min_count = FIFO_SIZE_BYTES;
+    bool restart = (ret != ESP_OK);
+    for (int s = 0; s < SENSOR_COUNT && !restart; s++) {
+      count[s] = fifo_samples(status[s]);
+      if (count[s] < 0) restart = true;
+      else if (count[s] < min_count) min_count = count[s];
+    }
+
+    if (restart) {
+      // Overflow or bus error: restart every FIFO so they stay sample-aligned
+      if (ret != ESP_OK) capture_faults.i2c_error++;
+      else capture_faults.fifo_overflow++;
+      fifo_reset_all();
+      #if !SENSOR_USE_INT
+      clock_start_us = esp_timer_get_time();
       #endif
+      sample_clock = 0;
+      continue;
+    }
+
+    // Every sensor runs off its own oscillator. Discard from the ones running ahead of the
+    // slowest once the skew gets large so matched samples stay within a few sample periods.
+    bool discarded = false;
+    for (int s = 0; s < SENSOR_COUNT && ret == ESP_OK; s++) {
+      if (count[s] - min_count > FIFO_MAX_SKEW_SAMPLES) {
+        ret = i2c_read_burst_async(&sensor_slots[s].target, REG_FIFO_R_W, fifo[s], FIFO_SAMPLE_BYTES);
+        count[s]--;
+        if (s == 0) sample_clock++;
+        discarded = true;
+      }
+    }
+    if (discarded) {
+      wait_ret = i2c_wait_all();
+      if (ret == ESP_OK) ret = wait_ret;
+      if (ret != ESP_OK) {
+        capture_faults.i2c_error++;
+        continue;
+      }
+    }
+
+    int pending = min_count;
+
+    while (pending > 0) {
+      int n = pending > FIFO_DRAIN_MAX_SAMPLES ? FIFO_DRAIN_MAX_SAMPLES : pending;
+      size_t len = n * FIFO_SAMPLE_BYTES;
+
+      // Queue all bursts back to back, the buses run them while we wait
+      i2c_start = diag_now();
+      for (int s = 0; s < SENSOR_COUNT && ret == ESP_OK; s++) {
+        ret = i2c_read_burst_async(&sensor_slots[s].target, REG_FIFO_R_W, fifo[s], len);
+      }
+      wait_ret = i2c_wait_all();
+      if (ret == ESP_OK) ret = wait_ret;
+      diag_record_since(DIAG_STAGE_I2C, i2c_start);
+
+      if (ret != ESP_OK) {
+        capture_faults.i2c_error++;
+        break;
+      }
+
+      for (int i = 0; i < n; i++) {
+        const uint8_t* raw[SENSOR_COUNT];
+        for (int s = 0; s < SENSOR_COUNT; s++) raw[s] = &fifo[s][i * FIFO_SAMPLE_BYTES];
+        #if SENSOR_USE_INT
+        uint64_t sample_us = int_timestamp(0, (uint32_t)sample_clock);
+        #else
+        uint64_t sample_us = clock_start_us + sample_clock * period_us;
+        #endif
+        sample_clock++;
+
+        capture_sample<sensor_fifo_layout>(sample_us, raw);
+      }
+      capture_notify();
+      pending -= n;
+    }
+
+    // A new rate starts from empty FIFOs, dropping what arrived since the status read
+    if (!stopping && capture_adapt()) {
+      fifo_reset_all();
+      #if !SENSOR_USE_INT
+      clock_start_us = esp_timer_get_time();
+      period_us = rate_period_us(capture_rate_hz);
+      #endif
+      sample_clock = 0;
+    }
+  }
+}
+#endif
+
+// Read the data registers of every sensor once per FreeRTOS tick (or data-ready edge) until the
+// session stops (or sampling between sessions ends).
+static void run_polled() {
+  uint8_t data[SENSOR_COUNT][imu_register_layout::bytes];
+  const uint8_t* raw[SENSOR_COUNT];
+  for (int s = 0; s < SENSOR_COUNT; s++) raw[s] = data[s];
+
+  bool looped = false;
+  uint32_t loop_start = 0;
+
+  #if SENSOR_USE_INT
+  int_counters_reset();
+  uint32_t last_edge = 0;
+
+  while (capture_follow_session()) {
+    if (looped) diag_record_since(DIAG_STAGE_CAPTURE_LOOP, loop_start);
+    if (!wait_for_data()) {
+      looped = false;
+      continue;
+    }
+
+    // Time of the most recent edge of the first sensor, captured in the ISR
+    uint32_t edge = int_count[0];
+    uint64_t now_us = int_timestamp(0, edge - 1);
+    if (last_edge != 0 && edge - last_edge > 1) capture_faults.loop_overrun += edge - last_edge - 1;
+    last_edge = edge;
+  #else
+  TickType_t xFrequency = pdMS_TO_TICKS(1000 / capture_rate_hz);
+  if (xFrequency == 0) xFrequency = 1;
+
+  // Reset timing reference when starting
+  TickType_t xLastWakeTime = xTaskGetTickCount();
+
+  // Running state - tight loop with precise timing
+  while (capture_follow_session()) {
+    if (looped) diag_record_since(DIAG_STAGE_CAPTURE_LOOP, loop_start);
+    if (xTaskDelayUntil(&xLastWakeTime, xFrequency) == pdFALSE) capture_faults.loop_overrun++;
+
+    uint64_t now_us = esp_timer_get_time();
+  #endif
+    loop_start = diag_now();
+    looped = true;
+
+    // 1. Queue every sensor back to back. One read of every data register (TEMP_OUT included) is cheaper
+    // than separate accel and gyro reads: the extra address phase costs more than 2 bytes.
+    uint32_t i2c_start = diag_now();
+    esp_err_t ret = ESP_OK;
+    for (int s = 0; s < SENSOR_COUNT && ret == ESP_OK; s++) {
+      ret = i2c_read_burst_async(&sensor_slots[s].target, REG_ACCEL_XOUT_H, data[s], imu_register_layout::bytes);
+    }
+
+    // 2. Wait for all transfers
+    esp_err_t wait_ret = i2c_wait_all();
+    if (ret == ESP_OK) ret = wait_ret;
+    diag_record_since(DIAG_STAGE_I2C, i2c_start);
+
+    if (ret == ESP_OK) {
+      capture_sample<imu_register_layout>(now_us, raw); // TEMP_OUT is dropped here
+      capture_notify();
+    } else {
+      capture_faults.i2c_error++;
+    }
+
+    if (capture_adapt()) {
+      #if !SENSOR_USE_INT
+      xFrequency = pdMS_TO_TICKS(1000 / capture_rate_hz);
+      if (xFrequency == 0) xFrequency = 1;
+      #endif
+    }
+  }
+}
+
+#if SENSOR_USE_BENCH
+/**
+ * @brief Register bytes of benchmark sample index, generated since_start_us into the session
+ */
+static void bench_block(uint8_t* block, uint64_t since_start_us, uint32_t index) {
+  for (int i = 0; i < 6; i++) block[i] = (uint8_t)(since_start_us >> (40 - 8 * i));
+  for (int i = 0; i < 4; i++) block[6 + i] = (uint8_t)(index >> (24 - 8 * i));
+  block[10] = 0;
+  block[11] = 0;
+}
+
+// Benchmark session in place of the capture loop. Every FIFO_DRAIN_PERIOD_MS it generates the
+// samples due on an exact synthetic clock, and it stops the session after the armed duration.
+static void run_bench() {
+  bench_session = true;
+  capture_begin();
+  bench_session = false;
+
+  uint8_t block[IMU_SENSOR_BYTES];
+  const uint8_t* raw[SENSOR_COUNT];
+  for (int s = 0; s < SENSOR_COUNT; s++) raw[s] = block;
+
+  const uint64_t total = (uint64_t)bench_rate_hz * bench_seconds;
+  const uint64_t start_us = esp_timer_get_time();
+  const uint64_t timeline_us = session_timeline_us();
+  uint64_t generated = 0;
+  bool looped = false;
+  uint32_t loop_start = 0;
+  const TickType_t xFrequency = pdMS_TO_TICKS(FIFO_DRAIN_PERIOD_MS);
+  TickType_t xLastWakeTime = xTaskGetTickCount();
+
+  while (capture_live && session_capturing()) {
+    if (looped) diag_record_since(DIAG_STAGE_CAPTURE_LOOP, loop_start);
+    if (xTaskDelayUntil(&xLastWakeTime, xFrequency) == pdFALSE) capture_faults.loop_overrun++;
+    loop_start = diag_now();
+    looped = true;
+
+    uint64_t due = (esp_timer_get_time() - start_us) * bench_rate_hz / 1000000 + 1;
+    if (due > total) due = total;
+    for (; generated < due; generated++) {
+      uint64_t sample_us = start_us + generated * 1000000 / bench_rate_hz;
+      bench_block(block, sample_us - timeline_us, (uint32_t)generated);
+      capture_sample<imu_sensor_block>(sample_us, raw);
+    }
+    capture_notify();
+    if (generated >= total) session_request_stop(); // the loop ends at its next check
+  }
+  if (capture_live) capture_end();
+}
+#endif
+
+/**
+ * @brief Queue one data register read of every sensor and wait, the bus time of a polled sample
+ */
+static esp_err_t bus_read_round(uint8_t (*data)[imu_register_layout::bytes]) {
+  esp_err_t ret = ESP_OK;
+  for (int s = 0; s < SENSOR_COUNT && ret == ESP_OK; s++) {
+    ret = i2c_read_burst_async(&sensor_slots[s].target, REG_ACCEL_XOUT_H, data[s], imu_register_layout::bytes);
+  }
+  esp_err_t wait_ret = i2c_wait_all();
+  return ret == ESP_OK ? wait_ret : ret;
+}
+
+#if I2C_FAST_MODE_PLUS
+/**
+ * @brief Rounds of WHO_AM_I and data reads at the current clock, false on any error or mismatch
+ */
+static bool bus_probe(const uint8_t* who_am_i) {
+  uint8_t data[SENSOR_COUNT][imu_register_layout::bytes];
+  for (int i = 0; i < SENSOR_BUS_PROBE_ROUNDS; i++) {
+    for (int s = 0; s < SENSOR_COUNT; s++) {
+      uint8_t id = 0;
+      if (i2c_read_burst(&sensor_slots[s].target, REG_WHO_AM_I, &id, 1) != ESP_OK) return false;
+      if (id != who_am_i[s]) return false;
+    }
+    if (bus_read_round(data) != ESP_OK) return false;
+  }
+  return true;
+}
+#endif
+
+void sensor_bus_selftest() {
+  #if I2C_FAST_MODE_PLUS
+  // Reference values at the rated 400kHz, then the same registers must read back identically at 1MHz
+  uint8_t who_am_i[SENSOR_COUNT];
+  bool reference_ok = true;
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    if (i2c_read_burst(&sensor_slots[s].target, REG_WHO_AM_I, &who_am_i[s], 1) != ESP_OK) reference_ok = false;
+  }
+  if (reference_ok) {
+    i2c_set_speed(I2C_FAST_PLUS_FREQ_HZ);
+    if (!bus_probe(who_am_i)) {
+      ESP_LOGW(TAG, "I2C unreliable at %d kHz, staying at %d kHz", I2C_FAST_PLUS_FREQ_HZ / 1000, I2C_MASTER_FREQ_HZ / 1000);
+      i2c_set_speed(I2C_MASTER_FREQ_HZ);
+    }
+  }
+  #endif
+
+  uint8_t data[SENSOR_COUNT][imu_register_layout::bytes];
+  uint64_t total_us = 0;
+  int rounds = 0;
+  for (int i = 0; i < SENSOR_BUS_MEASURE_ROUNDS; i++) {
+    uint64_t start_us = esp_timer_get_time();
+    if (bus_read_round(data) != ESP_OK) continue;
+    total_us += esp_timer_get_time() - start_us;
+    rounds++;
+  }
+  if (rounds == 0) {
+    ESP_LOGE(TAG, "I2C measurement failed, every read round errored");
+    return;
+  }
+  bus_round_us = total_us / rounds;
+
+  uint32_t period_us = config_period_us(&active_config);
+  ESP_LOGI(TAG, "I2C at %lu kHz: %lu us to read %d sensors, %lu%% of the %lu us sample period",
+           (unsigned long)(i2c_get_speed() / 1000), (unsigned long)bus_round_us, SENSOR_COUNT,
+           (unsigned long)(bus_round_us * 100 / period_us), (unsigned long)period_us);
+}
 
-      memcpy(packet_buffer.samples[sample_index].acc_B, &raw_data[0], 6);
-      memcpy(packet_buffer.samples[sample_index].gyro_B, &raw_data[8], 6);
-
-      if (retA == ESP_OK && retB == ESP_OK) {
-        // Calculate time offset in ms
-        packet_buffer.samples[sample_index].time_offset = (uint16_t)((now_us - session_start) / 1000);
-        
-        sample_index++;
-
-        // 3. Buffer Full? Push to Queue.
-        if (sample_index >= 3) {
-          packet_buffer.seq_id = sequence_counter++;
-          
-          // Send copy of packet to BLE task
-          // timeout=0 means "don't block if queue is full, just drop it" (real-time preference)
-          xQueueSend(ble_queue, &packet_buffer, 0);
-          
-          sample_index = 0; // Reset
+#if SENSOR_USE_EVENTS
+static imu_event_detector_t event_detector;
+
+// Rep detection on the relative rate of sensors A and B (A alone in single-sensor builds).
+// Runs every streamed session, the events go out while the app asks for them.
+static void detect_events(uint64_t since_start_us, const raw_sample_t* raw) {
+  #if SENSOR_COUNT > 1
+  const uint8_t* block_B = raw->imu[1];
+  #else
+  const uint8_t* block_B = nullptr;
+  #endif
+  imu_event_t event;
+  if (!imu_event_detector_push(&event_detector, since_start_us, raw->imu[0], block_B, &event)) return;
+  if (ble_event_mode() != IMU_EVENTS_OFF && !ble_send_event(&event)) {
+    ESP_LOGW(TAG, "Event queue full, event %u dropped", event.seq);
+  }
+}
+#endif
+
+#if SENSOR_ADAPTIVE_RATE
+// Processing side of the adaptive rate: the level sensor_task should run at, from the peak gyro
+// rate per SENSOR_ADAPTIVE_WINDOW_MS
+typedef struct {
+  bool enabled;                 // this session adapts its rate
+  uint32_t motion_sq;           // SENSOR_ADAPTIVE_MOTION_DPS / _FAST_DPS as squared gyro counts
+  uint32_t fast_sq;
+  uint8_t level;                // ADAPTIVE_* last asked for
+  uint8_t window_level;         // highest level a sample of the current window reached
+  uint8_t quiet_windows;        // windows in a row below level
+  uint64_t window_start_us;
+} adaptive_monitor_t;
+
+static adaptive_monitor_t adaptive_monitor;
+
+static void adaptive_monitor_begin(bool enabled, uint8_t gyro_fs) {
+  adaptive_monitor_t* m = &adaptive_monitor;
+  memset(m, 0, sizeof(*m));
+  m->enabled = enabled;
+  m->level = ADAPTIVE_MOTION;
+  float lsb_per_dps = FUSION_GYRO_LSB_PER_DPS / (float)(1 << gyro_fs);
+  uint32_t motion = (uint32_t)(SENSOR_ADAPTIVE_MOTION_DPS * lsb_per_dps);
+  uint32_t fast = (uint32_t)(SENSOR_ADAPTIVE_FAST_DPS * lsb_per_dps);
+  m->motion_sq = motion * motion;
+  m->fast_sq = fast * fast;
+}
+
+// Gyro magnitude of the fastest sensor against the thresholds, once per (calibrated) sample
+static void adaptive_watch(uint64_t since_start_us, const raw_sample_t* raw) {
+  adaptive_monitor_t* m = &adaptive_monitor;
+  if (!m->enabled) return;
+
+  uint32_t peak_sq = 0;
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    const uint8_t* gyro = raw->imu[s] + imu_sensor_block::offset(IMU_CHANNEL_GYRO);
+    uint32_t sq = 0;
+    for (int i = 0; i < 3; i++) {
+      int32_t g = packet_builder_be16(&gyro[i * 2]);
+      sq += (uint32_t)(g * g);
+    }
+    if (sq > peak_sq) peak_sq = sq;
+  }
+  uint8_t level = peak_sq >= m->fast_sq ? ADAPTIVE_FAST : peak_sq >= m->motion_sq ? ADAPTIVE_MOTION : ADAPTIVE_REST;
+  if (level > m->window_level) m->window_level = level;
+
+  // Faster right away, a movement must not wait for the window to be undersampled
+  if (level > m->level) {
+    m->level = level;
+    m->quiet_windows = 0;
+    adaptive_request = level;
+  }
+
+  if (since_start_us - m->window_start_us < SENSOR_ADAPTIVE_WINDOW_MS * 1000ULL) return;
+  // Slower one level at a time, after a run of quiet windows
+  if (m->window_level >= m->level) {
+    m->quiet_windows = 0;
+  } else if (++m->quiet_windows >= SENSOR_ADAPTIVE_HOLD_WINDOWS) {
+    m->level--;
+    m->quiet_windows = 0;
+    adaptive_request = m->level;
+  }
+  m->window_level = ADAPTIVE_REST;
+  m->window_start_us = since_start_us;
+}
+#endif
+
+// Benchmark session (SENSOR_USE_BENCH) in the processing task: samples go out as generated
+static bool benchmarking = false;
+static uint32_t bench_samples;
+static uint64_t session_timeline;      // session_timeline_us() of the session, time 0 of its samples
+static uint64_t bench_first_us;
+static uint64_t bench_last_us;
+
+static void session_begin(const raw_sample_t* marker) {
+  session_marker_t start;
+  memcpy(&start, marker->imu[0], sizeof(start));
+  session_config = start.config;
+  session_timeline = session_timeline_us(); // published before the marker
+  packet_builder_begin(&builder, &session_config, SENSOR_BATCH_MAX_LATENCY_MS);
+  benchmarking = start.bench;
+  bench_samples = 0;
+  if (benchmarking && start.bench_batch > 0) packet_builder_limit_batch(&builder, start.bench_batch);
+  #if SENSOR_USE_EVENTS
+  imu_event_detector_begin(&event_detector, session_config.gyro_fs);
+  #endif
+
+  ble_ring.reset_stats();
+  calibrating = calibration_begin(&session_config);
+  recording = !calibrating && recorder_begin();
+  #if SENSOR_ADAPTIVE_RATE
+  adaptive_monitor_begin(start.adaptive && !calibrating, session_config.gyro_fs); // a calibration stays at its rate
+  #endif
+  if (session_pretrigger()) {
+    // "Start"/"Record": the app's time 0 was its command, tell it how much earlier ours is
+    char reply[24];
+    snprintf(reply, sizeof(reply), "Pretriggered:%u", (unsigned)start.pretrigger_ms);
+    ble_send_status(reply);
+  }
+  ESP_LOGI(TAG, "Session started %lu us after the request", (unsigned long)session_start_latency_us());
+}
+
+// The partly filled packet goes out (or to flash) before the session is declared drained
+static void session_end() {
+  packet_builder_finish(&builder);
+  if (benchmarking) {
+    ble_bench_done(bench_samples, builder.sequence, (uint32_t)((bench_last_us - bench_first_us) / 1000));
+    benchmarking = false;
+  }
+  if (recording) recorder_end();
+  calibration_end();
+  recording = false;
+  calibrating = false;
+  session_drained();
+}
+
+// Log what the capture loop counted since the last report, at most every SENSOR_LOG_INTERVAL_MS
+static void report_capture_faults() {
+  static capture_fault_counts_t reported;
+  capture_fault_counts_t now = capture_faults_snapshot();
+  if (memcmp(&now, &reported, sizeof(now)) == 0) return;
+
+  ESP_LOGE(TAG, "Capture faults: I2C %lu, FIFO overflow %lu, no data-ready %lu, processing behind %lu, overruns %lu",
+           now.i2c_error - reported.i2c_error, now.fifo_overflow - reported.fifo_overflow,
+           now.int_timeout - reported.int_timeout, now.raw_ring_full - reported.raw_ring_full,
+           now.loop_overrun - reported.loop_overrun);
+  if (now.int_timeout != reported.int_timeout) ESP_LOGE(TAG, "No data-ready interrupt, check INT wiring");
+  reported = now;
+}
+
+// Cold path: byte order, fusion, encoding and batching for everything sensor_task captured
+static void sensor_process_task(void *pvParameters) {
+  diag_register_task(DIAG_TASK_PROCESS);
+  packet_builder_init(&builder, &ble_sink, SENSOR_COUNT);
+  TickType_t last_report = xTaskGetTickCount();
+
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SENSOR_LOG_INTERVAL_MS));
+
+    raw_sample_t* raw;
+    while ((raw = raw_ring.peek()) != nullptr) {
+      if (raw->kind == RAW_SESSION_BEGIN) {
+        session_begin(raw);
+      } else if (raw->kind == RAW_SESSION_END) {
+        session_end();
+      } else if (raw->kind == RAW_RATE_CHANGE) {
+        uint16_t rate_hz;
+        memcpy(&rate_hz, raw->imu[0], sizeof(rate_hz));
+        packet_builder_set_rate(&builder, rate_hz);
+        ESP_LOGD(TAG, "Sampling at %u Hz", rate_hz);
+      } else {
+        diag_record_since(DIAG_STAGE_QUEUE_WAIT, raw->capture_cycles);
+        uint32_t pack_start = diag_now();
+        uint64_t since_start_us = raw->sample_us > session_timeline ? raw->sample_us - session_timeline : 0;
+        if (benchmarking) {
+          // Untouched, the bytes carry generation time and index for the host
+          if (bench_samples++ == 0) bench_first_us = since_start_us;
+          bench_last_us = since_start_us;
+          packet_builder_push(&builder, raw->sample_us, since_start_us, &raw->imu[0][0]);
+        } else if (calibrating) {
+          // Raw samples only; once the capture is stored, stop the session like "Stop" would
+          if (calibration_add(&raw->imu[0][0], since_start_us)) {
+            calibrating = false;
+            session_request_stop();
+          }
+        } else {
+          for (int s = 0; s < SENSOR_COUNT; s++) calibration_apply(s, raw->imu[s]);
+          #if SENSOR_ADAPTIVE_RATE
+          adaptive_watch(since_start_us, raw);
+          #endif
+          #if SENSOR_USE_EVENTS
+          detect_events(since_start_us, raw);
+          bool pack = recording || ble_event_mode() != IMU_EVENTS_ONLY; // "Record" always logs raw data
+          #else
+          bool pack = true;
+          #endif
+          if (pack) packet_builder_push(&builder, raw->sample_us, since_start_us, &raw->imu[0][0]);
         }
+        diag_record_since(DIAG_STAGE_PACK, pack_start);
+      }
+      raw_ring.release();
+    }
+
+    if (xTaskGetTickCount() - last_report >= pdMS_TO_TICKS(SENSOR_LOG_INTERVAL_MS)) {
+      report_capture_faults();
+      last_report = xTaskGetTickCount();
+    }
+  }
+}
+
+void sensor_task(void *pvParameters) {
+  diag_register_task(DIAG_TASK_CAPTURE);
+  xTaskCreatePinnedToCore(sensor_process_task, "SensorProc", TASK_PROCESS_STACK, NULL,
+                          TASK_PROCESS_PRIORITY, &process_task_handle, TASK_PROCESS_CORE);
+
+  #if CONFIG_PM_ENABLE
+  // Full CPU clock and no light sleep while a session runs, so capture timing stays deterministic
+  esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "sensor", &session_pm_lock);
+  #endif
+
+  // Wake up sensors
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    i2c_write_byte(&sensor_slots[s].target, REG_PWR_MGMT_1, 0x00);
+  }
+
+  sensors_apply_config();
+
+  #if SENSOR_USE_FIFO
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    if (mpu6050_fifo_setup(&sensor_slots[s].target) != ESP_OK) {
+      ESP_LOGE(TAG, "FIFO setup failed on Sensor %c", 'A' + s);
+    }
+  }
+  #endif
+
+  session_attach_capture_task(xTaskGetCurrentTaskHandle());
+
+  #if SENSOR_USE_INT
+  sensor_task_handle = xTaskGetCurrentTaskHandle();
+  gpio_install_isr_service(0);
+  for (int s = 0; s < SENSOR_COUNT; s++) {
+    if (mpu6050_int_setup(&sensor_slots[s], s) != ESP_OK) {
+      ESP_LOGE(TAG, "INT setup failed on Sensor %c", 'A' + s);
+    }
+  }
+  #endif
+
+  sensors_sleep(); // until a central connects or the first "Start"
+  bool awake = false;
+
+  while (1) {
+    // Idle. While a central is connected the sensors stay awake and configured, so a start
+    // only resets the FIFOs and takes the first sample instead of waiting for the gyro PLL,
+    // and with pre-trigger sampling enabled ("Pretrigger:1") they fill the pre-trigger ring.
+    while (session_state() != SESSION_ARMING && !pretrigger_wanted()) {
+      bool warm = session_prewarm();
+      if (warm != awake) {
+        if (warm) sensors_wake();
+        else sensors_sleep();
+        awake = warm;
+      } else if (awake && take_pending_config()) {
+        sensors_apply_config();
       } else {
-        ESP_LOGE(TAG, "I2C Read Failed");
-      } // End of running loop
+        xTaskNotifyWait(0, UINT32_MAX, NULL, portMAX_DELAY);
+      }
+    }
+
+    #if SENSOR_USE_BENCH
+    // A benchmark does without the sensors, they stay as they are
+    if (session_state() == SESSION_ARMING && bench_armed.exchange(false)) {
+      run_bench();
+      continue;
+    }
+    #endif
+
+    if (!awake) sensors_wake(); // cold start, nobody connected before the command
+    awake = true;
+
+    // A config written since the last session takes effect here, never mid-session
+    if (take_pending_config()) sensors_apply_config();
+
+    // Pre-trigger sampling until a session arms, then the session (capture_follow_session)
+    #if SENSOR_USE_INT
+    int_armed = true;
+    #endif
+
+    #if SENSOR_USE_FIFO
+    run_fifo();
+    #else
+    run_polled();
+    #endif
+
+    #if SENSOR_USE_INT
+    int_armed = false;
+    #endif
+
+    if (capture_live) capture_end();
+    pretrigger_count = 0; // a later loop must not replay samples from before this gap
+
+    if (!session_prewarm()) {
+      sensors_sleep();
+      awake = false;
     }
   } // End of outer loop
-}
\ No newline at end of file
+}
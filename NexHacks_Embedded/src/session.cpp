@@ -0,0 +1,95 @@
+#include "session.hpp"
+#include "esp_timer.h"
+#include <atomic>
+
+static std::atomic<uint8_t> state{SESSION_IDLE};
+static std::atomic<bool> prewarm{false};
+static std::atomic<bool> pretrigger{false};
+static std::atomic<int64_t> start_requested_us{0};
+static std::atomic<uint32_t> start_latency_us{0};
+static std::atomic<uint64_t> timeline_us{0};
+static TaskHandle_t capture_task = NULL;
+
+/**
+ * @brief Move from one state to another, false if the state was no longer `from`
+ */
+static bool transition(session_state_t from, session_state_t to) {
+  uint8_t expected = from;
+  return state.compare_exchange_strong(expected, to);
+}
+
+void session_wake_capture() {
+  if (capture_task != NULL) xTaskNotify(capture_task, SESSION_NOTIFY_BIT, eSetBits);
+}
+
+void session_attach_capture_task(TaskHandle_t task) {
+  capture_task = task;
+}
+
+session_state_t session_state() {
+  return (session_state_t)state.load();
+}
+
+bool session_request_start(bool with_pretrigger) {
+  if (session_state() != SESSION_IDLE) return false;
+  start_requested_us = esp_timer_get_time();
+  pretrigger = with_pretrigger;
+  if (!transition(SESSION_IDLE, SESSION_ARMING)) return false;
+  session_wake_capture();
+  return true;
+}
+
+bool session_request_stop() {
+  if (!transition(SESSION_RUNNING, SESSION_DRAINING) && !transition(SESSION_ARMING, SESSION_DRAINING)) {
+    return false;
+  }
+  session_wake_capture(); // out of a data-ready wait, it ends the session at the next sample
+  return true;
+}
+
+bool session_enter_running(uint64_t timeline) {
+  timeline_us = timeline;
+  if (!transition(SESSION_ARMING, SESSION_RUNNING)) return false;
+  start_latency_us = (uint32_t)(esp_timer_get_time() - start_requested_us.load());
+  return true;
+}
+
+bool session_capturing() {
+  return state.load() == SESSION_RUNNING;
+}
+
+bool session_pretrigger() {
+  return pretrigger;
+}
+
+void session_drained() {
+  transition(SESSION_DRAINING, SESSION_IDLE);
+}
+
+uint32_t session_start_latency_us() {
+  return start_latency_us;
+}
+
+int64_t session_start_requested_us() {
+  return start_requested_us;
+}
+
+uint64_t session_timeline_us() {
+  return timeline_us;
+}
+
+bool session_begin_offload() {
+  return transition(SESSION_IDLE, SESSION_OFFLOADING);
+}
+
+void session_end_offload() {
+  transition(SESSION_OFFLOADING, SESSION_IDLE);
+}
+
+void session_set_prewarm(bool enable) {
+  if (prewarm.exchange(enable) != enable) session_wake_capture();
+}
+
+bool session_prewarm() {
+  return prewarm;
+}